@@ -10,24 +10,33 @@ using namespace otalib::app;
 int main(int argc, char *argv[]) {
   QCoreApplication a(argc, argv);
   QCommandLineOption op_update("u");
+  QCommandLineOption op_rollback("r");
   QCommandLineOption op_ver("v");
   QCommandLineOption op_app_ver_test("t");
+  // "-v -s": hash every file, ignoring the hash cache.
+  QCommandLineOption op_strict("s");
 
   QCommandLineParser parser;
   parser.addOption(op_update);
+  parser.addOption(op_rollback);
   parser.addOption(op_ver);
   parser.addOption(op_app_ver_test);
+  parser.addOption(op_strict);
 
   parser.process(a);
 
   bool op_update_set = parser.isSet(op_update);
+  bool op_rollback_set = parser.isSet(op_rollback);
   bool op_ver_set = parser.isSet(op_ver);
   bool op_app_ver_test_set = parser.isSet(op_app_ver_test);
 
-  if (op_update_set) {
+  if (op_update_set || op_rollback_set) {
     printf("\n");
+    // "-r": roll back the last update locally.
+    QStringList args;
+    if (op_rollback_set) args << "-r";
     QProcess update_process;
-    if (!update_process.startDetached(kUpdateModule)) {
+    if (!update_process.startDetached(kUpdateModule, args)) {
       print<GeneralFerrorCtrl>(::std::cerr, "Cannot execute update program.");
     }
     a.exit();
@@ -47,7 +56,10 @@ int main(int argc, char *argv[]) {
     info += "app version: " + app.app_version_ + "\n";
     info += "app hash: " +
             QString::fromStdString(
-                FileLogger::GetHashFromLogFile(kFileLogPath).to_string()) +
+                FileLogger::GetHashFromLogFile(kFileLogPath, "",
+                                               parser.isSet(op_strict),
+                                               app.hash_chunk_size_)
+                    .to_string()) +
             "\n";
     print<GeneralInfoCtrl>(::std::cout, info);
   }
@@ -16,6 +16,7 @@ class AppError : public ::std::exception {
     index_network_send_fail = 2,
     index_network_recv_fail = 3,
     index_update_response_corrupt = 4,
+    index_no_local_rollback = 5,
   };
 
  private:
@@ -43,6 +44,9 @@ class AppError : public ::std::exception {
             "Failed to parse the response from the server, file might be "
             "corrupted.";
         break;
+      case index_no_local_rollback:
+        msg_ = "There's no update to roll back locally.";
+        break;
     }
   }
 
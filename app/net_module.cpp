@@ -18,6 +18,22 @@ bool NetModule::Recv() {
   return error_ == SSL_ERROR_ZERO_RETURN;
 }
 
+bool NetModule::Recv(
+    const ::std::function<void(const char*, size_t)>& consumer) {
+  socket_.setProgressCb(
+      [&consumer](const char* data, DataSize, DataSize chunk_size) {
+        consumer(data, chunk_size);
+      });
+  try {
+    error_ = socket_.recv(false);
+  } catch (...) {
+    socket_.setProgressCb(nullptr);
+    throw;
+  }
+  socket_.setProgressCb(nullptr);
+  return error_ == SSL_ERROR_ZERO_RETURN;
+}
+
 QByteArray NetModule::GetData() {
   //
   QByteArray data(socket_.recver()->peek(), socket_.recver()->readable());
@@ -24,6 +24,9 @@ class NetModule {
 
   bool Recv();
 
+  // Hand the data to "consumer" as it arrives, nothing is kept.
+  bool Recv(const ::std::function<void(const char*, size_t)>& consumer);
+
   QByteArray GetData();
 
   inline bool Error() const noexcept { return error_ != 0; }
@@ -21,7 +21,12 @@ static inline const quint16 kPort = 5555;
 static inline const quint32 kTimeOut = 30;  // second
 // temporary directory
 static inline const QString kOtaTmpDir = "/tmp/ota_demo/";
-static inline const QString kOtaTmpFile = kOtaTmpDir + "tmpfile.tar.gz";
+// local undo journal, 0 cap turns it off.
+static inline const QString kOtaJournalDir = "/var/tmp/ota_demo/journal/";
+static inline const quint64 kOtaJournalCap = 256 * 1024 * 1024;  // bytes
+// received packs kept for reuse, 0 cap turns it off.
+static inline const QString kOtaPackCacheDir = "/var/tmp/ota_demo/packs/";
+static inline const quint64 kOtaPackCacheCap = 64 * 1024 * 1024;  // bytes
 // public key file for verifying signature.
 static inline const QString kPubkeyFile = "pubkey";
 
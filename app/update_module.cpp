@@ -50,6 +50,25 @@ void TipsOutput(const RequestResponse<AppVersionType>& response) {
       return;
   }
 }
+
+// Removes the slot staged for an update unless it was switched to, so a slot
+// patched halfway is never left behind as if it were a version.
+class StagedSlotGuard {
+ public:
+  explicit StagedSlotGuard(const ::std::optional<SlotLayout>& layout)
+      : layout_(layout) {}
+  ~StagedSlotGuard() {
+    if (layout_ && !committed_) layout_->discard();
+  }
+  StagedSlotGuard(const StagedSlotGuard&) = delete;
+  StagedSlotGuard& operator=(const StagedSlotGuard&) = delete;
+
+  void committed() noexcept { committed_ = true; }
+
+ private:
+  const ::std::optional<SlotLayout>& layout_;
+  bool committed_ = false;
+};
 }  // namespace
 UpdateModule::UpdateModule() noexcept : net_() {
   //
@@ -130,31 +149,74 @@ bool UpdateModule::doUpdate(const RequestResponse<AppVersionType>& response) {
     }
   }
 
-  QJsonDocument jdoc = MakeConfirm(response);
+  // Tell the server the packs kept from the previous updates.
+  PackCache cache(QDir(kOtaPackCacheDir), kOtaPackCacheCap);
+  Property pp = ReadProperty();
+  QJsonDocument jdoc =
+      MakeConfirm(response, cache.list(), pp.app_name_, pp.app_type_);
   if (!net_.Send(jdoc.toJson())) {
     net_.Close();
     throw AppError(AppError::index_network_send_fail);
   }
 
-  if (!net_.Recv()) {
+  // Installed in A/B slots, patch the inactive slot and switch to it at the
+  // end. Otherwise patch the app in place.
+  auto layout = SlotLayout::detect(QDir::current());
+  QDir app_root = QDir::current();
+  StagedSlotGuard guard(layout);
+  if (layout) {
+    layout->stage();
+    app_root = layout->inactive();
+  }
+
+  // Keep the undo journal for the in-place update. Slots don't need it, the
+  // previous version stays in the other slot.
+  UndoJournal journal(QDir(kOtaJournalDir), kOtaJournalCap);
+  if (!layout)
+    journal.begin(::std::get<2>(response).toString(),
+                  ::std::get<3>(response).toString());
+
+  // The packs are applied while the rest are still being received.
+  PackStreamApplier applier(app_root, QDir(kOtaTmpDir),
+                            QFileInfo(kPubkeyFile), true,
+                            layout ? nullptr : &journal, &cache);
+  if (!net_.Recv([&applier](const char* data, size_t size) {
+        applier.feed(data, size);
+      })) {
     net_.Close();
     throw AppError(AppError::index_network_recv_fail);
   }
 
-  QByteArray data = net_.GetData();
-  QFile archive(kOtaTmpFile);
-  if (!archive.open(QFile::WriteOnly | QFile::Truncate))
-    throw OTAError::S_file_open_fail{kOtaTmpFile, STRING_SOURCE_LOCATION};
+  // Under the safe mode the root of the app is checked after each pack, the
+  // last check is the one of the whole slot against the destination version,
+  // so the slot is complete and verified before the switch.
+  applier.finish();
+  if (layout) {
+    layout->commit();
+    guard.committed();
+  }
+  return true;
+}
 
-  if (archive.write(data) != data.size())
-    throw OTAError::S_file_write_fail{kOtaTmpFile, STRING_SOURCE_LOCATION};
+void UpdateModule::TryLocalRollback() {
+  // Installed in slots, the previous version is the other slot. It's taken
+  // only if an update has switched from it, a slot staged by an update that
+  // failed holds a tree patched halfway.
+  auto layout = SlotLayout::detect(QDir::current());
+  if (layout && layout->inactiveReady() &&
+      layout->inactive().exists(kPropertyName)) {
+    Property pp = ReadProperty(layout->inactive().filePath(kPropertyName));
+    layout->commit();
+    print<GeneralSuccessCtrl>(
+        ::std::cout, "Switched back to version [" + pp.app_version_ + "].");
+    return;
+  }
 
-  archive.close();
-  tar_extract_archive_file_gzip(kOtaTmpFile, kOtaTmpDir);
-  QFile::remove(kOtaTmpFile);
-  applyPackOnApp<AppVersionType>(QDir::current(), QDir(kOtaTmpDir),
-                                 QFileInfo(kPubkeyFile), true);
-  return true;
+  UndoJournal journal(QDir(kOtaJournalDir), kOtaJournalCap);
+  if (!journal.usable()) throw AppError(AppError::index_no_local_rollback);
+  QString version = journal.rollback(QDir::current());
+  print<GeneralSuccessCtrl>(::std::cout,
+                            "Rolled back to version [" + version + "].");
 }
 
 }  // namespace otalib::app
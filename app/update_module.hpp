@@ -6,6 +6,7 @@
 
 #include "../otalib/pack_apply.hpp"
 #include "../otalib/shell_cmd.hpp"
+#include "../otalib/slot_install.hpp"
 #include "../otalib/update_strategy.hpp"
 #include "../otalib/version.hpp"
 #include "app_error.hpp"
@@ -22,6 +23,9 @@ class UpdateModule {
 
   void TryUpdate();
 
+  // Roll back the last update without the server.
+  void TryLocalRollback();
+
  private:
   bool doUpdate(const RequestResponse<AppVersionType>& response);
 };
@@ -16,6 +16,11 @@ SOURCES += \
         otalib/diff.cpp \
         otalib/signature.cpp \
         otalib/ssl_socket_client.cpp \
+        otalib/sha256_accel.cpp \
+        otalib/file_manifest.cpp \
+        otalib/vermap_index.cpp \
+        otalib/tar_archive.cpp \
+        otalib/undo_journal.cpp \
         server/src/InetAddress.cc \
         server/src/SSL.cc \
         server/src/ServerSocket.cc \
@@ -23,6 +28,7 @@ SOURCES += \
         server/src/TcpServer.cc \
         server/src/TimerQueue.cc \
         server/src/server.cpp \
+        server/src/shard.cpp \
         server_main.cpp
 
 # Default rules for deployment.
@@ -36,6 +42,7 @@ HEADERS += \
     otalib/buffer.hpp \
     otalib/delta_log.h \
     otalib/diff.h \
+    otalib/dir_copy.hpp \
     otalib/file_logger.h \
     otalib/logger/logger.h \
     otalib/sha256_hash.h \
@@ -44,7 +51,18 @@ HEADERS += \
     otalib/pack_apply.hpp \
     otalib/shell_cmd.hpp \
     otalib/signature.h \
+    otalib/hash_cache.hpp \
+    otalib/merkle_snapshot.hpp \
+    otalib/merkle_proof.hpp \
+    otalib/route_manifest.hpp \
+    otalib/pack_cache.hpp \
+    otalib/slot_install.hpp \
     otalib/ssl_socket_client.hpp \
+    otalib/sha256_accel.h \
+    otalib/file_manifest.h \
+    otalib/vermap_index.h \
+    otalib/tar_archive.h \
+    otalib/undo_journal.h \
     otalib/update_strategy.hpp \
     otalib/utils.hpp \
     otalib/vcm.hpp \
@@ -61,9 +79,10 @@ HEADERS += \
     server/include/TimerHeap.h \
     server/include/TimerQueue.h \
     server/include/server.h \
+    server/include/shard.h \
     server/include/timestamp.h \
 
-LIBS += -lssl -lcrypto -lpthread
+LIBS += -lssl -lcrypto -lpthread -lz
 
 TEMPLATE = app
 TARGET = bin/otaserver
@@ -19,7 +19,12 @@ SOURCES += \
         otalib/delta_log.cpp \
         otalib/diff.cpp \
         otalib/signature.cpp \
-        otalib/ssl_socket_client.cpp
+        otalib/ssl_socket_client.cpp \
+        otalib/sha256_accel.cpp \
+        otalib/file_manifest.cpp \
+        otalib/vermap_index.cpp \
+        otalib/tar_archive.cpp \
+        otalib/undo_journal.cpp
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
@@ -41,6 +46,7 @@ HEADERS += \
   otalib/buffer.hpp \
   otalib/delta_log.h \
   otalib/diff.h \
+  otalib/dir_copy.hpp \
   otalib/file_logger.h \
   otalib/logger/logger.h \
   otalib/logger/logger_color.h \
@@ -53,13 +59,24 @@ HEADERS += \
   otalib/sha256_hash.h \
   otalib/shell_cmd.hpp \
   otalib/signature.h \
+  otalib/hash_cache.hpp \
+  otalib/merkle_snapshot.hpp \
+  otalib/merkle_proof.hpp \
+  otalib/route_manifest.hpp \
+  otalib/pack_cache.hpp \
+  otalib/slot_install.hpp \
   otalib/ssl_socket_client.hpp \
+  otalib/sha256_accel.h \
+  otalib/file_manifest.h \
+  otalib/vermap_index.h \
+  otalib/tar_archive.h \
+  otalib/undo_journal.h \
   otalib/update_strategy.hpp \
   otalib/utils.hpp \
   otalib/vcm.hpp \
   otalib/version.hpp
 
-LIBS += -lssl -lcrypto -lpthread
+LIBS += -lssl -lcrypto -lpthread -lz
 
 TEMPLATE = app
 TARGET = bin/update
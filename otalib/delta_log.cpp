@@ -49,7 +49,7 @@ DeltaInfo receiveLine(const QString& line) {
   info.position = list.front();
 
   info.opaque = QString();
-  if (info.action == Action::DELTA && info.category == Category::FILE) {
+  if (info.action != Action::DELETEACT && info.category == Category::FILE) {
     list.pop_front();
     if (!list.isEmpty()) info.opaque = list.front();
   }
@@ -104,6 +104,22 @@ void writeDeltaLog(QTextStream& log, const DeltaInfo& info) {
   }
 }
 
+QString targetHashOf(const DeltaInfo& info) {
+  if (info.category != Category::FILE) return QString();
+  switch (info.action) {
+    case Action::ADD:
+      return info.opaque;
+    case Action::DELTA: {
+      // opaque ::= size/sha256
+      QStringList slist = info.opaque.split("/");
+      if (slist.size() < 2) return QString();
+      return slist.at(1);
+    }
+    default:
+      return QString();
+  }
+}
+
 DeltaInfoStream readDeltaLog(QTextStream& log) {
   DeltaInfoStream stream;
   QString line;
@@ -15,6 +15,11 @@ enum class Category { FILE, DIR };
 /* Info pattern
  *  Normal info: action|category|position|
  *  Error info : error |category|position|error-msg
+ *
+ *  Opaque of "DELTA|FILE": size/sha256 of the patched file.
+ *  Opaque of "ADD|FILE"  : sha256 of the added file.
+ *  The sha256 is optional, packs generated before it was introduced just
+ *  don't carry it.
  */
 struct DeltaInfo {
   Action action;
@@ -32,6 +37,10 @@ using DeltaInfoStream = QVector<DeltaInfo>;
 
 void writeDeltaLog(QTextStream& log, const DeltaInfo& info);
 
+// Get the expected sha256(hex) of the file produced by "info". Return an empty
+// string if the info doesn't carry one.
+QString targetHashOf(const DeltaInfo& info);
+
 DeltaInfoStream readDeltaLog(QTextStream& log);
 
 }  // namespace otalib
@@ -1,4 +1,7 @@
 #include "diff.h"
+
+#include <stdio.h>
+
 namespace otalib::bs {
 namespace {
 
@@ -14,8 +17,20 @@ static int plainWrite(bsdiff_stream* stream, const void* buffer, int size) {
 }
 
 void copyDir(const QDir& source, const QDir& dest) {
+#ifdef __linux__
+  CopyReport report =
+      copyDirectory(source.path().toStdString(), dest.path().toStdString());
+  if (report.ok()) return;
+  for (const auto& failure : report.failures_)
+    print<GeneralErrorCtrl>(std::cerr, "[" + failure.path_ + "]",
+                            failure.reason_);
+  OTAError::S_file_copy_fail xerror{source.path(), dest.path(),
+                                    STRING_SOURCE_LOCATION};
+  throw OTAError{::std::move(xerror)};
+#else
   copyDirCmd(source.path(), dest.path());
   return;
+#endif
 }
 
 /* Copy the "newfile" into "tdir" and log "add" in alog, "delete" in dlog. */
@@ -37,7 +52,10 @@ bool doAddActionLog(QFile* newfile, const QDir& tdir, const QDir& nroot,
   }
   QString target = file.filePath();
   if (QFile::copy(target, udest_file)) {
-    writeDeltaLog(alog, {Action::ADD, Category::FILE, position, QString()});
+    // opaque ::= sha256 of the added file.
+    QString opaque =
+        QString::fromStdString(Sha256HexOfFile(target.toStdString()));
+    writeDeltaLog(alog, {Action::ADD, Category::FILE, position, opaque});
     print<GeneralSuccessCtrl>(std::cout, "Copy succeed.");
     return true;
   } else {  // Copy failed.
@@ -110,9 +128,13 @@ bool doChangeActionLog(QByteArray& buffer_old, QByteArray& buffer_new,
     delta.close();
     if (success) {
       // Additional info stores in opaque.
-      // opaque ::= _1/
+      // opaque ::= _1/_2
       // _1 : The size of new file.
-      ::std::string opaque = ::std::to_string(buffer_new.size());
+      // _2 : The sha256 of new file.
+      uint8_t md[kSha256Len]{0};
+      Sha256HashBuffer(buffer_new.constData(), buffer_new.size(), md);
+      ::std::string opaque = ::std::to_string(buffer_new.size()) + "/" +
+                             merkle_hash_t(md).to_string();
       writeDeltaLog(ulog, {Action::DELTA, Category::FILE, pos,
                            QString::fromStdString(opaque)});
 
@@ -429,7 +451,25 @@ bool doAdd(const DeltaInfo& info, const QDir& pack, const QDir& root) {
       throw OTAError{::std::move(xerror)};
     }
     case Category::FILE: {
-      if (QFile::copy(spath, dpath)) return true;
+      // Copy beside the target and verify it there, the target appears only
+      // when it's right, the same as a patched file does.
+      QString tpath = dpath + ".otaadd";
+      QFile::remove(tpath);
+      if (QFile::copy(spath, tpath)) {
+        // Verify the output if the pack tells what it should be.
+        QString expected = targetHashOf(info);
+        if (!expected.isEmpty() &&
+            expected.toStdString() != Sha256HexOfFile(tpath.toStdString())) {
+          QFile::remove(tpath);
+          OTAError::S_file_hash_mismatch xerror{::std::move(dpath),
+                                                STRING_SOURCE_LOCATION};
+          throw OTAError{::std::move(xerror)};
+        }
+        if (::rename(tpath.toStdString().c_str(),
+                     dpath.toStdString().c_str()) == 0)
+          return true;
+        QFile::remove(tpath);
+      }
       OTAError::S_general xerror{
           QStringLiteral("Add action failed. File copy failed.") +
           STRING_SOURCE_LOCATION};
@@ -515,15 +555,32 @@ bool doDelta(const DeltaInfo& info, const QDir& pack, const QDir& root) {
           target.close();
           patch.close();
 
-          if (!target.open(QFile::WriteOnly | QFile::Truncate)) {
+          // Verify the output before it replaces the target.
+          QString expected = targetHashOf(info);
+          if (!expected.isEmpty()) {
+            uint8_t md[kSha256Len]{0};
+            Sha256HashBuffer(buffer_result.constData(), buffer_result.size(),
+                             md);
+            if (expected.toStdString() != merkle_hash_t(md).to_string()) {
+              OTAError::S_file_hash_mismatch xerror{::std::move(source_path),
+                                                    STRING_SOURCE_LOCATION};
+              throw OTAError{::std::move(xerror)};
+            }
+          }
+
+          // Replace the target instead of rewriting it, the file may share
+          // its data with another tree(A/B slots), and a crash leaves either
+          // the old file or the new one.
+          QSaveFile output(source_path);
+          if (!output.open(QFile::WriteOnly)) {
             OTAError::S_general xerror{
                 QStringLiteral("Applying delta patch failed. Cannot write "
                                "date into target file.") +
                 STRING_SOURCE_LOCATION};
             throw OTAError{::std::move(xerror)};
           }
-          if (target.write(buffer_result) != buffer_result.size()) {
-            target.close();
+          if (output.write(buffer_result) != buffer_result.size() ||
+              !output.commit()) {
             OTAError::S_general xerror{
                 QStringLiteral(
                     "Applying delta patch failed. Unexpected error occurs when "
@@ -531,7 +588,6 @@ bool doDelta(const DeltaInfo& info, const QDir& pack, const QDir& root) {
                 STRING_SOURCE_LOCATION};
             throw OTAError{::std::move(xerror)};
           }
-          target.close();
           return true;
         } else {  // Patch failed
           patch.close();
@@ -573,7 +629,8 @@ bool doDelta(const DeltaInfo& info, const QDir& pack, const QDir& root) {
 }
 
 bool doApply(const QDir& pack, const QDir& target, QTextStream& log,
-             QTextStream& dlog) {
+             QTextStream& dlog, DeltaInfoStream* applied,
+             UndoJournal* journal) {
   // Read the info from the dlog
   DeltaInfoStream dstrm = readDeltaLog(dlog);
   auto hasDone = [&dstrm](const DeltaInfo& action) {
@@ -588,12 +645,15 @@ bool doApply(const QDir& pack, const QDir& target, QTextStream& log,
     bool success = false;
     const auto& info = stream.back();
     if (hasDone(info)) {
-      // Skip the action if it had already done.
+      // Skip the action if it had already done. Its undo is unknown.
+      if (applied) applied->push_back(info);
+      if (journal) journal->invalidate();
       stream.pop_back();
       continue;
     }
 
     try {
+      if (journal) journal->record(info, target);
       switch (info.action) {
         case Action::ADD:
           success = doAdd(info, pack, target);
@@ -619,6 +679,8 @@ bool doApply(const QDir& pack, const QDir& target, QTextStream& log,
 
     // Record the successful action in dlog.
     if (success) {
+      if (applied) applied->push_back(info);
+      if (journal) journal->confirm();
       try {
         writeDeltaLog(dlog, info);
       } catch (::std::exception& e) {
@@ -641,7 +703,8 @@ bool doApply(const QDir& pack, const QDir& target, QTextStream& log,
 
 }  // namespace
 
-bool applyDeltaPack(const QDir& pack, const QDir& target) {
+bool applyDeltaPack(const QDir& pack, const QDir& target,
+                    DeltaInfoStream* applied, UndoJournal* journal) {
   if constexpr (bs_debug_mode)
     print<GeneralDebugCtrl>(std::cout, "[applyDeltaPack]");
 
@@ -676,7 +739,7 @@ bool applyDeltaPack(const QDir& pack, const QDir& target) {
     QTextStream ulog(&ulogf);
     QTextStream dlog(&dlogf);
     try {
-      doApply(pack, target, ulog, dlog);
+      doApply(pack, target, ulog, dlog, applied, journal);
     } catch (::std::exception& e) {
       dlogf.close();
       ulogf.close();
@@ -703,7 +766,7 @@ bool applyDeltaPack(const QDir& pack, const QDir& target) {
     QTextStream rlog(&rlogf);
     QTextStream dlog(&dlogf);
     try {
-      doApply(pack, target, rlog, dlog);
+      doApply(pack, target, rlog, dlog, applied, journal);
     } catch (::std::exception& e) {
       dlogf.close();
       rlogf.close();
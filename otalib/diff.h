@@ -7,6 +7,7 @@
 #include <QDir>
 #include <QFile>
 #include <QMap>
+#include <QSaveFile>
 #include <QTextStream>
 #include <memory>
 #include <string>
@@ -16,7 +17,9 @@
 #include "delta_log.h"
 #include "logger/logger.h"
 #include "otaerr.hpp"
+#include "sha256_hash.h"
 #include "shell_cmd.hpp"
+#include "undo_journal.h"
 
 namespace otalib::bs {
 
@@ -30,7 +33,12 @@ bool generateDeltaPack(QDir& oldfile, QDir& newfile, QDir& rollback_dest,
                        QDir& update_dest);
 
 // Apply the delta pack to update/rollback app.
-bool applyDeltaPack(const QDir& pack, const QDir& target);
+// applied: If not null, receives every action which has been performed on
+// target(including the ones done by a previous interrupted attempt).
+// journal: If not null, records how to undo the actions performed.
+bool applyDeltaPack(const QDir& pack, const QDir& target,
+                    DeltaInfoStream* applied = nullptr,
+                    UndoJournal* journal = nullptr);
 
 }  // namespace otalib::bs
 
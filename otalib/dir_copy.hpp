@@ -0,0 +1,296 @@
+#ifndef DIR_COPY_HPP
+#define DIR_COPY_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif  // __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace otalib {
+
+// In-process replacement of "cp -r". Regular files are cloned(FICLONE) when
+// the filesystem supports reflinks, otherwise copied through
+// copy_file_range(), and read()/write() as the last resort. Files are copied
+// concurrently, each failure is reported on its own.
+struct CopyFailure {
+  ::std::string path_;
+  ::std::string reason_;
+};
+
+struct CopyReport {
+  size_t files_ = 0;
+  size_t bytes_ = 0;
+  ::std::vector<CopyFailure> failures_;
+
+  bool ok() const noexcept { return failures_.empty(); }
+};
+
+// Called after every file. It may be called from the worker threads, but
+// never concurrently.
+using CopyProgress = ::std::function<void(size_t done, size_t total)>;
+
+enum class CopyMode {
+  Content,  // Real copies.
+  Share,    // Reflinks, or hard links where reflinks are not supported. Only
+            // for the trees where files are replaced rather than rewritten.
+};
+
+namespace copy_details {
+namespace fs = ::std::filesystem;
+
+constexpr size_t kMaxCopyThreads = 8;
+constexpr size_t kCopyBufferSize = 128 * 1024;
+
+struct FileJob {
+  ::std::string from_;
+  ::std::string to_;
+};
+
+inline ::std::string errorString(int err) { return ::strerror(err); }
+
+inline bool copyByReadWrite(int in, int out, ::std::string* reason) {
+  ::std::vector<char> buffer(kCopyBufferSize);
+  while (true) {
+    ssize_t n = ::read(in, buffer.data(), buffer.size());
+    if (n == 0) return true;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      *reason = "read: " + errorString(errno);
+      return false;
+    }
+    char* p = buffer.data();
+    while (n > 0) {
+      ssize_t w = ::write(out, p, n);
+      if (w < 0) {
+        if (errno == EINTR) continue;
+        *reason = "write: " + errorString(errno);
+        return false;
+      }
+      p += w;
+      n -= w;
+    }
+  }
+}
+
+// Copy the content of "in" into "out", both are at offset 0.
+inline bool copyContent(int in, int out, off_t size, ::std::string* reason) {
+#ifdef __linux__
+#ifdef FICLONE
+  // Share the extents if the filesystem can(btrfs, xfs...).
+  if (::ioctl(out, FICLONE, in) == 0) return true;
+#endif  // FICLONE
+  off_t left = size;
+  while (left > 0) {
+    ssize_t n = ::copy_file_range(in, nullptr, out, nullptr, left, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (left == size &&
+          (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+           errno == EOPNOTSUPP || errno == EBADF))
+        break;  // Not supported here, fall back.
+      *reason = "copy_file_range: " + errorString(errno);
+      return false;
+    }
+    if (n == 0) break;  // Source shrank, copy what is left by hand.
+    left -= n;
+  }
+  if (left == 0) return true;
+  if (left != size) {
+    // Continue from where copy_file_range() stopped.
+    if (::lseek(in, size - left, SEEK_SET) < 0 ||
+        ::lseek(out, size - left, SEEK_SET) < 0) {
+      *reason = "lseek: " + errorString(errno);
+      return false;
+    }
+  }
+#endif  // __linux__
+  return copyByReadWrite(in, out, reason);
+}
+
+inline bool copyRegularFile(const FileJob& job, size_t* bytes,
+                            ::std::string* reason) {
+  int in = ::open(job.from_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    *reason = "open source: " + errorString(errno);
+    return false;
+  }
+  struct stat st;
+  if (::fstat(in, &st) < 0) {
+    *reason = "stat source: " + errorString(errno);
+    ::close(in);
+    return false;
+  }
+  // A new file, the old one may be a hardlink of the source, truncating it
+  // would wipe the source.
+  ::unlink(job.to_.c_str());
+  int out = ::open(job.to_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                   st.st_mode & 07777);
+  if (out < 0) {
+    *reason = "open dest: " + errorString(errno);
+    ::close(in);
+    return false;
+  }
+
+  bool succ = copyContent(in, out, st.st_size, reason);
+  if (::close(out) < 0 && succ) {
+    *reason = "close dest: " + errorString(errno);
+    succ = false;
+  }
+  ::close(in);
+  if (succ) *bytes = st.st_size;
+  return succ;
+}
+
+// Let the copy share the data with the source, no byte is copied.
+inline bool shareRegularFile(const FileJob& job) {
+  bool shared = false;
+  // As copyRegularFile(), never truncate what's there.
+  ::unlink(job.to_.c_str());
+#ifdef FICLONE
+  int in = ::open(job.from_.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (in >= 0 && ::fstat(in, &st) == 0) {
+    int out = ::open(job.to_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                     st.st_mode & 07777);
+    if (out >= 0) {
+      shared = ::ioctl(out, FICLONE, in) == 0;
+      ::close(out);
+    }
+  }
+  if (in >= 0) ::close(in);
+  if (shared) return true;
+  ::unlink(job.to_.c_str());
+#endif  // FICLONE
+  shared = ::link(job.from_.c_str(), job.to_.c_str()) == 0;
+  return shared;
+}
+
+}  // namespace copy_details
+
+// desc: Copy one regular file to "dest", which must not be a directory.
+// param:
+//      bytes: Receives the bytes copied, 0 if the data is shared.
+inline bool copyFile(const ::std::string& source, const ::std::string& dest,
+                     CopyMode mode, size_t* bytes,
+                     ::std::string* reason = nullptr) {
+  copy_details::FileJob job{source, dest};
+  ::std::string why;
+  *bytes = 0;
+  if (mode == CopyMode::Share && copy_details::shareRegularFile(job))
+    return true;
+  bool succ = copy_details::copyRegularFile(job, bytes, &why);
+  if (!succ && reason) *reason = ::std::move(why);
+  return succ;
+}
+
+// desc: Copy "source" recursively. Same as "cp -r source dest": if "dest" is
+// an existing directory the copy goes into "dest/<name of source>", otherwise
+// "dest" becomes the copy.
+// param:
+//      mode: Copy the content, or share it with the source. "bytes_" of the
+//      report only counts the bytes copied.
+// param:
+//      threads: Worker count, 0 means deciding by the hardware.
+inline CopyReport copyDirectory(const ::std::string& source,
+                                const ::std::string& dest,
+                                CopyMode mode = CopyMode::Content,
+                                const CopyProgress& progress = nullptr,
+                                size_t threads = 0) {
+  namespace fs = copy_details::fs;
+  CopyReport report;
+  ::std::error_code ec;
+
+  fs::path src(source);
+  while (src.has_relative_path() && !src.has_filename())
+    src = src.parent_path();  // Drop the trailing '/'.
+  if (!fs::is_directory(src, ec)) {
+    report.failures_.push_back({source, "not a directory"});
+    return report;
+  }
+  fs::path target(dest);
+  if (fs::is_directory(target, ec)) target /= src.filename();
+
+  // Make the directory tree first, then collect the files.
+  ::std::vector<copy_details::FileJob> jobs;
+  if (!fs::exists(target, ec) && !fs::create_directories(target, ec)) {
+    report.failures_.push_back({target.string(), ec.message()});
+    return report;
+  }
+  fs::recursive_directory_iterator iter(src, ec), end;
+  if (ec) {
+    report.failures_.push_back({src.string(), ec.message()});
+    return report;
+  }
+  for (; iter != end; iter.increment(ec)) {
+    const fs::path& from = iter->path();
+    fs::path to = target / from.lexically_relative(src);
+    fs::file_status st = iter->symlink_status(ec);
+    if (fs::is_symlink(st)) {
+      fs::copy_symlink(from, to, ec);
+      if (ec) report.failures_.push_back({from.string(), ec.message()});
+    } else if (fs::is_directory(st)) {
+      fs::create_directories(to, ec);
+      if (ec) report.failures_.push_back({to.string(), ec.message()});
+    } else if (fs::is_regular_file(st)) {
+      jobs.push_back({from.string(), to.string()});
+    } else {
+      report.failures_.push_back({from.string(), "unsupported type"});
+    }
+    ec.clear();
+  }
+  if (ec) report.failures_.push_back({src.string(), ec.message()});
+
+  // Copy the files.
+  if (threads == 0) threads = ::std::thread::hardware_concurrency();
+  threads = ::std::clamp<size_t>(threads, 1, copy_details::kMaxCopyThreads);
+  threads = ::std::min(threads, jobs.size());
+
+  ::std::atomic<size_t> next{0};
+  ::std::mutex lock;
+  size_t done = 0;
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next.fetch_add(1)) < jobs.size()) {
+      size_t bytes = 0;
+      ::std::string reason;
+      bool succ = (mode == CopyMode::Share &&
+                   copy_details::shareRegularFile(jobs[i])) ||
+                  copy_details::copyRegularFile(jobs[i], &bytes, &reason);
+
+      ::std::lock_guard locker(lock);
+      if (succ) {
+        report.files_++;
+        report.bytes_ += bytes;
+      } else {
+        report.failures_.push_back({jobs[i].from_, ::std::move(reason)});
+      }
+      ++done;
+      if (progress) progress(done, jobs.size());
+    }
+  };
+
+  ::std::vector<::std::thread> workers;
+  for (size_t t = 1; t < threads; ++t) workers.emplace_back(worker);
+  worker();
+  for (auto& th : workers) th.join();
+  return report;
+}
+
+}  // namespace otalib
+
+#endif  // DIR_COPY_HPP
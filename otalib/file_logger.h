@@ -2,7 +2,13 @@
 #define FILE_LOGGER_H
 
 #include <QDir>
+#include <QSaveFile>
+#include <QTextStream>
+#include <unordered_map>
 
+#include "file_manifest.h"
+#include "hash_cache.hpp"
+#include "merkle_snapshot.hpp"
 #include "sha256_hash.h"
 
 namespace otalib {
@@ -11,31 +17,155 @@ struct FileLogger {
     file_.open(QIODevice::ReadWrite);
   }
 
+  // Read the files recorded in log file, in order and without the leading
+  // "./".
+  static QStringList ReadEntries(const QString &log_file) {
+    QStringList entries;
+    std::vector<std::string> names;
+    ReadFileLogEntries(log_file, names);
+    for (const auto &name : names) entries.append(QString::fromStdString(name));
+    return entries;
+  }
+
+  // The entries as ReadEntries(), copied from FileLogNames, for the callers
+  // keeping them. The hashing below takes the views.
+  static std::vector<std::string> ReadNames(const QString &log_file) {
+    FileLogNames views;
+    views.open(log_file);
+    return std::vector<std::string>(views.names().begin(),
+                                    views.names().end());
+  }
+
+  // The leaf hashes are reused from the hash cache next to "log_file" when
+  // the files' stat still matches, and the tree from the snapshot next to it,
+  // only the nodes above the changed leaves are hashed. "strict" ignores both
+  // and hashes every file, without writing them.
+  // "chunk_size" is Property::hash_chunk_size_ of the app.
   static merkle_hash_t GetHashFromLogFile(const QString &log_file,
-                                          const QString &prefix = "") {
-    QFile file(log_file);
-    if (!file.open(QIODevice::ReadOnly)) return merkle_hash_t();
-    char buf[1024]{0};
-    merkle_tree_t tree;
-    uint8_t md[kSha256Len]{0};
-    QString path;
-
-    while (-1 != file.readLine(buf, sizeof(buf))) {
-      QString filename = QString(buf).trimmed();
-      if (filename.isEmpty()) continue;
-      filename = filename.remove(0, 2);  // remvoe "./"
-      if (prefix.isEmpty())
-        path = filename;
-      else
-        path = prefix + filename;
-      Sha256HashFile(path.toStdString(), md);
-      tree.insert(merkle_hash_t(md));
-    }
-    file.close();
-    auto root = tree.root();
+                                          const QString &prefix = "",
+                                          bool strict = false,
+                                          uint64_t chunk_size = 0) {
+    // Views into the mapped manifest(or log), the paths are built by the
+    // hashers, nothing is allocated for an entry.
+    FileLogNames names;
+    if (!names.open(log_file, strict) || names.empty())
+      return merkle_hash_t();
+    std::string root_dir = prefix.toStdString();
+
+    // Hashed in parallel, the leaves follow the order of the log.
+    if (strict)
+      return MerkleRootOf(
+          Sha256HashFiles(root_dir, names.names(), 0, chunk_size));
+
+    QDir dir = QFileInfo(log_file).dir();
+    HashCache cache(dir.filePath(kHashCacheName), chunk_size);
+    std::vector<merkle_hash_t> hashes = cache.hash(root_dir, names.names());
+    cache.retain(names.names());
+    cache.save();
+    MerkleSnapshot snapshot(dir.filePath(kMerkleSnapshotName));
+    auto root = snapshot.root(names.names(), std::move(hashes));
+    snapshot.save();
     return root;
   }
 
+  // Leaf manifest, the file manifest of the log with the size, the mode and
+  // the leaf hash of every file. Hashed strictly. The proofs of a delta pack
+  // are made from it(see WriteMerkleProofs()).
+  // ret: The merkle root, same as GetHashFromLogFile(), or a zero hash if the
+  // manifest can't be written.
+  static merkle_hash_t WriteLeafManifest(const QString &log_file,
+                                         const QString &prefix,
+                                         uint64_t chunk_size,
+                                         const QString &out) {
+    FileLogNames names;
+    names.open(log_file, true);
+    std::string root_dir = prefix.toStdString();
+    std::vector<merkle_hash_t> leaves =
+        Sha256HashFiles(root_dir, names.names(), 0, chunk_size);
+
+    // The names are copied into the entries only, the manifest is written
+    // from them.
+    std::vector<FileManifest::Entry> entries(names.size());
+    std::string path;
+    for (size_t i = 0; i < names.size(); ++i) {
+      struct stat st;
+      path.assign(root_dir);
+      path.append(names[i]);
+      if (::stat(path.c_str(), &st) == 0) {
+        entries[i].size_ = static_cast<uint64_t>(st.st_size);
+        entries[i].mode_ = st.st_mode;
+      }
+      entries[i].name_ = names[i];
+      ::memcpy(entries[i].hash_, leaves[i].bytes, kSha256Len);
+    }
+    if (!FileManifest::Write(out, entries)) return merkle_hash_t();
+    return MerkleRootOf(std::move(leaves));
+  }
+
+  static std::vector<merkle_hash_t> ReadLeafManifest(
+      const QString &manifest, std::vector<std::string> *entries) {
+    std::vector<merkle_hash_t> leaves;
+    FileManifest leaf_manifest;
+    if (!leaf_manifest.open(manifest)) return leaves;
+    entries->reserve(leaf_manifest.size());
+    leaves.reserve(leaf_manifest.size());
+    for (size_t i = 0; i < leaf_manifest.size(); ++i) {
+      entries->emplace_back(leaf_manifest.name(i));
+      leaves.emplace_back(leaf_manifest.record(i).hash);
+    }
+    return leaves;
+  }
+
+  // Chunk manifest, the chunk hashes of the files larger than "chunk_size":
+  //      chunk size
+  //      file|hash,hash,...
+  // With it a client can find the bad chunks of a file(FindBadChunks()), and
+  // doesn't need the whole file again.
+  static bool WriteChunkManifest(const QString &log_file, const QString &prefix,
+                                 uint64_t chunk_size, const QString &out) {
+    if (chunk_size == 0) return false;
+    QStringList entries = ReadEntries(log_file);
+
+    QString content = QString::number(chunk_size) + "\n";
+    for (const auto &entry : entries) {
+      std::vector<merkle_hash_t> chunks =
+          Sha256ChunkHashes((prefix + entry).toStdString(), chunk_size);
+      if (chunks.size() <= 1) continue;
+      QStringList hashes;
+      for (const auto &hash : chunks)
+        hashes.append(QString::fromStdString(hash.to_string()));
+      content += entry + "|" + hashes.join(",") + "\n";
+    }
+
+    QSaveFile file(out);
+    QByteArray raw = content.toUtf8();
+    return file.open(QFile::WriteOnly) && file.write(raw) == raw.size() &&
+           file.commit();
+  }
+
+  static std::unordered_map<std::string, std::vector<merkle_hash_t>>
+  ReadChunkManifest(const QString &manifest, uint64_t *chunk_size) {
+    std::unordered_map<std::string, std::vector<merkle_hash_t>> chunks;
+    QFile file(manifest);
+    if (!file.open(QIODevice::ReadOnly)) return chunks;
+    QTextStream stream(&file);
+    QString line;
+    if (!stream.readLineInto(&line)) return chunks;
+    *chunk_size = line.trimmed().toULongLong();
+
+    while (stream.readLineInto(&line)) {
+      int sep = line.lastIndexOf('|');
+      if (sep < 0) continue;
+      std::vector<merkle_hash_t> hashes;
+      for (const auto &hashv : line.mid(sep + 1).split(",")) {
+        if (hashv.size() != 2 * static_cast<int>(kSha256Len)) break;
+        hashes.emplace_back(hashv.toStdString());
+      }
+      chunks[line.left(sep).toStdString()] = std::move(hashes);
+    }
+    return chunks;
+  }
+
   void Close() { file_.close(); }
 
   void AppendDir(const QString &dir_name) {
@@ -0,0 +1,234 @@
+#include "file_manifest.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+namespace otalib {
+namespace {
+
+constexpr char kMagic[8] = {'O', 'T', 'A', 'M', 'A', 'N', 'I', 'F'};
+
+// Map a whole file read-only. An empty file maps to nothing and succeeds.
+bool mapFile(const QString& path, void** map, size_t* length) {
+  int fd = ::open(path.toStdString().c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat st;
+  if (::fstat(fd, &st) < 0) {
+    ::close(fd);
+    return false;
+  }
+  *length = static_cast<size_t>(st.st_size);
+  *map = nullptr;
+  if (*length > 0) {
+    *map = ::mmap(nullptr, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*map == MAP_FAILED) *map = nullptr;
+  }
+  ::close(fd);
+  return *length == 0 || *map != nullptr;
+}
+
+bool statOf(const QString& path, struct stat* st) {
+  return ::stat(path.toStdString().c_str(), st) == 0;
+}
+
+int64_t mtimeOf(const struct stat& st) {
+  return st.st_mtim.tv_sec * 1'000'000'000LL + st.st_mtim.tv_nsec;
+}
+
+// Split the text of file_log into its entries, trimmed and without "./".
+template <typename Function>
+void splitFileLog(const void* map, size_t length, Function&& f) {
+  const char* data = static_cast<const char*>(map);
+  const char* end = data + length;
+  while (data < end) {
+    auto eol = static_cast<const char*>(::memchr(data, '\n', end - data));
+    if (!eol) eol = end;
+    const char* first = data;
+    const char* last = eol;
+    while (first < last && ::isspace(static_cast<unsigned char>(*first)))
+      ++first;
+    while (last > first && ::isspace(static_cast<unsigned char>(last[-1])))
+      --last;
+    // remove "./"
+    if (last - first > 2)
+      f(::std::string_view(first + 2, static_cast<size_t>(last - first - 2)));
+    data = eol + 1;
+  }
+}
+
+}  // namespace
+
+bool FileManifest::open(const QString& path) {
+  close();
+  if (!mapFile(path, &map_, &length_)) return false;
+  auto fail = [this] {
+    close();
+    return false;
+  };
+  if (length_ < sizeof(FileManifestHeader)) return fail();
+
+  auto header = static_cast<const FileManifestHeader*>(map_);
+  if (::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion ||
+      header->record_size != sizeof(FileManifestRecord))
+    return fail();
+  uint64_t room = length_ - sizeof(FileManifestHeader);
+  if (header->count > room / sizeof(FileManifestRecord)) return fail();
+  room -= header->count * sizeof(FileManifestRecord);
+  if (header->names_size != room) return fail();
+
+  auto records = reinterpret_cast<const FileManifestRecord*>(header + 1);
+  for (uint64_t i = 0; i < header->count; ++i) {
+    if (records[i].name_offset > room ||
+        records[i].name_size > room - records[i].name_offset)
+      return fail();
+  }
+  header_ = header;
+  records_ = records;
+  names_ = reinterpret_cast<const char*>(records + header->count);
+  return true;
+}
+
+void FileManifest::close() {
+  if (map_) ::munmap(map_, length_);
+  map_ = nullptr;
+  length_ = 0;
+  header_ = nullptr;
+  records_ = nullptr;
+  names_ = nullptr;
+}
+
+bool FileManifest::toFileLog(const QString& out) const {
+  QByteArray content;
+  for (size_t i = 0; i < size(); ++i) {
+    ::std::string_view entry = name(i);
+    content.append("./");
+    content.append(entry.data(), static_cast<int>(entry.size()));
+    content.append("\r\n");
+  }
+  QSaveFile file(out);
+  return file.open(QFile::WriteOnly) &&
+         file.write(content) == content.size() && file.commit();
+}
+
+bool FileManifest::Write(const QString& path,
+                         const ::std::vector<Entry>& entries,
+                         const QString& source) {
+  FileManifestHeader header;
+  ::memset(&header, 0, sizeof(header));
+  ::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.record_size = sizeof(FileManifestRecord);
+  header.count = entries.size();
+  struct stat st;
+  if (!source.isEmpty() && statOf(source, &st)) {
+    header.source_size = st.st_size;
+    header.source_mtime = mtimeOf(st);
+    header.source_ino = st.st_ino;
+  }
+
+  ::std::vector<FileManifestRecord> records(entries.size());
+  ::std::string names;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    FileManifestRecord& record = records[i];
+    record.name_offset = names.size();
+    record.name_size = static_cast<uint32_t>(entries[i].name_.size());
+    record.mode = entries[i].mode_;
+    record.size = entries[i].size_;
+    ::memcpy(record.hash, entries[i].hash_, sizeof(record.hash));
+    names += entries[i].name_;
+  }
+  header.names_size = names.size();
+
+  QSaveFile file(path);
+  if (!file.open(QFile::WriteOnly)) return false;
+  qint64 records_size =
+      static_cast<qint64>(records.size() * sizeof(FileManifestRecord));
+  if (file.write(reinterpret_cast<const char*>(&header), sizeof(header)) !=
+          sizeof(header) ||
+      file.write(reinterpret_cast<const char*>(records.data()),
+                 records_size) != records_size ||
+      file.write(names.data(), static_cast<qint64>(names.size())) !=
+          static_cast<qint64>(names.size()))
+    return false;
+  return file.commit();
+}
+
+bool FileManifest::FromFileLog(const QString& log_file, const QString& prefix,
+                               const QString& out, bool with_stat) {
+  ::std::vector<::std::string> names;
+  if (!ReadFileLogEntries(log_file, names)) return false;
+  ::std::vector<Entry> entries(names.size());
+  ::std::string root = prefix.toStdString();
+  for (size_t i = 0; i < names.size(); ++i) {
+    struct stat st;
+    if (with_stat && ::stat((root + names[i]).c_str(), &st) == 0) {
+      entries[i].size_ = static_cast<uint64_t>(st.st_size);
+      entries[i].mode_ = st.st_mode;
+    }
+    entries[i].name_ = ::std::move(names[i]);
+  }
+  return Write(out, entries, log_file);
+}
+
+bool FileManifest::IsFresh(const FileManifest& manifest,
+                           const QString& log_file) {
+  struct stat st;
+  if (!manifest.isOpen() || !statOf(log_file, &st)) return false;
+  const FileManifestHeader& header = manifest.header();
+  return header.source_size == st.st_size &&
+         header.source_mtime == mtimeOf(st) && header.source_ino == st.st_ino;
+}
+
+bool ReadFileLogEntries(const QString& log_file,
+                        ::std::vector<::std::string>& entries) {
+  void* map = nullptr;
+  size_t length = 0;
+  if (!mapFile(log_file, &map, &length)) return false;
+  splitFileLog(map, length, [&entries](::std::string_view name) {
+    entries.emplace_back(name);
+  });
+  if (map) ::munmap(map, length);
+  return true;
+}
+
+bool FileLogNames::open(const QString& log_file, bool strict) {
+  close();
+  if (!strict) {
+    QString dir = QFileInfo(log_file).dir().path();
+    QString path = dir + "/" + kFileManifestName;
+    if ((manifest_.open(path) && FileManifest::IsFresh(manifest_, log_file)) ||
+        (FileManifest::FromFileLog(log_file, dir + "/", path) &&
+         manifest_.open(path))) {
+      names_.reserve(manifest_.size());
+      for (size_t i = 0; i < manifest_.size(); ++i)
+        names_.push_back(manifest_.name(i));
+      return true;
+    }
+    manifest_.close();
+  }
+
+  if (!mapFile(log_file, &map_, &length_)) return false;
+  splitFileLog(map_, length_,
+               [this](::std::string_view name) { names_.push_back(name); });
+  return true;
+}
+
+void FileLogNames::close() {
+  names_.clear();
+  manifest_.close();
+  if (map_) ::munmap(map_, length_);
+  map_ = nullptr;
+  length_ = 0;
+}
+
+}  // namespace otalib
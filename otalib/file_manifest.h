@@ -0,0 +1,138 @@
+#ifndef FILE_MANIFEST_H
+#define FILE_MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <QString>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace otalib {
+
+static inline const QString kFileManifestName = "file_manifest";
+
+// Binary form of file_log, mapped and read in place without a parse. The
+// integers are in the byte order of the host, the layout is:
+//      header | records[count] | names
+// A record has a fixed width and points at its name in the name table. "hash"
+// is the leaf hash of the file, zeros if it's unknown.
+// "source_*" is the stat of the text file_log it was converted from, so a
+// stale manifest can be told(see FileLogger::ReadNames()).
+struct FileManifestHeader {
+  char magic[8];  // "OTAMANIF"
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t count;
+  uint64_t names_size;
+  int64_t source_size;
+  int64_t source_mtime;  // ns
+  uint64_t source_ino;
+};
+
+struct FileManifestRecord {
+  uint64_t name_offset;
+  uint32_t name_size;
+  uint32_t mode;
+  uint64_t size;
+  uint8_t hash[32];
+};
+
+static_assert(sizeof(FileManifestHeader) == 56, "Header must be packed.");
+static_assert(sizeof(FileManifestRecord) == 56, "Record must be packed.");
+
+class FileManifest {
+ public:
+  static constexpr uint32_t kVersion = 1;
+
+  struct Entry {
+    ::std::string name_;
+    uint64_t size_ = 0;
+    uint32_t mode_ = 0;
+    uint8_t hash_[32]{0};
+  };
+
+  FileManifest() = default;
+  ~FileManifest() { close(); }
+  FileManifest(const FileManifest&) = delete;
+  FileManifest& operator=(const FileManifest&) = delete;
+
+  // desc: Map the manifest. A file of another version, or whose records or
+  // names are out of its bounds, fails.
+  bool open(const QString& path);
+  void close();
+  bool isOpen() const { return header_ != nullptr; }
+
+  const FileManifestHeader& header() const { return *header_; }
+  size_t size() const { return header_ ? header_->count : 0; }
+  const FileManifestRecord& record(size_t index) const {
+    return records_[index];
+  }
+  ::std::string_view name(size_t index) const {
+    return {names_ + records_[index].name_offset, records_[index].name_size};
+  }
+
+  // desc: Write the text form, the same as FileLogger writes.
+  bool toFileLog(const QString& out) const;
+
+  // param:
+  //      source: The text file_log the entries come from, its stat is
+  //      recorded. Empty for none.
+  static bool Write(const QString& path, const ::std::vector<Entry>& entries,
+                    const QString& source = QString());
+
+  // desc: Convert the text file_log. "size_" and "mode_" are taken from the
+  // files under "prefix" if "with_stat" is set, the hashes are left zeros.
+  static bool FromFileLog(const QString& log_file, const QString& prefix,
+                          const QString& out, bool with_stat = true);
+
+  // desc: Whether "manifest" is still the one converted from "log_file".
+  static bool IsFresh(const FileManifest& manifest, const QString& log_file);
+
+ private:
+  void* map_ = nullptr;
+  size_t length_ = 0;
+  const FileManifestHeader* header_ = nullptr;
+  const FileManifestRecord* records_ = nullptr;
+  const char* names_ = nullptr;
+};
+
+// desc: The entries of a text file_log, in order and without the leading
+// "./". The file is mapped and split in place, a line may be of any length.
+bool ReadFileLogEntries(const QString& log_file,
+                        ::std::vector<::std::string>& entries);
+
+// The entries of a file_log as views into the file mapped, no entry is copied.
+// They're taken from the manifest next to the log(kFileManifestName), which
+// is converted again when the log has changed since, or from the text log if
+// the manifest can't be made. The views are valid while it's open.
+class FileLogNames {
+ public:
+  FileLogNames() = default;
+  ~FileLogNames() { close(); }
+  FileLogNames(const FileLogNames&) = delete;
+  FileLogNames& operator=(const FileLogNames&) = delete;
+
+  // param:
+  //      strict: Read the text log only, the manifest is neither used nor
+  //      written.
+  // ret: false if the log can't be read.
+  bool open(const QString& log_file, bool strict = false);
+  void close();
+
+  size_t size() const { return names_.size(); }
+  bool empty() const { return names_.empty(); }
+  ::std::string_view operator[](size_t index) const { return names_[index]; }
+  const ::std::vector<::std::string_view>& names() const { return names_; }
+
+ private:
+  FileManifest manifest_;
+  void* map_ = nullptr;  // The text log.
+  size_t length_ = 0;
+  ::std::vector<::std::string_view> names_;
+};
+
+}  // namespace otalib
+
+#endif  // FILE_MANIFEST_H
@@ -0,0 +1,253 @@
+#ifndef HASH_CACHE_HPP
+#define HASH_CACHE_HPP
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include <QFile>
+#include <QSaveFile>
+#include <QString>
+#include <QStringList>
+#include <QTextStream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "sha256_hash.h"
+
+namespace otalib {
+
+static inline const QString kHashCacheName = "file_log_cache";
+
+// Leaf hashes of the files recorded in file_log, kept next to it. A file whose
+// stat still matches the one recorded(device, inode, size and mtime in ns) is
+// not read again. The content is:
+//      stamp|chunk size
+//      name|dev|ino|size|mtime|hash
+// "stamp" is when the hashing began. A file modified within kRacyWindowNs
+// before it may be changed again without a new mtime(the timestamps of the
+// file system are coarse), so it's always hashed again, same as the racy
+// entries of git's index.
+class HashCache {
+  struct Entry {
+    uint64_t dev_;
+    uint64_t ino_;
+    int64_t size_;
+    int64_t mtime_;
+    merkle_hash_t hash_;
+  };
+
+ public:
+  static constexpr int64_t kRacyWindowNs = 2'000'000'000;
+
+  // "chunk_size" is the one of Sha256HashFiles(). The cache made with another
+  // chunk size is dropped.
+  explicit HashCache(const QString& file, uint64_t chunk_size = 0)
+      : file_(file),
+        chunk_size_(chunk_size),
+        stamp_(0),
+        pending_stamp_(0),
+        dirty_(false) {
+    load();
+  }
+
+  // desc: Hash "paths" as Sha256HashFiles() does. "names" are the keys of the
+  // files in the cache, the entries in file_log.
+  std::vector<merkle_hash_t> hash(const std::vector<std::string>& names,
+                                  const std::vector<std::string>& paths,
+                                  size_t threads = 0) {
+    return hashBy(
+        names.size(),
+        [&names](size_t i) -> std::string_view { return names[i]; },
+        [&paths](size_t i, std::string&) -> const std::string& {
+          return paths[i];
+        },
+        threads);
+  }
+
+  // desc: The same, the files are "prefix + name", e.g. the views of
+  // FileLogNames. Nothing is allocated for a file the cache still knows.
+  std::vector<merkle_hash_t> hash(const std::string& prefix,
+                                  const std::vector<std::string_view>& names,
+                                  size_t threads = 0) {
+    return hashBy(
+        names.size(), [&names](size_t i) { return names[i]; },
+        [&prefix, &names](size_t i, std::string& buffer) -> const std::string& {
+          buffer.assign(prefix);
+          buffer.append(names[i]);
+          return buffer;
+        },
+        threads);
+  }
+
+  // desc: Forget the files not in "names" any more.
+  template <typename Names>
+  void retain(const Names& names) {
+    // Nothing is dropped mostly, tell it without a copy.
+    size_t kept_count = 0;
+    for (const auto& name : names) kept_count += find(name) != entries_.end();
+    if (kept_count == entries_.size()) return;
+
+    std::unordered_map<std::string, Entry> kept;
+    for (const auto& name : names) {
+      auto iter = find(name);
+      if (iter != entries_.end()) kept.emplace(*iter);
+    }
+    dirty_ = true;
+    entries_ = std::move(kept);
+  }
+
+  // desc: Write the cache back if it has changed. It's only a cache, the
+  // failure is ignored.
+  void save() {
+    if (!dirty_) return;
+    QString content = QString::number(pending_stamp_) + "|" +
+                      QString::number(chunk_size_) + "\n";
+    for (const auto& [name, entry] : entries_) {
+      content += QString::fromStdString(name) + "|" +
+                 QString::number(entry.dev_) + "|" +
+                 QString::number(entry.ino_) + "|" +
+                 QString::number(entry.size_) + "|" +
+                 QString::number(entry.mtime_) + "|" +
+                 QString::fromStdString(entry.hash_.to_string()) + "\n";
+    }
+    QByteArray raw = content.toUtf8();
+    QSaveFile file(file_);
+    if (!file.open(QFile::WriteOnly) || file.write(raw) != raw.size() ||
+        !file.commit())
+      return;
+    stamp_ = pending_stamp_;
+    pending_stamp_ = 0;
+    dirty_ = false;
+  }
+
+ private:
+  // "name_of(i)" is the key of file "i", "path_of(i, buffer)" its path as
+  // Sha256HashFilesBy() takes.
+  template <typename NameOf, typename PathOf>
+  std::vector<merkle_hash_t> hashBy(size_t count, NameOf&& name_of,
+                                    PathOf&& path_of, size_t threads) {
+    int64_t start = nowNs();
+    if (pending_stamp_ == 0 || start < pending_stamp_) pending_stamp_ = start;
+
+    std::vector<merkle_hash_t> hashes(count);
+    std::vector<size_t> missing;
+    std::vector<Entry> stats(count);
+    std::vector<bool> found(count, false);
+    std::string path;
+    for (size_t i = 0; i < count; ++i) {
+      struct stat st;
+      if (::stat(path_of(i, path).c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+        missing.push_back(i);
+        continue;
+      }
+      found[i] = true;
+      stats[i] = Entry{static_cast<uint64_t>(st.st_dev),
+                       static_cast<uint64_t>(st.st_ino),
+                       static_cast<int64_t>(st.st_size),
+                       st.st_mtim.tv_sec * 1'000'000'000LL + st.st_mtim.tv_nsec,
+                       merkle_hash_t()};
+
+      auto iter = find(name_of(i));
+      if (iter != entries_.end() && matches(iter->second, stats[i])) {
+        hashes[i] = iter->second.hash_;
+        continue;
+      }
+      missing.push_back(i);
+    }
+
+    std::vector<merkle_hash_t> fresh = Sha256HashFilesBy(
+        missing.size(),
+        [&missing, &path_of](size_t k, std::string& buffer)
+            -> const std::string& { return path_of(missing[k], buffer); },
+        threads, chunk_size_);
+    for (size_t k = 0; k < missing.size(); ++k) {
+      size_t i = missing[k];
+      hashes[i] = fresh[k];
+      // Recorded with the stat taken before the read, a change during the
+      // read makes it racy.
+      if (!found[i]) {
+        auto iter = find(name_of(i));
+        if (iter != entries_.end()) {
+          entries_.erase(iter);
+          dirty_ = true;
+        }
+        continue;
+      }
+      stats[i].hash_ = fresh[k];
+      entries_[std::string(name_of(i))] = stats[i];
+      dirty_ = true;
+    }
+    return hashes;
+  }
+
+  // C++17 has no lookup by a view, the key is copied into one buffer.
+  std::unordered_map<std::string, Entry>::iterator find(std::string_view name) {
+    key_.assign(name.data(), name.size());
+    return entries_.find(key_);
+  }
+
+  static int64_t nowNs() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+  }
+
+  bool matches(const Entry& cached, const Entry& current) const {
+    return cached.dev_ == current.dev_ && cached.ino_ == current.ino_ &&
+           cached.size_ == current.size_ && cached.mtime_ == current.mtime_ &&
+           current.mtime_ + kRacyWindowNs < stamp_;
+  }
+
+  void load() {
+    QFile file(file_);
+    if (!file.open(QFile::ReadOnly)) return;
+    QTextStream stream(&file);
+    QString line;
+    if (!stream.readLineInto(&line)) return;
+    QStringList head = line.split("|");
+    bool succ[2]{false, false};
+    uint64_t chunk_size = 0;
+    if (head.size() == 2) {
+      stamp_ = head.at(0).toLongLong(&succ[0]);
+      chunk_size = head.at(1).toULongLong(&succ[1]);
+    }
+    if (!succ[0] || !succ[1] || chunk_size != chunk_size_) {
+      stamp_ = 0;
+      dirty_ = true;
+      return;
+    }
+
+    while (stream.readLineInto(&line)) {
+      // The name may hold '|', the fields are taken from the back.
+      QStringList info = line.split("|");
+      if (info.size() < 6) continue;
+      int n = info.size();
+      bool ok[4]{false, false, false, false};
+      Entry entry;
+      entry.dev_ = info.at(n - 5).toULongLong(&ok[0]);
+      entry.ino_ = info.at(n - 4).toULongLong(&ok[1]);
+      entry.size_ = info.at(n - 3).toLongLong(&ok[2]);
+      entry.mtime_ = info.at(n - 2).toLongLong(&ok[3]);
+      std::string hashv = info.at(n - 1).toStdString();
+      if (!ok[0] || !ok[1] || !ok[2] || !ok[3] ||
+          hashv.size() != 2 * kSha256Len)
+        continue;
+      entry.hash_ = merkle_hash_t(hashv);
+      entries_[info.mid(0, n - 5).join("|").toStdString()] = entry;
+    }
+  }
+
+  QString file_;
+  uint64_t chunk_size_;
+  int64_t stamp_;          // Stamp of the cache loaded.
+  int64_t pending_stamp_;  // Stamp of the hashing since the last save.
+  bool dirty_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::string key_;
+};
+
+}  // namespace otalib
+
+#endif  // HASH_CACHE_HPP
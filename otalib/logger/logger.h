@@ -39,29 +39,24 @@ using GeneralSuccessCtrl = PrintCtrl<kHeadTagSuccess, ' ', fgColor::Green>;
 
 template <typename ctrl, typename OutputStream, typename... Args>
 void print(OutputStream&& out, Args&&... args) {
-  static ::std::stringstream inner_stream;
+  // One stream for each thread, the messages are built without a lock. The
+  // delta packs are generated on several threads at once.
+  thread_local ::std::stringstream inner_stream;
   static SpinLock slock;
 
   if constexpr (ctrl::time()) {
     char buf[64]{0};
     time_t t = time(nullptr);
     strftime(buf, 64, "%Y-%m-%d %H:%M:%S", localtime(&t));
-    std::string head = std::string(buf) + ctrl::sep();
-    {
-      if constexpr (ctrl::isThreadSafe()) SpinLock::Acquire locker(slock);
-      inner_stream << head;
-    }
+    inner_stream << buf << ctrl::sep();
   }
 
   auto outWithSep = [&](auto& stream, const auto& args) {
     stream << ctrl::sep() << args;
   };
 
-  {
-    if constexpr (ctrl::isThreadSafe()) SpinLock::Acquire locker(slock);
-    inner_stream << ctrl::tag();
-    (..., outWithSep(inner_stream, args));
-  }
+  inner_stream << ctrl::tag();
+  (..., outWithSep(inner_stream, args));
   // Put all the msg into out.
   std::string msg =
       LOGGER_COLOR(ctrl::color(), bgColor::None).operator()(inner_stream.str());
@@ -70,13 +65,17 @@ void print(OutputStream&& out, Args&&... args) {
   inner_stream.str("");
 
   // May need support for customized endl;
-  {
-    if constexpr (ctrl::isThreadSafe()) SpinLock::Acquire locker(slock);
+  // The line is written at once, so the lines of the threads don't mix.
+  if constexpr (ctrl::isLinefeed()) msg += '\n';
+  auto write = [&] {
     out << msg;
-    if constexpr (ctrl::isLinefeed())
-      out << '\n';
-    else
-      out << std::flush;
+    if constexpr (!ctrl::isLinefeed()) out << std::flush;
+  };
+  if constexpr (ctrl::isThreadSafe()) {
+    SpinLock::Acquire locker(slock);
+    write();
+  } else {
+    write();
   }
   LOGGER_COLOR_RESET
 }
@@ -0,0 +1,121 @@
+#ifndef MERKLE_PROOF_HPP
+#define MERKLE_PROOF_HPP
+
+#include <QFile>
+#include <QSaveFile>
+#include <QString>
+#include <QStringList>
+#include <QTextStream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "delta_log.h"
+#include "sha256_hash.h"
+
+namespace otalib {
+
+// Inclusion proofs of the files a delta pack writes, against the root of the
+// target version. The file is in the pack, so it's covered by the pack's
+// signature:
+//      file|hex of merkle::PathT::serialise()
+// The client checks the files it touched without the other leaves.
+static inline const QString kMerkleProofName = "merkle_proof";
+
+using merkle_path_t = merkle_tree_t::Path;
+using MerkleProofs =
+    ::std::unordered_map<::std::string, ::std::shared_ptr<merkle_path_t>>;
+
+// desc: The entries of "entries" written by "applied": the files added or
+// patched, and all the files under an added directory.
+// ret: Their indexes in "entries", in order.
+inline ::std::vector<size_t> TouchedEntries(
+    const DeltaInfoStream& applied,
+    const ::std::vector<::std::string>& entries) {
+  ::std::unordered_set<::std::string> files;
+  ::std::vector<::std::string> dirs;
+  for (const auto& info : applied) {
+    if (info.action == Action::DELETEACT) continue;
+    if (info.category == Category::DIR)
+      dirs.push_back(info.position.toStdString() + "/");
+    else
+      files.insert(info.position.toStdString());
+  }
+
+  ::std::vector<size_t> touched;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const ::std::string& entry = entries[i];
+    bool hit = files.count(entry) > 0;
+    for (size_t k = 0; !hit && k < dirs.size(); ++k)
+      hit = entry.compare(0, dirs[k].size(), dirs[k]) == 0;
+    if (hit) touched.push_back(i);
+  }
+  return touched;
+}
+
+// desc: Write the proofs of "files" in the tree of "leaves", the leaf hashes of
+// "entries" in order. A file not in "entries" is skipped.
+inline bool WriteMerkleProofs(const ::std::vector<::std::string>& entries,
+                              const ::std::vector<merkle_hash_t>& leaves,
+                              const ::std::vector<size_t>& files,
+                              const QString& out) {
+  if (entries.size() != leaves.size()) return false;
+  merkle_tree_t tree;
+  for (const auto& leaf : leaves) tree.insert(leaf);
+
+  QString content;
+  for (size_t index : files) {
+    if (index >= leaves.size()) continue;
+    ::std::vector<uint8_t> bytes;
+    tree.path(index)->serialise(bytes);
+    QByteArray raw(reinterpret_cast<const char*>(bytes.data()),
+                   static_cast<int>(bytes.size()));
+    content += QString::fromStdString(entries[index]) + "|" +
+               QString::fromLatin1(raw.toHex()) + "\n";
+  }
+
+  QSaveFile file(out);
+  QByteArray raw = content.toUtf8();
+  return file.open(QFile::WriteOnly) && file.write(raw) == raw.size() &&
+         file.commit();
+}
+
+// ret: Empty if there's no proof file, a broken line is skipped.
+inline MerkleProofs ReadMerkleProofs(const QString& path) {
+  MerkleProofs proofs;
+  QFile file(path);
+  if (!file.open(QFile::ReadOnly)) return proofs;
+  QTextStream stream(&file);
+  QString line;
+  // leaf, leaf index, max index, count, then count * (hash, direction).
+  constexpr size_t kHead = kSha256Len + 3 * sizeof(uint64_t);
+  while (stream.readLineInto(&line)) {
+    int sep = line.lastIndexOf('|');
+    if (sep < 0) continue;
+    QByteArray raw = QByteArray::fromHex(line.mid(sep + 1).toLatin1());
+    ::std::vector<uint8_t> bytes(raw.begin(), raw.end());
+    if (bytes.size() < kHead) continue;
+    size_t position = kHead - sizeof(uint64_t);
+    uint64_t count = merkle::deserialise_uint64_t(bytes, position);
+    if (count > 64 || bytes.size() != kHead + count * (kSha256Len + 1))
+      continue;
+    proofs[line.left(sep).toStdString()] =
+        ::std::make_shared<merkle_path_t>(bytes);
+  }
+  return proofs;
+}
+
+// desc: Whether "path" proves "leaf" is the leaf "index" of a tree of "count"
+// leaves with "root".
+inline bool VerifyMerkleProof(const merkle_path_t& path, size_t index,
+                              size_t count, const merkle_hash_t& leaf,
+                              const merkle_hash_t& root) {
+  return path.leaf_index() == index && path.max_index() + 1 == count &&
+         path.leaf() == leaf && path.verify(root);
+}
+
+}  // namespace otalib
+
+#endif  // MERKLE_PROOF_HPP
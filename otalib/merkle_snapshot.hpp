@@ -0,0 +1,233 @@
+#ifndef MERKLE_SNAPSHOT_HPP
+#define MERKLE_SNAPSHOT_HPP
+
+#include <zlib.h>
+
+#include <QDataStream>
+#include <QFile>
+#include <QSaveFile>
+#include <QString>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "sha256_hash.h"
+
+namespace otalib {
+
+static inline const QString kMerkleSnapshotName = "file_log_tree";
+
+// Merkle tree with every level kept, the same shape as merkle_tree_t(see
+// MerkleRootOf()). A changed leaf costs only the nodes on its way to the root:
+// after k leaves are updated, root() hashes O(k log n) nodes, the dirty nodes
+// of one level in one batch. merkle_tree_t only appends, so it's rebuilt from
+// all the leaves instead.
+class IncrementalMerkleTree {
+ public:
+  // desc: Build the tree from scratch.
+  void build(::std::vector<merkle_hash_t> leaves) {
+    levels_.clear();
+    dirty_.clear();
+    if (leaves.empty()) return;
+    levels_.push_back(::std::move(leaves));
+    while (levels_.back().size() > 1) {
+      const auto& level = levels_.back();
+      size_t pairs = level.size() / 2;
+      ::std::vector<merkle_hash_t> parents(pairs + level.size() % 2);
+      Sha256Hash64(level[0].bytes, parents[0].bytes, pairs);
+      if (level.size() % 2) parents.back() = level.back();
+      levels_.push_back(::std::move(parents));
+    }
+  }
+
+  size_t size() const { return levels_.empty() ? 0 : levels_[0].size(); }
+
+  const merkle_hash_t& leaf(size_t index) const { return levels_[0][index]; }
+
+  // desc: Replace a leaf. The nodes above are hashed again by root().
+  void update(size_t index, const merkle_hash_t& hash) {
+    if (levels_[0][index] == hash) return;
+    levels_[0][index] = hash;
+    dirty_.push_back(index);
+  }
+
+  // ret: A zero hash if there's no leaf.
+  merkle_hash_t root() {
+    if (levels_.empty()) return merkle_hash_t();
+    ::std::vector<uint8_t> in;
+    ::std::vector<uint8_t> out;
+    for (size_t l = 0; l + 1 < levels_.size() && !dirty_.empty(); ++l) {
+      const auto& level = levels_[l];
+      auto& parents = levels_[l + 1];
+      for (auto& index : dirty_) index /= 2;
+      ::std::sort(dirty_.begin(), dirty_.end());
+      dirty_.erase(::std::unique(dirty_.begin(), dirty_.end()), dirty_.end());
+
+      // The parents with two children, left || right side by side.
+      in.clear();
+      size_t pairs = 0;
+      for (size_t p : dirty_) {
+        if (2 * p + 1 >= level.size()) {
+          parents[p] = level[2 * p];
+          continue;
+        }
+        in.insert(in.end(), level[2 * p].bytes, level[2 * p].bytes + 64);
+        ++pairs;
+      }
+      out.resize(pairs * kSha256Len);
+      if (pairs > 0) Sha256Hash64(in.data(), out.data(), pairs);
+      size_t k = 0;
+      for (size_t p : dirty_) {
+        if (2 * p + 1 >= level.size()) continue;
+        parents[p] = merkle_hash_t(out.data() + kSha256Len * k++);
+      }
+    }
+    dirty_.clear();
+    return levels_.back().front();
+  }
+
+  void serialise(QDataStream& stream) const {
+    stream << static_cast<quint32>(levels_.size());
+    for (const auto& level : levels_) {
+      stream << static_cast<quint64>(level.size());
+      stream.writeRawData(reinterpret_cast<const char*>(level[0].bytes),
+                          static_cast<int>(level.size() * kSha256Len));
+    }
+  }
+
+  // ret: false if the data is broken, the tree is empty then.
+  bool deserialise(QDataStream& stream) {
+    levels_.clear();
+    dirty_.clear();
+    quint32 count = 0;
+    stream >> count;
+    quint64 expect = 0;
+    for (quint32 l = 0; l < count && stream.status() == QDataStream::Ok; ++l) {
+      quint64 size = 0;
+      stream >> size;
+      // Each level is half of the one below, rounded up.
+      if (size == 0 || (l > 0 && size != expect) || size > (1ull << 32)) break;
+      ::std::vector<merkle_hash_t> level(size);
+      int bytes = static_cast<int>(size * kSha256Len);
+      if (stream.readRawData(reinterpret_cast<char*>(level[0].bytes), bytes) !=
+          bytes)
+        break;
+      levels_.push_back(::std::move(level));
+      expect = (size + 1) / 2;
+    }
+    if (levels_.size() != count || (count > 0 && levels_.back().size() != 1)) {
+      levels_.clear();
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  ::std::vector<::std::vector<merkle_hash_t>> levels_;
+  ::std::vector<size_t> dirty_;  // Indexes of the changed nodes on the level.
+};
+
+// The tree of an app, kept next to its file_log so the next run starts from
+// it. The content is:
+//      "OTAMT1" crc32(body) body
+// body: the entries of file_log, then the levels of the tree. It's only a
+// cache, the leaves are still compared with the ones given to root(); a broken
+// or stale snapshot is built again.
+class MerkleSnapshot {
+  static constexpr char kMagic[] = "OTAMT1";
+  static constexpr int kMagicLen = sizeof(kMagic) - 1;
+
+ public:
+  explicit MerkleSnapshot(const QString& file) : file_(file), dirty_(false) {
+    load();
+  }
+
+  // desc: Root of "leaves", the leaf hashes of "entries" in order. The tree
+  // is updated on the leaves changed since the last call, or built again if
+  // the entries are not the same. "entries" are strings or string views, they
+  // are copied only when they have changed.
+  template <typename Entries>
+  merkle_hash_t root(const Entries& entries,
+                     ::std::vector<merkle_hash_t> leaves) {
+    if (!::std::equal(entries.begin(), entries.end(), entries_.begin(),
+                      entries_.end()) ||
+        tree_.size() != leaves.size()) {
+      entries_.assign(entries.begin(), entries.end());
+      tree_.build(::std::move(leaves));
+      dirty_ = true;
+      return tree_.root();
+    }
+    for (size_t i = 0; i < leaves.size(); ++i) {
+      if (tree_.leaf(i) == leaves[i]) continue;
+      tree_.update(i, leaves[i]);
+      dirty_ = true;
+    }
+    return tree_.root();
+  }
+
+  // desc: Write the snapshot back if it has changed. The failure is ignored.
+  void save() {
+    if (!dirty_) return;
+    QByteArray body;
+    {
+      QDataStream stream(&body, QIODevice::WriteOnly);
+      stream << static_cast<quint64>(entries_.size());
+      for (const auto& entry : entries_)
+        stream.writeBytes(entry.data(), static_cast<uint>(entry.size()));
+      tree_.root();
+      tree_.serialise(stream);
+    }
+    quint32 crc = ::crc32(0, reinterpret_cast<const Bytef*>(body.constData()),
+                          static_cast<uInt>(body.size()));
+
+    QSaveFile file(file_);
+    if (!file.open(QFile::WriteOnly)) return;
+    QDataStream stream(&file);
+    stream.writeRawData(kMagic, kMagicLen);
+    stream << crc;
+    stream.writeRawData(body.constData(), body.size());
+    if (stream.status() != QDataStream::Ok || !file.commit()) return;
+    dirty_ = false;
+  }
+
+ private:
+  void load() {
+    QFile file(file_);
+    if (!file.open(QFile::ReadOnly)) return;
+    QByteArray raw = file.readAll();
+    if (raw.size() < kMagicLen + 4 || !raw.startsWith(kMagic)) return;
+    QDataStream head(raw.mid(kMagicLen, 4));
+    quint32 crc = 0;
+    head >> crc;
+    QByteArray body = raw.mid(kMagicLen + 4);
+    if (crc != ::crc32(0, reinterpret_cast<const Bytef*>(body.constData()),
+                       static_cast<uInt>(body.size())))
+      return;
+
+    QDataStream stream(body);
+    quint64 count = 0;
+    stream >> count;
+    for (quint64 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+      char* entry = nullptr;
+      uint size = 0;
+      stream.readBytes(entry, size);
+      if (entry) entries_.emplace_back(entry, size);
+      delete[] entry;
+    }
+    if (stream.status() != QDataStream::Ok || entries_.size() != count ||
+        !tree_.deserialise(stream) ||
+        tree_.size() != entries_.size()) {
+      entries_.clear();
+      tree_.build({});
+    }
+  }
+
+  QString file_;
+  bool dirty_;
+  ::std::vector<::std::string> entries_;
+  IncrementalMerkleTree tree_;
+};
+
+}  // namespace otalib
+
+#endif  // MERKLE_SNAPSHOT_HPP
@@ -68,6 +68,16 @@ class OTAError : public ::std::exception {
     QString extra_;
   };
 
+  struct S_file_hash_mismatch {
+    QString filename_;
+    QString extra_;
+  };
+
+  struct S_archive_corrupt {
+    QString archive_;
+    QString extra_;
+  };
+
   enum Index : uint8_t {
     index_success = 0,
     index_file_open_fail = 1,
@@ -79,7 +89,9 @@ class OTAError : public ::std::exception {
     index_file_delete_fail = 7,
     index_file_write_fail = 8,
     index_verify_fail = 9,
-    index_hash_check_fail = 10
+    index_hash_check_fail = 10,
+    index_file_hash_mismatch = 11,
+    index_archive_corrupt = 12
   };
 
  private:
@@ -93,7 +105,9 @@ class OTAError : public ::std::exception {
                                      S_file_delete_fail,            // 7
                                      S_file_write_fail,             // 8
                                      S_verify_fail,                 // 9
-                                     S_hash_check_fail              // 10
+                                     S_hash_check_fail,             // 10
+                                     S_file_hash_mismatch,          // 11
+                                     S_archive_corrupt              // 12
                                      >;
   StorageType stor_;
   ::std::string msg_;
@@ -177,6 +191,17 @@ class OTAError : public ::std::exception {
               altr.extra_;
         break;
       }
+      case index_file_hash_mismatch: {
+        const auto& altr = ::std::get<index_file_hash_mismatch>(stor_);
+        msg = "[" + altr.filename_ + "] File's hash mismatches the pack." +
+              altr.extra_;
+        break;
+      }
+      case index_archive_corrupt: {
+        const auto& altr = ::std::get<index_archive_corrupt>(stor_);
+        msg = "[" + altr.archive_ + "] Archive is corrupt." + altr.extra_;
+        break;
+      }
     }
     msg_ = msg.toStdString();
   }
@@ -5,60 +5,202 @@
 #include <QFileInfo>
 #include <QString>
 #include <QTextStream>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "diff.h"
 #include "file_logger.h"
+#include "merkle_proof.hpp"
 #include "otaerr.hpp"
+#include "pack_cache.hpp"
 #include "property.hpp"
+#include "route_manifest.hpp"
 #include "shell_cmd.hpp"
 #include "signature.h"
+#include "tar_archive.h"
 
 namespace otalib {
 using namespace ::otalib::bs;
 namespace {
-bool lverify(const QString& file, const QFileInfo& pubkey,
+// Verified in memory, the hops on different threads don't share a file. The
+// scheme is told by the signature file.
+bool lverify(const QByteArray& pack, const QFileInfo& pubkey,
              const QFileInfo& sig) {
-  QFile target(file);
-  if (!target.open(QFile::ReadOnly)) {
-    OTAError::S_file_open_fail xerr{::std::move(file), STRING_SOURCE_LOCATION};
+  QFile sigfile(sig.absoluteFilePath());
+  if (!sigfile.open(QFile::ReadOnly)) {
+    OTAError::S_file_open_fail xerr{sigfile.fileName(), STRING_SOURCE_LOCATION};
     throw OTAError{::std::move(xerr)};
   }
+  QByteArray sigval = sigfile.readAll();
+  sigfile.close();
+  return verifyData(pack, sigval, pubkey);
+}
+}  // namespace
 
-  QCryptographicHash hash(kHashAlgorithm);
-  hash.addData(&target);
-  QByteArray hashval = hash.result();
-  target.close();
+// Leaf hashes of the app, keyed by the path recorded in file_log. The hashes
+// carried by the applied actions have been verified when the files were
+// written, so only the files without one need to be hashed again. The tree is
+// kept in the app's merkle snapshot: a pack touching k files costs O(k log n)
+// nodes, and the snapshot is written back when the tracker is destroyed.
+class AppHashTracker {
+  struct Leaf {
+    merkle_hash_t hash_;
+    bool whole_;  // Hash of the whole file, carried by an action.
+  };
+  using LeafTable = ::std::unordered_map<::std::string, Leaf>;
 
-  QFile tmphash("tmphash");
-  if (!tmphash.open(QFile::WriteOnly | QFile::Truncate)) {
-    OTAError::S_file_open_fail xerr{tmphash.fileName(), STRING_SOURCE_LOCATION};
-    throw OTAError{::std::move(xerr)};
+ public:
+  explicit AppHashTracker(const QDir& app_root)
+      : app_root_(app_root),
+        root_path_(app_root.absolutePath().toStdString() + "/") {}
+  ~AppHashTracker() {
+    if (snapshot_) snapshot_->save();
   }
+  AppHashTracker(const AppHashTracker&) = delete;
+  AppHashTracker& operator=(const AppHashTracker&) = delete;
 
-  if (tmphash.write(hashval) != hashval.size()) {
-    tmphash.close();
-    OTAError::S_file_write_fail xerr{tmphash.fileName(),
-                                     STRING_SOURCE_LOCATION};
-    throw OTAError{::std::move(xerr)};
-  };
+  // Take the actions performed by one pack.
+  void update(const DeltaInfoStream& applied) {
+    for (const auto& info : applied) {
+      ::std::string pos = info.position.toStdString();
+      if (info.category == Category::DIR) {
+        // The whole directory is added or deleted.
+        eraseUnder(pos);
+        continue;
+      }
+
+      leaves_.erase(pos);
+      if (info.action == Action::DELETEACT) continue;
+      QString hashv = targetHashOf(info);
+      if (!hashv.isEmpty())
+        leaves_.emplace(pos, Leaf{merkle_hash_t(hashv.toStdString()), true});
+    }
+  }
 
-  tmphash.close();
-  // Verifiy.
-  bool succ = verify(QFileInfo(tmphash.fileName()), sig, pubkey);
+  // Merkle root of the app according to its current file_log.
+  merkle_hash_t root() {
+    ::std::vector<::std::string> entries =
+        FileLogger::ReadNames(app_root_.filePath(kFileLogName));
+    if (entries.empty()) return merkle_hash_t();
 
-  if (!tmphash.remove()) {
-    OTAError::S_file_delete_fail xerr{tmphash.fileName(),
-                                      STRING_SOURCE_LOCATION};
-    throw OTAError{::std::move(xerr)};
+    quint64 chunk_size =
+        ReadProperty(app_root_.filePath(kPropertyName)).hash_chunk_size_;
+
+    // Never seen or touched without a hash. Hash them from the disk, unless
+    // the hash cache still knows them.
+    ::std::vector<::std::string> missing;
+    ::std::vector<::std::string> paths;
+    for (const auto& entry : entries) {
+      auto iter = leaves_.find(entry);
+      if (iter != leaves_.end() && isLeaf(entry, iter->second, chunk_size))
+        continue;
+      if (iter != leaves_.end()) leaves_.erase(iter);
+      missing.push_back(entry);
+      paths.push_back(pathOf(entry));
+    }
+    HashCache cache(app_root_.filePath(kHashCacheName), chunk_size);
+    ::std::vector<merkle_hash_t> hashes = cache.hash(missing, paths);
+    cache.retain(entries);
+    cache.save();
+    for (size_t i = 0; i < missing.size(); ++i)
+      leaves_.emplace(missing[i], Leaf{hashes[i], false});
+
+    ::std::vector<merkle_hash_t> leaves;
+    leaves.reserve(entries.size());
+    for (const auto& entry : entries) leaves.push_back(leaves_.at(entry).hash_);
+    // Loaded at the first check, not needed without the safe mode.
+    if (!snapshot_) snapshot_.emplace(app_root_.filePath(kMerkleSnapshotName));
+    return snapshot_->root(entries, ::std::move(leaves));
   }
 
-  return succ;
-}
-}  // namespace
-// desc: Generate the whole pack for patching.
+  // desc: Check the files written by "applied" against "root" with the proofs
+  // shipped in the pack, the other leaves are not needed. The files without a
+  // carried hash are hashed, only them.
+  // ret: false if a file written has no valid proof, root() is needed then.
+  bool prove(const DeltaInfoStream& applied, const MerkleProofs& proofs,
+             const merkle_hash_t& root) {
+    ::std::vector<::std::string> entries =
+        FileLogger::ReadNames(app_root_.filePath(kFileLogName));
+    ::std::vector<size_t> touched = TouchedEntries(applied, entries);
+    quint64 chunk_size =
+        ReadProperty(app_root_.filePath(kPropertyName)).hash_chunk_size_;
+
+    ::std::vector<::std::string> missing;
+    ::std::vector<::std::string> paths;
+    for (size_t index : touched) {
+      const ::std::string& entry = entries[index];
+      if (proofs.find(entry) == proofs.end()) return false;
+      auto iter = leaves_.find(entry);
+      if (iter != leaves_.end() && isLeaf(entry, iter->second, chunk_size))
+        continue;
+      if (iter != leaves_.end()) leaves_.erase(iter);
+      missing.push_back(entry);
+      paths.push_back(pathOf(entry));
+    }
+    ::std::vector<merkle_hash_t> hashes =
+        Sha256HashFiles(paths, 0, chunk_size);
+    for (size_t i = 0; i < missing.size(); ++i)
+      leaves_.emplace(missing[i], Leaf{hashes[i], false});
+
+    for (size_t index : touched) {
+      const ::std::string& entry = entries[index];
+      if (!VerifyMerkleProof(*proofs.at(entry), index, entries.size(),
+                             leaves_.at(entry).hash_, root))
+        return false;
+    }
+    return true;
+  }
+
+ private:
+  // The hashes carried are of the whole files. They are the leaves only when
+  // the file fits in one chunk.
+  bool isLeaf(const ::std::string& entry, const Leaf& leaf,
+              quint64 chunk_size) const {
+    if (!leaf.whole_ || chunk_size == 0) return true;
+    struct stat st;
+    return ::stat(pathOf(entry).c_str(), &st) == 0 &&
+           static_cast<quint64>(st.st_size) <= chunk_size;
+  }
+
+  ::std::string pathOf(const ::std::string& entry) const {
+    return root_path_ + entry;
+  }
+
+  void eraseUnder(const ::std::string& dir) {
+    ::std::string prefix = dir + "/";
+    for (auto iter = leaves_.begin(); iter != leaves_.end();) {
+      if (iter->first.compare(0, prefix.size(), prefix) == 0)
+        iter = leaves_.erase(iter);
+      else
+        ++iter;
+    }
+  }
+
+  QDir app_root_;
+  ::std::string root_path_;
+  LeafTable leaves_;
+  ::std::optional<MerkleSnapshot> snapshot_;
+};
+
+// {pack, hash, signature} of one step.
+using PackFiles = ::std::tuple<QFileInfo, QFileInfo, QFileInfo>;
+// {manifest, signature}, both empty if it can't be made.
+using RouteManifestMaker = ::std::function<::std::pair<QByteArray, QByteArray>(
+    const QByteArray& apply_log, const ::std::vector<PackFiles>& packs)>;
+
+// desc: Generate the whole pack for patching. The packs are written into
+// "writer" directly, the caller finishes it.
 // param:
-//      dest_dir: Destination directory.
+//      writer: The archive of the whole pack.
 // param:
 //      paths: The paths generate by VersionMap::search().
 // param:
@@ -68,170 +210,528 @@ bool lverify(const QString& file, const QFileInfo& pubkey,
 //      First : The pack's filename
 //      Second: The app's hash file.
 //      Third : The pack's signature.
+// param:
+//      omit: If set, tells the packs the client has cached. Their signatures
+//      and hashes are still sent, the packs are not.
+// param:
+//      manifest: If set, makes the signed route manifest of apply_log and the
+//      packs found. It returns the manifest and its signature, the archive goes
+//      without them if they're empty.
+// ret: How many packs are left out.
 template <typename VersionType, typename CallbackOnFind,
           typename EdgeType = ::std::pair<VersionType, VersionType>>
-void getPackFromPaths(const QDir& dest_dir,
-                      const ::std::vector<EdgeType>& paths,
-                      CallbackOnFind&& callback) {
-  using CallbackType = ::std::tuple<QFileInfo, QFileInfo, QFileInfo>(
-      const VersionType&, const VersionType&);
-  static_assert(::std::is_same_v<CallbackOnFind, CallbackType>,
+size_t archivePackFromPaths(
+    TarGzWriter& writer, const ::std::vector<EdgeType>& paths,
+    CallbackOnFind&& callback,
+    const ::std::function<bool(const QFileInfo& pack, const QFileInfo& sig)>&
+        omit = nullptr,
+    const RouteManifestMaker& manifest = nullptr) {
+  static_assert(::std::is_invocable_r_v<::std::tuple<QFileInfo, QFileInfo,
+                                                    QFileInfo>,
+                                       CallbackOnFind, const VersionType&,
+                                       const VersionType&>,
                 "Callback function type dismatched.");
-  //
-  QString lpath = dest_dir.filePath(kApplyLogName);
-  QFile log(lpath);
-  if (!log.open(QFile::WriteOnly | QFile::Truncate)) {
-    OTAError::S_file_open_fail xerror{::std::move(lpath),
-                                      STRING_SOURCE_LOCATION};
-    throw OTAError{::std::move(xerror)};
+  // Find all the packs first, apply_log leads the archive.
+  ::std::vector<PackFiles> packs;
+  for (auto& p : paths) {
+    const auto& [prev, next] = p;
+    packs.push_back(callback(prev, next));
   }
+
   // Log records the order of applying delta pack,
   // and the hash info.
+  QString log;
   QTextStream stream(&log);
-  for (auto& p : paths) {
-    //
-    const auto& [prev, next] = p;
-    const auto [file, hash, sig] = callback(prev, next);
-    // Copy the pack into "dest_dir", and then generate the current info.
-    QString targetf = file.absoluteFilePath();
-    QString targeth = hash.absoluteFilePath();
-    QString targets = sig.absoluteFilePath();
-    QString destf = dest_dir.filePath(file.fileName());
-    QString desth = dest_dir.filePath(hash.fileName());
-    QString dests = dest_dir.filePath(sig.fileName());
-
-    // copy the pack into destination.
-    if (!QFile::copy(targetf, destf)) {
-      log.close();
-      OTAError::S_file_copy_fail xerror{
-          ::std::move(targetf), ::std::move(destf), STRING_SOURCE_LOCATION};
-      throw OTAError{::std::move(xerror)};
-    }
+  for (const auto& [file, hash, sig] : packs)
+    stream << file.fileName() << "|" << hash.fileName() << "|" << sig.fileName()
+           << "\n";
+  stream.flush();
+  ::std::string logv = log.toStdString();
 
-    // copy the hash info into destination.
-    if (!QFile::copy(targeth, desth)) {
-      log.close();
-      OTAError::S_file_copy_fail xerror{
-          ::std::move(targeth), ::std::move(desth), STRING_SOURCE_LOCATION};
-      throw OTAError{::std::move(xerror)};
+  writer.addDirectory(".");
+  writer.addFile("./" + kApplyLogName.toStdString(), logv.data(), logv.size());
+  if (manifest) {
+    auto [content, sig] = manifest(QByteArray::fromStdString(logv), packs);
+    if (!content.isEmpty() && !sig.isEmpty()) {
+      writer.addFile("./" + kRouteManifestName.toStdString(),
+                     content.constData(), static_cast<size_t>(content.size()));
+      writer.addFile("./" + kRouteManifestSigName.toStdString(),
+                     sig.constData(), static_cast<size_t>(sig.size()));
     }
-
-    // copy the signature into destination.
-    if (!QFile::copy(targets, dests)) {
-      log.close();
-      OTAError::S_file_copy_fail xerror{
-          ::std::move(targets), ::std::move(dests), STRING_SOURCE_LOCATION};
-      throw OTAError{::std::move(xerror)};
+  }
+  // The signature and the hash come before the pack, so the receiver has all
+  // it needs when the pack is complete.
+  size_t omitted = 0;
+  for (const auto& [file, hash, sig] : packs) {
+    writer.addFile("./" + sig.fileName().toStdString(), sig.absoluteFilePath());
+    writer.addFile("./" + hash.fileName().toStdString(),
+                   hash.absoluteFilePath());
+    if (omit && omit(file, sig)) {
+      ++omitted;
+      continue;
     }
+    writer.addFile("./" + file.fileName().toStdString(),
+                   file.absoluteFilePath());
+  }
+  return omitted;
+}
 
-    stream << file.fileName() << "|" << hash.fileName() << "|" << sig.fileName()
-           << "\n";
+// One step of apply_log.
+struct PackHop {
+  QString packname_;
+  QByteArray pack_;       // Content of the pack(tar.gz).
+  QFileInfo signature_;   // Signature file of the pack.
+  QByteArray sig_data_;   // Signature received, verified without a file.
+  ::std::string hash_;    // Hash of the app after the pack.
+  QString sig_hash_;      // Key in the pack cache.
+  QByteArray digest_;     // From the route manifest, empty without one.
+  bool from_cache_ = false;
+  bool verified_ = false;  // Verified while it was received.
+};
+
+// desc: Verify one pack, by the digest of the route manifest or by its own
+// signature, then uncompress it under "pack_root" and apply it on app.
+// The pack itself arrives in memory, but its content is still extracted into
+// "pack_root"/TmPdIc and patched from there: applyDeltaPack() reads the logs,
+// the patches and the added trees from a directory, and resumes by the
+// done_log kept in it. The directory is removed after each step.
+// param:
+//      tracker: Leaf hashes of the app, carried from the previous step. Used
+//      only under safe mode.
+// param:
+//      journal: If not null, records how to undo the pack.
+inline void applyPackHop(const QDir& app_root, const QDir& pack_root,
+                         const PackHop& hop, const QFileInfo& pubkey,
+                         bool safe_mode, AppHashTracker& tracker,
+                         UndoJournal* journal = nullptr) {
+  // Verify
+  bool succ;
+  if (hop.verified_)
+    succ = true;
+  else if (!hop.digest_.isEmpty())
+    succ = RouteDigestOf(hop.pack_) == hop.digest_;
+  else if (!hop.sig_data_.isEmpty())
+    succ = verifyData(hop.pack_, hop.sig_data_, pubkey);
+  else
+    succ = lverify(hop.pack_, pubkey, hop.signature_);
+  if (!succ) {
+    QString info = "[" + hop.packname_ + "]current pack verify fails.";
+    OTAError::S_verify_fail xerr{::std::move(info), STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerr)};
+  }
+
+  // remake the temp directory.
+  pack_root.mkdir("TmPdIc");
+  QDir tmp_root(pack_root);
+  tmp_root.cd("TmPdIc");
+
+  // Verify succeed.
+  DeltaInfoStream applied;
+  MerkleProofs proofs;
+  try {
+    tar_extract_archive_buffer_gzip(hop.pack_, tmp_root.absolutePath());
+    if (safe_mode)
+      proofs = ReadMerkleProofs(tmp_root.filePath(kMerkleProofName));
+    if (journal) journal->beginPack();
+    succ = applyDeltaPack(tmp_root, app_root, &applied, journal);
+    if (journal) journal->endPack();
+  } catch (...) {
+    tmp_root.removeRecursively();
+    throw;
+  }
+  // remove the previsou content.
+  tmp_root.removeRecursively();
+  if (!succ) {
+    OTAError::S_apply_pack_unexpected_fail xerr{hop.packname_,
+                                                STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerr)};
+  }
+
+  if (!safe_mode) return;
+
+  // Do hash check. The files written are enough if the pack proves them all.
+  tracker.update(applied);
+  if (!proofs.empty() && hop.hash_.size() == 2 * kSha256Len &&
+      tracker.prove(applied, proofs, merkle_hash_t(hop.hash_)))
+    return;
+  ::std::string app_value = tracker.root().to_string();
+  if (app_value != hop.hash_) {
+    Property pp = ReadProperty(app_root.filePath(kPropertyName));
+    OTAError::S_hash_check_fail xerror{::std::move(pp.app_version_),
+                                       STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
   }
-  log.close();
 }
 
 // desc: After the uncompress, all the pack stores in "pack_root". This func is
 // to apply all the packs on app.
 
-// safe mode: Under saft mode, there's hash check for app after every step.
+// safe mode: Under saft mode, there's hash check for app after every step. Only
+// the files without a verified hash are read again for the check.
 template <typename VersionType,
           typename EdgeType = ::std::pair<VersionType, VersionType>>
 void applyPackOnApp(const QDir& app_root, const QDir& pack_root,
                     const QFileInfo& pubkey, bool safe_mode = true) {
+  AppHashTracker tracker(app_root);
+
+  auto readAll = [](const QString& path) {
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+      OTAError::S_file_open_fail xerror{path, STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+    return file.readAll();
+  };
+
   // Apply sequence is decicded according to apply_log.
   QString log_path = pack_root.filePath(kApplyLogName);
-  QFile log_file(log_path);
-  if (!log_file.open(QFile::ReadOnly)) {
-    OTAError::S_file_open_fail xerror{::std::move(log_path),
-                                      STRING_SOURCE_LOCATION};
-    throw OTAError{::std::move(xerror)};
+  QByteArray log_content = readAll(log_path);
+
+  // One signature for the whole route if the server sends the manifest.
+  ::std::optional<RouteDigests> route;
+  if (pack_root.exists(kRouteManifestName)) {
+    route.emplace();
+    if (!VerifyRouteManifest(
+            readAll(pack_root.filePath(kRouteManifestName)),
+            readAll(pack_root.filePath(kRouteManifestSigName)), log_content,
+            pubkey, &*route)) {
+      OTAError::S_verify_fail xerr{kRouteManifestName, STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerr)};
+    }
   }
 
-  QTextStream log(&log_file);
+  QTextStream log(&log_content, QIODevice::ReadOnly);
   QString line;
-  QStringList info;
   while (log.readLineInto(&line)) {
-    // remake the temp directory.
-    pack_root.mkdir("TmPdIc");
-    QDir tmp_root(pack_root);
-    tmp_root.cd("TmPdIc");
-
-    // clear the list.
-    info.clear();
-
     // Info: packname|hashname|signame
-    info = line.split("|");
+    QStringList info = line.split("|");
     if (info.size() != 3) {
-      log_file.close();
-      tmp_root.removeRecursively();
       OTAError::S_general xerr{"Invalid apply_log info." +
                                STRING_SOURCE_LOCATION};
       throw OTAError{::std::move(xerr)};
     }
 
-    // Verify the signature of current pack. Then uncompress and apply.
-    QString packname = info.at(0);
-    QString packfile = pack_root.filePath(packname);
-    QString signame = info.at(2);
-    QFileInfo signature{pack_root.filePath(signame)};
+    PackHop hop;
+    hop.packname_ = info.at(0);
+    hop.pack_ = readAll(pack_root.filePath(info.at(0)));
+    hop.signature_ = QFileInfo(pack_root.filePath(info.at(2)));
+    QByteArray hash;
+    if (safe_mode || route) hash = readAll(pack_root.filePath(info.at(1)));
+    if (route) {
+      auto digest = route->find(info.at(0));
+      if (digest == route->end() ||
+          !MatchRouteDigest(*route, info.at(1), hash)) {
+        OTAError::S_verify_fail xerr{info.at(0), STRING_SOURCE_LOCATION};
+        throw OTAError{::std::move(xerr)};
+      }
+      hop.digest_ = digest->second;
+    }
+    if (safe_mode) hop.hash_ = hash.toStdString();
+    applyPackHop(app_root, pack_root, hop, pubkey, safe_mode, tracker);
+  }
+}
 
-    // Verify
-    bool succ = lverify(packfile, pubkey, signature);
-    if (!succ) {
-      log_file.close();
-      tmp_root.removeRecursively();
-      packfile.prepend("[");
-      packfile.append("]");
-      packfile.append("current pack verify fails.");
-      OTAError::S_verify_fail xerr{::std::move(packfile),
-                                   STRING_SOURCE_LOCATION};
+// Apply the packs while the whole pack is still being received. Feed the
+// received bytes in any size, and call finish() after the last one. Each pack
+// is verified and applied on a worker thread, in the order of apply_log, as
+// soon as the pack, its hash and its signature have all arrived. The network
+// thread keeps receiving in the meantime. With a route manifest, its signature
+// is the only one verified, and the packs are checked by their digests.
+// A pack is hashed piece by piece as it's received, the digest is checked when
+// its last byte arrives, so a corrupt pack is rejected on the network thread
+// before anything of it is extracted, and the worker doesn't read it again.
+// "journal", if not null, records how to undo the packs. It must have begun.
+// "cache", if not null, provides the packs the server left out, and keeps the
+// packs applied.
+class PackStreamApplier {
+ public:
+  PackStreamApplier(const QDir& app_root, const QDir& pack_root,
+                    const QFileInfo& pubkey, bool safe_mode = true,
+                    UndoJournal* journal = nullptr, PackCache* cache = nullptr)
+      : app_root_(app_root),
+        pack_root_(pack_root),
+        pubkey_(pubkey),
+        safe_mode_(safe_mode),
+        journal_(journal),
+        cache_(cache),
+        has_log_(false),
+        next_hop_(0),
+        closed_(false),
+        stopped_(false) {
+    reader_.setEntryCallback([this](const TarEntry& entry) {
+      if (entry.type_ != TarEntry::File) return;
+      current_.clear();
+      current_.reserve(static_cast<int>(entry.size_));
+      current_hash_.reset();
+      auto algorithm = packHashOf(QString::fromStdString(entry.name_));
+      if (algorithm) current_hash_.emplace(*algorithm);
+    });
+    reader_.setDataCallback(
+        [this](const TarEntry&, const char* data, size_t size) {
+          current_.append(data, static_cast<int>(size));
+          if (current_hash_)
+            current_hash_->addData(data, static_cast<int>(size));
+        });
+    reader_.setEndCallback(
+        [this](const TarEntry& entry) { onEntryEnd(entry); });
+    worker_ = ::std::thread(&PackStreamApplier::work, this);
+  }
+
+  ~PackStreamApplier() {
+    // Leave the packs not applied yet if it ends with an error.
+    {
+      ::std::lock_guard locker(lock_);
+      stopped_ = true;
+    }
+    cond_.notify_all();
+    if (worker_.joinable()) worker_.join();
+  }
+
+  PackStreamApplier(const PackStreamApplier&) = delete;
+  PackStreamApplier& operator=(const PackStreamApplier&) = delete;
+
+  // Throws if the archive is corrupt or the worker has failed.
+  void feed(const char* data, size_t size) {
+    rethrowError();
+    reader_.feed(data, size);
+  }
+
+  // Wait for all the packs to be applied.
+  void finish() {
+    rethrowError();
+    if (!reader_.finished()) {
+      OTAError::S_archive_corrupt xerror{
+          pack_root_.path(),
+          "Unexpected end of the pack." + STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+    if (!has_log_ || next_hop_ < order_.size()) {
+      OTAError::S_general xerror{"Some packs in apply_log are missing." +
+                                 STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+    {
+      ::std::lock_guard locker(lock_);
+      closed_ = true;
+    }
+    cond_.notify_all();
+    worker_.join();
+    if (cache_) cache_->unpin();
+    rethrowError();
+  }
+
+ private:
+  void onEntryEnd(const TarEntry& entry) {
+    QString name = QString::fromStdString(entry.name_);
+    while (name.startsWith("./")) name.remove(0, 2);
+    QByteArray content = ::std::move(current_);
+    current_ = QByteArray();
+    if (current_hash_) {
+      received_[name] = current_hash_->result();
+      current_hash_.reset();
+    }
+    // Already taken from the cache.
+    if (from_cache_.count(name)) return;
+    entries_[name] = ::std::move(content);
+
+    if (name == kApplyLogName) {
+      QTextStream log(&entries_[name], QIODevice::ReadOnly);
+      QString line;
+      while (log.readLineInto(&line))
+        if (!line.isEmpty()) order_.append(line);
+      has_log_ = true;
+    }
+    if (name == kRouteManifestSigName) verifyRoute();
+    dispatch();
+  }
+
+  // One public key operation for the whole route, the packs are checked by
+  // their digests then.
+  void verifyRoute() {
+    auto content = entries_.find(kRouteManifestName);
+    auto log = entries_.find(kApplyLogName);
+    RouteDigests digests;
+    if (content == entries_.end() || log == entries_.end() ||
+        !VerifyRouteManifest(content->second,
+                             entries_.at(kRouteManifestSigName), log->second,
+                             pubkey_, &digests)) {
+      OTAError::S_verify_fail xerr{kRouteManifestName, STRING_SOURCE_LOCATION};
       throw OTAError{::std::move(xerr)};
     }
+    route_ = ::std::move(digests);
+  }
 
-    // Verify succeed.
-    tar_extract_archive_file_gzip(packfile, tmp_root.absolutePath());
-    succ = applyDeltaPack(tmp_root, app_root);
+  // The hash to compute while the entry "name" is received. Only for the
+  // packs: sha256 with the route manifest, otherwise the hash of the scheme
+  // of its signature, which arrives before the pack.
+  ::std::optional<QCryptographicHash::Algorithm> packHashOf(QString name) {
+    while (name.startsWith("./")) name.remove(0, 2);
+    if (!has_log_) return ::std::nullopt;
+    for (int i = next_hop_; i < order_.size(); ++i) {
+      QStringList info = order_.at(i).split("|");
+      if (info.size() != 3 || info.at(0) != name) continue;
+      if (route_) return QCryptographicHash::Sha256;
+      auto sig = entries_.find(info.at(2));
+      SigScheme scheme;
+      QByteArray signature;
+      if (sig == entries_.end() ||
+          !parseSigFile(sig->second, &scheme, &signature))
+        return ::std::nullopt;
+      return sigHashOf(scheme);
+    }
+    return ::std::nullopt;
+  }
+
+  // desc: Check the digest computed while the pack was received.
+  // ret: false if it wasn't hashed, the worker verifies it then.
+  bool verifyReceived(const QStringList& info, const QByteArray& sig) {
+    auto received = received_.find(info.at(0));
+    if (received == received_.end()) return false;
+    QByteArray digest = ::std::move(received->second);
+    received_.erase(received);
+
+    bool succ = false;
+    if (route_) {
+      succ = digest == route_->at(info.at(0));
+    } else {
+      SigScheme scheme;
+      QByteArray signature;
+      succ = parseSigFile(sig, &scheme, &signature) &&
+             verifyDigest(digest, signature, pubkey_, scheme);
+    }
     if (!succ) {
-      log_file.close();
-      tmp_root.removeRecursively();
-      OTAError::S_apply_pack_unexpected_fail xerr{::std::move(packname),
-                                                  STRING_SOURCE_LOCATION};
+      QString msg = "[" + info.at(0) + "]current pack verify fails.";
+      OTAError::S_verify_fail xerr{::std::move(msg), STRING_SOURCE_LOCATION};
       throw OTAError{::std::move(xerr)};
     }
+    return true;
+  }
 
-    if (!safe_mode) {
-      tmp_root.removeRecursively();
-      continue;
-    }
+  // Hand over the packs which are ready, in the order of apply_log. The route
+  // manifest, if sent, comes before the packs and must be verified first.
+  void dispatch() {
+    if (!has_log_) return;
+    if (!route_ && entries_.count(kRouteManifestName)) return;
+    while (next_hop_ < order_.size()) {
+      // Info: packname|hashname|signame
+      QStringList info = order_.at(next_hop_).split("|");
+      if (info.size() != 3) {
+        OTAError::S_general xerr{"Invalid apply_log info." +
+                                 STRING_SOURCE_LOCATION};
+        throw OTAError{::std::move(xerr)};
+      }
+      auto pack = entries_.find(info.at(0));
+      auto hash = entries_.find(info.at(1));
+      auto sig = entries_.find(info.at(2));
+      if (hash == entries_.end() || sig == entries_.end()) return;
 
-    Property pp = ReadProperty();
+      // The server leaves out the packs cached, the signature tells which
+      // one it is.
+      QString sig_hash = PackCache::sigHash(sig->second);
+      ::std::optional<QByteArray> cached;
+      if (pack == entries_.end() && cache_)
+        cached = cache_->get(info.at(0), sig_hash);
+      if (pack == entries_.end() && !cached) return;
 
-    // Do hash check.
-    QString hash_filename = pack_root.filePath(info.at(1));
-    QFile hashfile(hash_filename);
-    if (!hashfile.open(QFile::ReadOnly)) {
-      log_file.close();
-      tmp_root.removeRecursively();
-      OTAError::S_file_open_fail xerror{::std::move(log_path),
-                                        STRING_SOURCE_LOCATION};
-      throw OTAError{::std::move(xerror)};
+      PackHop hop;
+      if (route_) {
+        auto digest = route_->find(info.at(0));
+        if (digest == route_->end() ||
+            !MatchRouteDigest(*route_, info.at(1), hash->second)) {
+          OTAError::S_verify_fail xerr{info.at(0), STRING_SOURCE_LOCATION};
+          throw OTAError{::std::move(xerr)};
+        }
+        hop.digest_ = digest->second;
+      }
+      if (!cached) hop.verified_ = verifyReceived(info, sig->second);
+      // The signature is verified from memory, nothing is written for it.
+      if (!route_ && !hop.verified_) hop.sig_data_ = sig->second;
+
+      hop.packname_ = info.at(0);
+      hop.hash_ = hash->second.toStdString();
+      hop.sig_hash_ = sig_hash;
+      if (cached) {
+        hop.pack_ = ::std::move(*cached);
+        hop.from_cache_ = true;
+        from_cache_.insert(info.at(0));
+      } else {
+        hop.pack_ = ::std::move(pack->second);
+        // A hash file may be shared by several steps, keep it.
+        entries_.erase(pack);
+      }
+      {
+        ::std::lock_guard locker(lock_);
+        queue_.push_back(::std::move(hop));
+      }
+      cond_.notify_one();
+      ++next_hop_;
     }
-    ::std::string base_value = hashfile.readAll().toStdString();
-    hashfile.close();
-    ::std::string app_value =
-        FileLogger::GetHashFromLogFile(kFileLogPath).to_string();
-    if (app_value != base_value) {
-      log_file.close();
-      tmp_root.removeRecursively();
-      OTAError::S_hash_check_fail xerror{::std::move(pp.app_version_),
-                                         STRING_SOURCE_LOCATION};
-      throw OTAError{::std::move(xerror)};
+  }
+
+  void work() {
+    AppHashTracker tracker(app_root_);
+    while (true) {
+      PackHop hop;
+      {
+        ::std::unique_lock locker(lock_);
+        cond_.wait(locker,
+                   [this] { return stopped_ || closed_ || !queue_.empty(); });
+        if (stopped_ || queue_.empty()) return;
+        hop = ::std::move(queue_.front());
+        queue_.pop_front();
+      }
+      try {
+        applyPackHop(app_root_, pack_root_, hop, pubkey_, safe_mode_, tracker,
+                     journal_);
+      } catch (...) {
+        // A bad cached pack must be received again next time.
+        if (cache_ && hop.from_cache_)
+          cache_->remove(hop.packname_, hop.sig_hash_);
+        ::std::lock_guard locker(lock_);
+        error_ = ::std::current_exception();
+        return;
+      }
+      if (cache_) cache_->put(hop.packname_, hop.sig_hash_, hop.pack_);
     }
+  }
 
-    // remove the previsou content.
-    tmp_root.removeRecursively();
+  void rethrowError() {
+    ::std::exception_ptr error;
+    {
+      ::std::lock_guard locker(lock_);
+      error = error_;
+    }
+    if (error) ::std::rethrow_exception(error);
   }
-}
+
+  QDir app_root_;
+  QDir pack_root_;
+  QFileInfo pubkey_;
+  bool safe_mode_;
+  UndoJournal* journal_;
+  PackCache* cache_;
+
+  // Owned by the receiving thread.
+  TarGzReader reader_;
+  QByteArray current_;
+  ::std::optional<QCryptographicHash> current_hash_;
+  ::std::map<QString, QByteArray> received_;  // Digests of the packs.
+  ::std::map<QString, QByteArray> entries_;
+  QStringList order_;
+  ::std::set<QString> from_cache_;
+  ::std::optional<RouteDigests> route_;
+  bool has_log_;
+  int next_hop_;
+
+  // Shared with the worker.
+  ::std::mutex lock_;
+  ::std::condition_variable cond_;
+  ::std::deque<PackHop> queue_;
+  ::std::exception_ptr error_;
+  bool closed_;
+  bool stopped_;
+  ::std::thread worker_;
+};
 
 }  // namespace otalib
 
@@ -0,0 +1,142 @@
+#ifndef PACK_CACHE_HPP
+#define PACK_CACHE_HPP
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QString>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <vector>
+
+#include "update_strategy.hpp"
+
+namespace otalib {
+
+// Packs received before, kept for the next update on the same step. A client
+// moving back and forth between versions gets the same packs again and again.
+// An entry is keyed by the pack's name and the hash of its signature:
+//      root/<sha256 of the signature>_<packname>
+// The server leaves the cached packs out, and sends their signatures only. A
+// cached pack is used only if the signature received hashes to its key, and it
+// is verified against that signature like a received one.
+// The total size is bounded by "cap", the least recently used are evicted.
+// The packs listed for the server are pinned until the update is over, it
+// won't send them again.
+class PackCache {
+ public:
+  explicit PackCache(const QDir& root, uint64_t cap) : root_(root), cap_(cap) {}
+
+  static QString sigHash(const QByteArray& sig) {
+    return QString::fromLatin1(
+        QCryptographicHash::hash(sig, QCryptographicHash::Sha256).toHex());
+  }
+
+  // desc: All the cached packs, sent along with the confirm. They're pinned,
+  // evict() keeps them until unpin().
+  ::std::vector<CachedPack> list() {
+    ::std::lock_guard locker(lock_);
+    ::std::vector<CachedPack> packs;
+    for (const auto& info : entries()) {
+      CachedPack pack;
+      if (!parseName(info.fileName(), &pack)) continue;
+      pinned_.insert(info.fileName());
+      packs.push_back(::std::move(pack));
+    }
+    return packs;
+  }
+
+  // desc: The update is over, the packs listed may be evicted again.
+  void unpin() {
+    ::std::lock_guard locker(lock_);
+    pinned_.clear();
+    evict();
+  }
+
+  ::std::optional<QByteArray> get(const QString& packname,
+                                  const QString& sig_hash) {
+    ::std::lock_guard locker(lock_);
+    QString path = root_.filePath(entryName(packname, sig_hash));
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) return ::std::nullopt;
+    QByteArray pack = file.readAll();
+    file.close();
+    touch(path);
+    return pack;
+  }
+
+  void put(const QString& packname, const QString& sig_hash,
+           const QByteArray& pack) {
+    ::std::lock_guard locker(lock_);
+    if (cap_ == 0 || static_cast<uint64_t>(pack.size()) > cap_) return;
+    QString path = root_.filePath(entryName(packname, sig_hash));
+    if (QFileInfo::exists(path)) {
+      touch(path);
+      return;
+    }
+
+    if (!root_.mkpath(".")) return;
+    QSaveFile file(path);
+    if (!file.open(QFile::WriteOnly) || file.write(pack) != pack.size() ||
+        !file.commit())
+      return;
+    evict();
+  }
+
+  // desc: Drop an entry, for example it fails the verification.
+  void remove(const QString& packname, const QString& sig_hash) {
+    ::std::lock_guard locker(lock_);
+    QFile::remove(root_.filePath(entryName(packname, sig_hash)));
+  }
+
+ private:
+  static QString entryName(const QString& packname, const QString& sig_hash) {
+    return sig_hash + "_" + packname;
+  }
+
+  static bool parseName(const QString& name, CachedPack* pack) {
+    int sep = name.indexOf('_');
+    // Hex of sha256.
+    if (sep != 64 || sep + 1 >= name.size()) return false;
+    pack->sig_hash_ = name.left(sep);
+    pack->packname_ = name.mid(sep + 1);
+    return true;
+  }
+
+  QFileInfoList entries() const {
+    return root_.entryInfoList(QDir::Files | QDir::NoDotAndDotDot,
+                               QDir::Time | QDir::Reversed);
+  }
+
+  static void touch(const QString& path) {
+    ::utimensat(AT_FDCWD, path.toStdString().c_str(), nullptr, 0);
+  }
+
+  // Remove the oldest until it fits the cap, the pinned ones are skipped.
+  void evict() {
+    QFileInfoList infos = entries();
+    uint64_t total = 0;
+    for (const auto& info : infos) total += info.size();
+    for (const auto& info : infos) {
+      if (total <= cap_) break;
+      if (pinned_.count(info.fileName())) continue;
+      if (QFile::remove(info.absoluteFilePath())) total -= info.size();
+    }
+  }
+
+  QDir root_;
+  uint64_t cap_;
+  // Names of the entries listed.
+  ::std::set<QString> pinned_;
+  mutable ::std::mutex lock_;
+};
+
+}  // namespace otalib
+
+#endif  // PACK_CACHE_HPP
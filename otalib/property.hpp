@@ -12,12 +12,16 @@ namespace otalib {
 static inline const QString kPropertyPath = "./property.json";
 static inline const QString kFileLogPath = "./file_log";
 static inline const QString kFileLogName = "file_log";
+static inline const QString kPropertyName = "property.json";
 static inline const QString kApplyLogName = "apply_log";
 
 struct Property {
   QString app_name_;
   QString app_type_;
   QString app_version_;
+  // Optional. The files larger than it are hashed in chunks of this size, 0
+  // hashes every file as a whole.
+  quint64 hash_chunk_size_ = 0;
 };
 
 static Property ReadProperty(const QString& path = kPropertyPath) {
@@ -48,9 +52,13 @@ static Property ReadProperty(const QString& path = kPropertyPath) {
   }
 
   // Get the data.
-  return Property{jobj.value("App Name").toString(),
-                  jobj.value("App Type").toString(),
-                  jobj.value("App Version").toString()};
+  Property pp{jobj.value("App Name").toString(),
+              jobj.value("App Type").toString(),
+              jobj.value("App Version").toString()};
+  if (jobj.value("Hash Chunk Size").isDouble())
+    pp.hash_chunk_size_ = static_cast<quint64>(
+        qMax(0.0, jobj.value("Hash Chunk Size").toDouble()));
+  return pp;
 }
 
 }  // namespace otalib
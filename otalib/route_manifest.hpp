@@ -0,0 +1,90 @@
+#ifndef ROUTE_MANIFEST_HPP
+#define ROUTE_MANIFEST_HPP
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QFileInfo>
+#include <QList>
+#include <QString>
+#include <map>
+
+#include "property.hpp"
+#include "sha256_hash.h"
+#include "signature.h"
+
+namespace otalib {
+
+// The sha256 of everything a whole pack carries for a route, signed once by
+// the server:
+//      apply_log|hex
+//      file|hex
+// The client verifies one signature for the route, then each pack and hash
+// file is checked by its digest. The manifest and its signature follow
+// apply_log in the archive, before any pack.
+static inline const QString kRouteManifestName = "route_manifest";
+static inline const QString kRouteManifestSigName = "route_manifest_sig";
+
+// file -> sha256
+using RouteDigests = ::std::map<QString, QByteArray>;
+
+inline QByteArray RouteDigestOf(const QByteArray& data) {
+  return QCryptographicHash::hash(data, QCryptographicHash::Sha256);
+}
+
+// desc: Make the manifest of "apply_log" and "files".
+// ret: Empty if a file can't be read.
+inline QByteArray MakeRouteManifest(const QByteArray& apply_log,
+                                    const QList<QFileInfo>& files) {
+  QByteArray content;
+  content += kApplyLogName.toUtf8() + "|" + RouteDigestOf(apply_log).toHex() +
+             "\n";
+  for (const auto& info : files) {
+    QFile file(info.absoluteFilePath());
+    if (!file.open(QFile::ReadOnly)) return QByteArray();
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(&file);
+    content += info.fileName().toUtf8() + "|" + hash.result().toHex() + "\n";
+  }
+  return content;
+}
+
+// ret: false if a line is broken.
+inline bool ParseRouteManifest(const QByteArray& content,
+                               RouteDigests* digests) {
+  digests->clear();
+  for (const auto& line : content.split('\n')) {
+    if (line.isEmpty()) continue;
+    int sep = line.lastIndexOf('|');
+    QByteArray digest = QByteArray::fromHex(line.mid(sep + 1));
+    if (sep <= 0 || static_cast<size_t>(digest.size()) != kSha256Len)
+      return false;
+    (*digests)[QString::fromUtf8(line.left(sep))] = ::std::move(digest);
+  }
+  return !digests->empty();
+}
+
+// desc: Verify the signature of the manifest and that it's the one of
+// "apply_log".
+inline bool VerifyRouteManifest(const QByteArray& content,
+                                const QByteArray& sig_file,
+                                const QByteArray& apply_log,
+                                const QFileInfo& pubkey,
+                                RouteDigests* digests) {
+  if (!verifyData(content, sig_file, pubkey) ||
+      !ParseRouteManifest(content, digests))
+    return false;
+  auto iter = digests->find(kApplyLogName);
+  return iter != digests->end() && iter->second == RouteDigestOf(apply_log);
+}
+
+// desc: Whether "data" is the file "name" of the manifest.
+inline bool MatchRouteDigest(const RouteDigests& digests, const QString& name,
+                             const QByteArray& data) {
+  auto iter = digests.find(name);
+  return iter != digests.end() && iter->second == RouteDigestOf(data);
+}
+
+}  // namespace otalib
+
+#endif  // ROUTE_MANIFEST_HPP
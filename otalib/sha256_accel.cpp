@@ -0,0 +1,357 @@
+#include "sha256_accel.h"
+
+#include <openssl/sha.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define OTALIB_SHA256_X86 1
+#endif
+
+namespace otalib {
+namespace {
+
+constexpr size_t kMsgLen = 64;
+constexpr size_t kDigestLen = 32;
+
+alignas(64) const uint32_t kRoundK[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const uint32_t kInitState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                0x1f83d9ab, 0x5be0cd19};
+
+// The second block of a 64-byte message is always the same padding: 0x80,
+// zeros, and the length of 512 bits.
+alignas(16) const uint8_t kPadBlock[kMsgLen] = {
+    0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0,    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0,    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00};
+
+void hashGeneric(const uint8_t* in, uint8_t* out, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    ::SHA256(in + i * kMsgLen, kMsgLen, out + i * kDigestLen);
+}
+
+#ifdef OTALIB_SHA256_X86
+
+bool cpuHasShaNi() {
+  unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+  bool sse41 = ecx & bit_SSE4_1;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+  return sse41 && (ebx & bit_SHA);
+}
+
+bool cpuHasAvx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+// ---- SHA-NI, one message at a time. ----
+
+__attribute__((target("sha,sse4.1"))) void shaNiCompress(__m128i& state0,
+                                                        __m128i& state1,
+                                                        const uint8_t* block) {
+  const __m128i kShuffle =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i abef = state0;
+  __m128i cdgh = state1;
+  __m128i msg[4];
+
+  // 16 groups of 4 rounds. The schedule of each group comes from the four
+  // before it.
+  for (int i = 0; i < 16; ++i) {
+    __m128i& cur = msg[i & 3];
+    if (i < 4) {
+      cur = _mm_shuffle_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i * 16)),
+          kShuffle);
+    } else {
+      const __m128i& prev1 = msg[(i - 1) & 3];
+      const __m128i& prev2 = msg[(i - 2) & 3];
+      const __m128i& prev3 = msg[(i - 3) & 3];
+      __m128i tmp = _mm_sha256msg1_epu32(cur, prev3);
+      tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(prev1, prev2, 4));
+      cur = _mm_sha256msg2_epu32(tmp, prev1);
+    }
+    __m128i wk = _mm_add_epi32(
+        cur, _mm_load_si128(reinterpret_cast<const __m128i*>(kRoundK + i * 4)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+    wk = _mm_shuffle_epi32(wk, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+  }
+
+  state0 = _mm_add_epi32(state0, abef);
+  state1 = _mm_add_epi32(state1, cdgh);
+}
+
+__attribute__((target("sha,sse4.1"))) void hashShaNi(const uint8_t* in,
+                                                    uint8_t* out, size_t n) {
+  const __m128i kByteSwap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  // The initial state in the ABEF/CDGH layout of the instructions.
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kInitState));
+  __m128i init1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(kInitState + 4));
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);                  // CDAB
+  init1 = _mm_shuffle_epi32(init1, 0x1B);              // EFGH
+  __m128i init0 = _mm_alignr_epi8(tmp, init1, 8);      // ABEF
+  init1 = _mm_blend_epi16(init1, tmp, 0xF0);           // CDGH
+
+  for (size_t i = 0; i < n; ++i) {
+    __m128i state0 = init0;
+    __m128i state1 = init1;
+    shaNiCompress(state0, state1, in + i * kMsgLen);
+    shaNiCompress(state0, state1, kPadBlock);
+
+    // Back to ABCD/EFGH, big endian.
+    tmp = _mm_shuffle_epi32(state0, 0x1B);               // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);            // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);         // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);            // HGFE
+    uint8_t* digest = out + i * kDigestLen;
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(digest),
+                     _mm_shuffle_epi8(state0, kByteSwap));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(digest + 16),
+                     _mm_shuffle_epi8(state1, kByteSwap));
+  }
+}
+
+// ---- AVX2, 8 messages at a time, one in each 32-bit lane. ----
+
+#define OTALIB_AVX2 __attribute__((target("avx2"))) inline
+
+OTALIB_AVX2 __m256i rotr(__m256i x, int n) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+OTALIB_AVX2 __m256i add(__m256i a, __m256i b) { return _mm256_add_epi32(a, b); }
+
+OTALIB_AVX2 __m256i bigSigma0(__m256i a) {
+  return _mm256_xor_si256(_mm256_xor_si256(rotr(a, 2), rotr(a, 13)),
+                          rotr(a, 22));
+}
+
+OTALIB_AVX2 __m256i bigSigma1(__m256i e) {
+  return _mm256_xor_si256(_mm256_xor_si256(rotr(e, 6), rotr(e, 11)),
+                          rotr(e, 25));
+}
+
+OTALIB_AVX2 __m256i smallSigma0(__m256i w) {
+  return _mm256_xor_si256(_mm256_xor_si256(rotr(w, 7), rotr(w, 18)),
+                          _mm256_srli_epi32(w, 3));
+}
+
+OTALIB_AVX2 __m256i smallSigma1(__m256i w) {
+  return _mm256_xor_si256(_mm256_xor_si256(rotr(w, 17), rotr(w, 19)),
+                          _mm256_srli_epi32(w, 10));
+}
+
+OTALIB_AVX2 void avx2Compress(__m256i state[8], __m256i w[16]) {
+  __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+  __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+  for (int i = 0; i < 64; ++i) {
+    if (i >= 16) {
+      w[i & 15] = add(add(w[i & 15], smallSigma0(w[(i + 1) & 15])),
+                      add(w[(i + 9) & 15], smallSigma1(w[(i + 14) & 15])));
+    }
+    __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                                  _mm256_andnot_si256(e, g));
+    __m256i maj = _mm256_xor_si256(
+        _mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+        _mm256_and_si256(b, c));
+    __m256i t1 =
+        add(add(add(h, bigSigma1(e)), add(ch, w[i & 15])),
+            _mm256_set1_epi32(static_cast<int>(kRoundK[i])));
+    __m256i t2 = add(bigSigma0(a), maj);
+    h = g;
+    g = f;
+    f = e;
+    e = add(d, t1);
+    d = c;
+    c = b;
+    b = a;
+    a = add(t1, t2);
+  }
+
+  state[0] = add(state[0], a);
+  state[1] = add(state[1], b);
+  state[2] = add(state[2], c);
+  state[3] = add(state[3], d);
+  state[4] = add(state[4], e);
+  state[5] = add(state[5], f);
+  state[6] = add(state[6], g);
+  state[7] = add(state[7], h);
+}
+
+inline uint32_t loadBigEndian(const uint8_t* p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+         (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+__attribute__((target("avx2"))) void hashAvx2(const uint8_t* in, uint8_t* out,
+                                              size_t n) {
+  constexpr size_t kLanes = 8;
+  size_t batches = n / kLanes;
+  for (size_t k = 0; k < batches; ++k) {
+    const uint8_t* msgs = in + k * kLanes * kMsgLen;
+    __m256i w[16];
+    for (int i = 0; i < 16; ++i) {
+      alignas(32) uint32_t lanes[kLanes];
+      for (size_t j = 0; j < kLanes; ++j)
+        lanes[j] = loadBigEndian(msgs + j * kMsgLen + i * 4);
+      w[i] = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes));
+    }
+
+    __m256i state[8];
+    for (int i = 0; i < 8; ++i)
+      state[i] = _mm256_set1_epi32(static_cast<int>(kInitState[i]));
+    avx2Compress(state, w);
+
+    // The padding block is the same in every lane.
+    for (int i = 0; i < 16; ++i)
+      w[i] = _mm256_set1_epi32(static_cast<int>(loadBigEndian(kPadBlock + i * 4)));
+    avx2Compress(state, w);
+
+    uint8_t* digests = out + k * kLanes * kDigestLen;
+    for (int i = 0; i < 8; ++i) {
+      alignas(32) uint32_t lanes[kLanes];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), state[i]);
+      for (size_t j = 0; j < kLanes; ++j) {
+        uint8_t* p = digests + j * kDigestLen + i * 4;
+        p[0] = lanes[j] >> 24;
+        p[1] = lanes[j] >> 16;
+        p[2] = lanes[j] >> 8;
+        p[3] = lanes[j];
+      }
+    }
+  }
+
+  // Fewer than 8 left, one at a time. Not by Sha256BestBackend(), it's this
+  // one on a CPU without SHA-NI.
+  size_t done = batches * kLanes;
+  if (done == n) return;
+  if (Sha256BackendSupported(Sha256Backend::ShaNi))
+    hashShaNi(in + done * kMsgLen, out + done * kDigestLen, n - done);
+  else
+    hashGeneric(in + done * kMsgLen, out + done * kDigestLen, n - done);
+}
+
+#undef OTALIB_AVX2
+
+#endif  // OTALIB_SHA256_X86
+
+Sha256Backend detectBackend() {
+#ifdef OTALIB_SHA256_X86
+  if (cpuHasShaNi()) return Sha256Backend::ShaNi;
+  if (cpuHasAvx2()) return Sha256Backend::Avx2;
+#endif
+  return Sha256Backend::Generic;
+}
+
+// Which of SHA-NI and 8-lane AVX2 is faster for many messages depends on the
+// CPU, time both on a small batch once.
+Sha256Backend detectBatchBackend() {
+  Sha256Backend single = Sha256BestBackend();
+  if (single != Sha256Backend::ShaNi ||
+      !Sha256BackendSupported(Sha256Backend::Avx2))
+    return single;
+
+  constexpr size_t kProbe = 512;
+  std::vector<uint8_t> in(kProbe * kMsgLen, 0x5a);
+  std::vector<uint8_t> out(kProbe * kDigestLen);
+  auto cost = [&](Sha256Backend backend) {
+    Sha256Hash64(in.data(), out.data(), kProbe, backend);  // Warm up.
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 4; ++i)
+      Sha256Hash64(in.data(), out.data(), kProbe, backend);
+    return std::chrono::steady_clock::now() - start;
+  };
+  return cost(Sha256Backend::Avx2) < cost(Sha256Backend::ShaNi)
+             ? Sha256Backend::Avx2
+             : Sha256Backend::ShaNi;
+}
+
+}  // namespace
+
+Sha256Backend Sha256BestBackend() {
+  static const Sha256Backend backend = detectBackend();
+  return backend;
+}
+
+Sha256Backend Sha256BatchBackend() {
+  static const Sha256Backend backend = detectBatchBackend();
+  return backend;
+}
+
+bool Sha256BackendSupported(Sha256Backend backend) {
+  switch (backend) {
+    case Sha256Backend::Generic:
+      return true;
+#ifdef OTALIB_SHA256_X86
+    case Sha256Backend::ShaNi: {
+      static const bool supported = cpuHasShaNi();
+      return supported;
+    }
+    case Sha256Backend::Avx2: {
+      static const bool supported = cpuHasAvx2();
+      return supported;
+    }
+#endif
+    default:
+      return false;
+  }
+}
+
+const char* Sha256BackendName(Sha256Backend backend) {
+  switch (backend) {
+    case Sha256Backend::ShaNi:
+      return "sha-ni";
+    case Sha256Backend::Avx2:
+      return "avx2";
+    default:
+      return "generic";
+  }
+}
+
+void Sha256Hash64(const uint8_t* in, uint8_t* out, size_t n) {
+  if (n >= 8)
+    Sha256Hash64(in, out, n, Sha256BatchBackend());
+  else
+    Sha256Hash64(in, out, n, Sha256BestBackend());
+}
+
+void Sha256Hash64(const uint8_t* in, uint8_t* out, size_t n,
+                  Sha256Backend backend) {
+  switch (backend) {
+#ifdef OTALIB_SHA256_X86
+    case Sha256Backend::ShaNi:
+      hashShaNi(in, out, n);
+      return;
+    case Sha256Backend::Avx2:
+      hashAvx2(in, out, n);
+      return;
+#endif
+    default:
+      hashGeneric(in, out, n);
+      return;
+  }
+}
+
+}  // namespace otalib
@@ -0,0 +1,34 @@
+#ifndef SHA256_ACCEL_H
+#define SHA256_ACCEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace otalib {
+
+// SHA-256 of 64-byte messages, the input of every Merkle node(left || right).
+// The messages are too short for the call overhead of OpenSSL to pay off, so
+// they are hashed here with the CPU's SHA extensions(SHA-NI), or 8 at a time
+// with AVX2. The backend is picked at runtime, the result is the same as
+// SHA256() whichever is used.
+enum class Sha256Backend { Generic, ShaNi, Avx2 };
+
+// desc: The fastest backend this CPU supports for a single message, and the
+// fastest for a batch of them.
+Sha256Backend Sha256BestBackend();
+Sha256Backend Sha256BatchBackend();
+
+bool Sha256BackendSupported(Sha256Backend backend);
+const char* Sha256BackendName(Sha256Backend backend);
+
+// desc: Hash "n" messages of 64 bytes in "in" into "n" digests in "out".
+// param:
+//      backend: Force a backend, for tests and benchmarks. It must be
+//      supported.
+void Sha256Hash64(const uint8_t* in, uint8_t* out, size_t n);
+void Sha256Hash64(const uint8_t* in, uint8_t* out, size_t n,
+                  Sha256Backend backend);
+
+}  // namespace otalib
+
+#endif  // SHA256_ACCEL_H
@@ -1,51 +1,254 @@
 #ifndef SHA256_HASH_H
 #define SHA256_HASH_H
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <QDir>
+#include <algorithm>
+#include <atomic>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "logger/logger.h"
 #include "merklecpp.h"
+#include "sha256_accel.h"
 
 namespace otalib {
 
 namespace {
-constexpr const static size_t kChunkSize = 2048;
+// Files are read in large aligned pieces, one buffer per thread.
+constexpr const static size_t kChunkSize = 1024 * 1024;
+constexpr const static size_t kChunkAlign = 4096;
 constexpr const static size_t kSha256Len = SHA256_DIGEST_LENGTH;
 }  // namespace
 
-using merkle_tree_t = merkle::TreeT<kSha256Len, merkle::sha256_openssl>;
+// Hash of an interior node, sha256(left || right). Same as
+// merkle::sha256_openssl, with the accelerated backend.
+static inline void Sha256Node(const merkle::HashT<kSha256Len> &l,
+                              const merkle::HashT<kSha256Len> &r, merkle::HashT<kSha256Len> &out) {
+  uint8_t block[kSha256Len * 2];
+  ::memcpy(block, l.bytes, kSha256Len);
+  ::memcpy(block + kSha256Len, r.bytes, kSha256Len);
+  Sha256Hash64(block, out.bytes, 1);
+}
+
+using merkle_tree_t = merkle::TreeT<kSha256Len, Sha256Node>;
 using merkle_hash_t = merkle::Hash;
+static_assert(sizeof(merkle_hash_t) == kSha256Len, "Hashes must be packed for batch hashing.");
 using hash_table_t = std::unordered_map<std::string, std::string>;
 
-static void Sha256HashFile(const std::string &filename, uint8_t md[kSha256Len]) {
-  FILE *fp = nullptr;
-  fp = ::fopen(filename.c_str(), "rb");
-  if (fp == nullptr) return;
+// sha256 of "length" bytes of "fd" from "offset", or up to the end of the
+// file if "length" is -1.
+static void Sha256HashRange(int fd, uint64_t offset, uint64_t length, uint8_t md[kSha256Len]) {
+  struct ChunkBuffer {
+    uint8_t *data = static_cast<uint8_t *>(::aligned_alloc(kChunkAlign, kChunkSize));
+    ~ChunkBuffer() { ::free(data); }
+  };
+  thread_local ChunkBuffer buffer;
 
   SHA256_CTX ctx;
-  uint8_t buffer[kChunkSize];
-  int n;
   ::SHA256_Init(&ctx);
-  while ((n = ::fread(buffer, sizeof(uint8_t), kChunkSize, fp)) > 0) {
-    ::SHA256_Update(&ctx, buffer, n);
+  while (length > 0) {
+    ssize_t n = ::pread(fd, buffer.data, std::min<uint64_t>(kChunkSize, length), offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    ::SHA256_Update(&ctx, buffer.data, n);
+    offset += n;
+    length -= n;
   }
   ::SHA256_Final(md, &ctx);
-  ::fclose(fp);
+}
+
+static void Sha256HashFile(const std::string &filename, uint8_t md[kSha256Len]) {
+  int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  Sha256HashRange(fd, 0, static_cast<uint64_t>(-1), md);
+  ::close(fd);
+}
+
+static void Sha256HashBuffer(const void *data, size_t len, uint8_t md[kSha256Len]) {
+  ::SHA256(static_cast<const uint8_t *>(data), len, md);
 }
 
 ///
-/// \brief CalcFileSha256Hash
-/// \param dir_name
-/// \param tree
-/// \param htable
+/// \brief MerkleRootOf
+/// Root of the tree built by inserting "leaves" into merkle_tree_t in order,
+/// computed level by level: the pairs of a level are hashed in one batch, an
+/// odd node left at the end goes up as it is. That is the shape of
+/// merkle_tree_t, so the root is the same.
+/// \param leaves
+/// \return A zero hash if there's no leaf.
+///
+static merkle_hash_t MerkleRootOf(std::vector<merkle_hash_t> leaves) {
+  if (leaves.empty()) return merkle_hash_t();
+  while (leaves.size() > 1) {
+    size_t pairs = leaves.size() / 2;
+    std::vector<merkle_hash_t> parents(pairs + leaves.size() % 2);
+    // Two neighbouring hashes are one 64-byte message.
+    Sha256Hash64(leaves[0].bytes, parents[0].bytes, pairs);
+    if (leaves.size() % 2) parents.back() = leaves.back();
+    leaves = std::move(parents);
+  }
+  return leaves.front();
+}
+
+///
+/// \brief Sha256HashFilesBy
+/// Hash the files on several threads, they take the next task from a shared
+/// index. The hashes are in the order of the files whichever thread hashed them,
+/// so a tree built from them is the same as the sequential one. A file failed
+/// to open hashes to zeros, as Sha256HashFile() leaves it.
+/// With "chunk_size", a file larger than it is cut into chunks of that size,
+/// each chunk is a task of its own, so one huge file is hashed on all the
+/// threads. Its leaf is the merkle root of the chunk hashes(see
+/// Sha256ChunkHashes()). A file within one chunk keeps its plain sha256.
+/// \param count
+/// \param path_of The path of file "i", as "const std::string &(size_t i,
+/// std::string &buffer)". It may be built in "buffer", each thread has its
+/// own.
+/// \param threads 0 for all the cores.
+/// \param chunk_size 0 for no chunks.
 /// \return
 ///
-static bool CalcFileSha256Hash(const QString &dir_name, merkle_tree_t &tree, hash_table_t &htable,
-                               size_t &cnt) {
-  QDir dir(dir_name);
-  if (!dir.exists()) return false;
+template <typename PathOf>
+static std::vector<merkle_hash_t> Sha256HashFilesBy(size_t count, PathOf &&path_of,
+                                                    size_t threads = 0, uint64_t chunk_size = 0) {
+  struct Task {
+    size_t file;
+    size_t chunk;
+  };
+  std::vector<std::vector<merkle_hash_t>> chunks(count);
+  std::vector<Task> tasks;
+  tasks.reserve(count);
+  std::string buffer;
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t pieces = 1;
+    struct stat st;
+    if (chunk_size > 0 && ::stat(path_of(i, buffer).c_str(), &st) == 0 &&
+        static_cast<uint64_t>(st.st_size) > chunk_size)
+      pieces = (st.st_size + chunk_size - 1) / chunk_size;
+    chunks[i].resize(pieces);
+    for (size_t k = 0; k < pieces; ++k) tasks.push_back({i, k});
+  }
 
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::min(threads, tasks.size());
+
+  std::atomic<size_t> next{0};
+  auto work = [&] {
+    std::string buffer;
+    for (size_t i = next++; i < tasks.size(); i = next++) {
+      const Task &task = tasks[i];
+      const std::string &path = path_of(task.file, buffer);
+      uint8_t md[kSha256Len]{0};
+      if (chunks[task.file].size() == 1) {
+        Sha256HashFile(path, md);
+      } else {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+          Sha256HashRange(fd, task.chunk * chunk_size, chunk_size, md);
+          ::close(fd);
+        }
+      }
+      chunks[task.file][task.chunk] = merkle_hash_t(md);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; ++i) workers.emplace_back(work);
+  work();
+  for (auto &worker : workers) worker.join();
+
+  std::vector<merkle_hash_t> hashes(count);
+  for (size_t i = 0; i < count; ++i) hashes[i] = MerkleRootOf(std::move(chunks[i]));
+  return hashes;
+}
+
+static std::vector<merkle_hash_t> Sha256HashFiles(const std::vector<std::string> &files,
+                                                  size_t threads = 0, uint64_t chunk_size = 0) {
+  return Sha256HashFilesBy(
+      files.size(), [&files](size_t i, std::string &) -> const std::string & { return files[i]; },
+      threads, chunk_size);
+}
+
+///
+/// \brief Sha256HashFiles
+/// The files "prefix + name" of "names", e.g. the views of FileLogNames. The
+/// paths are built in a buffer of each thread, nothing is allocated for a
+/// file.
+///
+static std::vector<merkle_hash_t> Sha256HashFiles(const std::string &prefix,
+                                                  const std::vector<std::string_view> &names,
+                                                  size_t threads = 0, uint64_t chunk_size = 0) {
+  return Sha256HashFilesBy(
+      names.size(),
+      [&prefix, &names](size_t i, std::string &buffer) -> const std::string & {
+        buffer.assign(prefix);
+        buffer.append(names[i]);
+        return buffer;
+      },
+      threads, chunk_size);
+}
+
+///
+/// \brief Sha256ChunkHashes
+/// Hashes of the "chunk_size" pieces of a file, the leaves of its chunked
+/// leaf. An empty file has one empty chunk.
+/// \param filename
+/// \param chunk_size
+/// \return Empty if the file cannot be read.
+///
+static std::vector<merkle_hash_t> Sha256ChunkHashes(const std::string &filename,
+                                                    uint64_t chunk_size) {
+  std::vector<merkle_hash_t> hashes;
+  int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return hashes;
+  struct stat st;
+  if (::fstat(fd, &st) == 0) {
+    uint64_t size = st.st_size;
+    uint64_t count = size > chunk_size && chunk_size > 0 ? (size + chunk_size - 1) / chunk_size : 1;
+    hashes.resize(count);
+    for (uint64_t k = 0; k < count; ++k)
+      Sha256HashRange(fd, k * chunk_size, count == 1 ? size : chunk_size, hashes[k].bytes);
+  }
+  ::close(fd);
+  return hashes;
+}
+
+///
+/// \brief FindBadChunks
+/// Compare the chunks of a file with the hashes expected(from the chunk
+/// manifest), so only the bad ones need to be fetched again.
+/// \param filename
+/// \param chunk_size
+/// \param expect
+/// \return Indexes of the chunks differ or missing.
+///
+static std::vector<size_t> FindBadChunks(const std::string &filename, uint64_t chunk_size,
+                                         const std::vector<merkle_hash_t> &expect) {
+  std::vector<merkle_hash_t> actual = Sha256ChunkHashes(filename, chunk_size);
+  std::vector<size_t> bad;
+  for (size_t k = 0; k < expect.size(); ++k)
+    if (k >= actual.size() || !(actual[k] == expect[k])) bad.push_back(k);
+  return bad;
+}
+
+// Hash of the file in the form written into the logs(lowercase hex).
+static ::std::string Sha256HexOfFile(const ::std::string &filename) {
+  uint8_t md[kSha256Len]{0};
+  Sha256HashFile(filename, md);
+  return merkle_hash_t(md).to_string();
+}
+
+// Files under "dir_name" in the order of the leaves.
+static void ListFilesForHash(const QString &dir_name, std::vector<std::string> &files) {
+  QDir dir(dir_name);
   dir.setFilter(QDir::Dirs | QDir::Files);
   // Directory first!
   dir.setSorting(QDir::DirsFirst);
@@ -54,17 +257,32 @@ static bool CalcFileSha256Hash(const QString &dir_name, merkle_tree_t &tree, has
   for (auto &file : list) {
     if (file.fileName() == "." || file.fileName() == "..") continue;
     QString name = QDir::fromNativeSeparators(dir_name + "/" + file.fileName());
-    if (file.isDir()) {
-      CalcFileSha256Hash(name, tree, htable, cnt);
-    } else if (file.isFile()) {
-      uint8_t md[kSha256Len];
-      Sha256HashFile(name.toStdString(), md);
-      cnt++;
-
-      merkle_hash_t hash(md);
-      tree.insert(hash);
-      htable.emplace(name.toStdString(), hash.to_string());
-    }
+    if (file.isDir())
+      ListFilesForHash(name, files);
+    else if (file.isFile())
+      files.push_back(name.toStdString());
+  }
+}
+
+///
+/// \brief CalcFileSha256Hash
+/// \param dir_name
+/// \param tree
+/// \param htable
+/// \return
+///
+static bool CalcFileSha256Hash(const QString &dir_name, merkle_tree_t &tree, hash_table_t &htable,
+                               size_t &cnt) {
+  QDir dir(dir_name);
+  if (!dir.exists()) return false;
+
+  std::vector<std::string> files;
+  ListFilesForHash(dir_name, files);
+  std::vector<merkle_hash_t> hashes = Sha256HashFiles(files);
+  for (size_t i = 0; i < files.size(); ++i) {
+    cnt++;
+    tree.insert(hashes[i]);
+    htable.emplace(files[i], hashes[i].to_string());
   }
   return true;
 }
@@ -10,25 +10,11 @@
 #include <Windows.h>
 #endif  // !defined(_WIN64) && !defined(_WIN32)
 
-namespace otalib {
-
-static void tar_create_archive_file_gzip(const QString& directory,
-                                         const QString& archive_file) {
-  QString cmd =
-      QString("tar -zcf \"%1\" -C \"%2\" .").arg(archive_file).arg(directory);
-  ::system(cmd.toStdString().c_str());
-}
-
-static void tar_extract_archive_file_gzip(const QString& archive_file,
-                                          const QString& directory) {
-  struct stat s;
-  if (-1 == ::stat(directory.toStdString().c_str(), &s))
-    ::mkdir(directory.toStdString().c_str(), 0755);
+#ifdef __linux__
+#include "dir_copy.hpp"
+#endif  // __linux__
 
-  QString cmd =
-      QString("tar -zxf \"%1\" -C \"%2\" .").arg(archive_file).arg(directory);
-  ::system(cmd.toStdString().c_str());
-}
+namespace otalib {
 
 static void copyDirCmd(const QString& source, const QString& dest) {
 #if defined(_WIN64) || defined(_WIN32)
@@ -40,10 +26,11 @@ static void copyDirCmd(const QString& source, const QString& dest) {
 #endif
 
 #ifdef __linux__
+  // Same as "cp -r", but without a shell. Use copyDirectory() directly to get
+  // the failures.
   QString src = source.trimmed();
   if (src.isEmpty()) return;
-  QString cmd("cp -r " + src + " " + dest);
-  system(cmd.toStdString().c_str());
+  copyDirectory(src.toStdString(), dest.toStdString());
   return;
 #endif
 }
@@ -1,88 +1,264 @@
 #include "signature.h"
 
+#include <sys/stat.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
 namespace otalib {
 namespace sig_details {
 
-bool rsaSignThroughCmd(const QString& from, const QString& to,
-                       const QString& prikey) {
-  //
-  static const ::std::string prefix = "openssl dgst -sign ";
-  ::std::string cmd = prefix + prikey.toStdString() + " " +
-                      kSignHashAlgorithmCmd + "-out " + to.toStdString() + " " +
-                      from.toStdString();
-  system(cmd.c_str());
-  return true;
+using KeyPtr = ::std::shared_ptr<EVP_PKEY>;
+
+struct CachedKey {
+  KeyPtr key;
+  int64_t mtime;
+  int64_t size;
+};
+
+static ::std::mutex gKeyLock;
+static ::std::map<::std::string, CachedKey> gKeys;
+
+void printSslError(const char* what) {
+  char buf[256]{0};
+  ::ERR_error_string_n(::ERR_get_error(), buf, sizeof(buf));
+  print<GeneralFerrorCtrl>(::std::cerr, what, buf);
+}
+
+// Load a PEM key, or take it from the cache if the file is unchanged.
+KeyPtr loadKey(const QFileInfo& file, bool priv) {
+  ::std::string path = file.absoluteFilePath().toStdString();
+  struct stat st;
+  if (::stat(path.c_str(), &st) < 0) return nullptr;
+  int64_t mtime = st.st_mtim.tv_sec * 1'000'000'000LL + st.st_mtim.tv_nsec;
+
+  ::std::lock_guard locker(gKeyLock);
+  auto iter = gKeys.find(path);
+  if (iter != gKeys.end() && iter->second.mtime == mtime &&
+      iter->second.size == st.st_size)
+    return iter->second.key;
+
+  FILE* fp = ::fopen(path.c_str(), "r");
+  if (!fp) return nullptr;
+  EVP_PKEY* raw = priv ? ::PEM_read_PrivateKey(fp, nullptr, nullptr, nullptr)
+                       : ::PEM_read_PUBKEY(fp, nullptr, nullptr, nullptr);
+  ::fclose(fp);
+  if (!raw) {
+    printSslError("Cannot load the key:");
+    return nullptr;
+  }
+  KeyPtr key(raw, ::EVP_PKEY_free);
+  gKeys[path] = CachedKey{key, mtime, static_cast<int64_t>(st.st_size)};
+  return key;
+}
+
+bool writeKeys(EVP_PKEY* key, const QString& prikey_file,
+               const QString& pubkey_file) {
+  FILE* pri = ::fopen(prikey_file.toStdString().c_str(), "w");
+  if (!pri) return false;
+  bool succ = ::PEM_write_PrivateKey(pri, key, nullptr, nullptr, 0, nullptr,
+                                     nullptr) == 1;
+  ::fclose(pri);
+  FILE* pub = ::fopen(pubkey_file.toStdString().c_str(), "w");
+  if (!pub) return false;
+  succ = ::PEM_write_PUBKEY(pub, key) == 1 && succ;
+  ::fclose(pub);
+  return succ;
+}
+
+QByteArray readAll(const QString& path) {
+  QFile file(path);
+  if (!file.open(QFile::ReadOnly)) return QByteArray();
+  return file.readAll();
+}
+
+bool schemeOf(EVP_PKEY* key, SigScheme* scheme) {
+  switch (::EVP_PKEY_id(key)) {
+    case EVP_PKEY_RSA:
+      *scheme = SigScheme::RsaSha256;
+      return true;
+    case EVP_PKEY_ED25519:
+      *scheme = SigScheme::Ed25519;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// RSA hashes the digest with sha256 itself, Ed25519 takes the message as it
+// is.
+const EVP_MD* mdOf(SigScheme scheme) {
+  return scheme == SigScheme::RsaSha256 ? ::EVP_sha256() : nullptr;
+}
+
+static const QByteArray kSigTag = "OTASIG ";
+
+}  // namespace sig_details
+
+const char* sigSchemeName(SigScheme scheme) {
+  switch (scheme) {
+    case SigScheme::RsaSha256:
+      return "rsa-sha256";
+    case SigScheme::Ed25519:
+      return "ed25519";
+  }
+  return "unknown";
 }
 
-bool rsaVerifyThroughCmd(const QString& sig, const QString& hash,
-                         const QString& pubkey) {
-  //
-  static const ::std::string prefix = "openssl dgst -verify ";
-  ::std::string cmd = prefix + pubkey.toStdString() + " " +
-                      kSignHashAlgorithmCmd + "-signature " +
-                      sig.toStdString() + " " + hash.toStdString();
-  ::std::string ret = getCmdResult(cmd);
-  if (ret == "Verified OK")
+QCryptographicHash::Algorithm sigHashOf(SigScheme scheme) {
+  return scheme == SigScheme::Ed25519 ? QCryptographicHash::Sha256
+                                      : kHashAlgorithm;
+}
+
+QByteArray sigDigestOf(const QByteArray& data, SigScheme scheme) {
+  return QCryptographicHash::hash(data, sigHashOf(scheme));
+}
+
+bool parseSigFile(const QByteArray& content, SigScheme* scheme,
+                  QByteArray* signature) {
+  // The bare signatures of RSA, made before the tag.
+  if (!content.startsWith(sig_details::kSigTag)) {
+    *scheme = SigScheme::RsaSha256;
+    *signature = content;
     return true;
-  else  // "Verification Failure"
+  }
+  int eol = content.indexOf('\n');
+  if (eol < 0) return false;
+  QByteArray name = content.mid(sig_details::kSigTag.size(),
+                                eol - sig_details::kSigTag.size());
+  if (name == sigSchemeName(SigScheme::Ed25519))
+    *scheme = SigScheme::Ed25519;
+  else if (name == sigSchemeName(SigScheme::RsaSha256))
+    *scheme = SigScheme::RsaSha256;
+  else
     return false;
+  *signature = content.mid(eol + 1);
+  return true;
 }
 
-}  // namespace sig_details
-void genKey(const QString& prikey_file, const QString& pubkey_file) {
-  // Generate rsa keys in current directory.
-  // "cmd": openssl genrsa -out prikey_file kKeyLength
-  ::std::string cmd = "openssl genrsa -out " + prikey_file.toStdString() + " " +
-                      ::std::to_string(kKeyLength) + " > /dev/null 2>&1";
-  system(cmd.c_str());
-  cmd.clear();
+void genKey(const QString& prikey_file, const QString& pubkey_file,
+            SigScheme scheme) {
+  // Generate the keys in current directory. The rsa keys are the same as
+  // "openssl genrsa" and "openssl rsa -pubout".
+  int type = scheme == SigScheme::Ed25519 ? EVP_PKEY_ED25519 : EVP_PKEY_RSA;
+  EVP_PKEY_CTX* ctx = ::EVP_PKEY_CTX_new_id(type, nullptr);
+  EVP_PKEY* key = nullptr;
+  if (ctx && ::EVP_PKEY_keygen_init(ctx) == 1 &&
+      (type != EVP_PKEY_RSA ||
+       ::EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, kKeyLength) == 1) &&
+      ::EVP_PKEY_keygen(ctx, &key) == 1) {
+    if (!sig_details::writeKeys(key, prikey_file, pubkey_file))
+      sig_details::printSslError("Cannot write the keys:");
+  } else {
+    sig_details::printSslError("Cannot generate the keys:");
+  }
+  ::EVP_PKEY_free(key);
+  ::EVP_PKEY_CTX_free(ctx);
+}
+
+QByteArray signDigest(const QByteArray& digest,
+                      const QFileInfo& prikey) noexcept {
+  sig_details::KeyPtr key = sig_details::loadKey(prikey, true);
+  SigScheme scheme;
+  if (!key || !sig_details::schemeOf(key.get(), &scheme)) return QByteArray();
 
-  // openssl rsa -pubout -in prikey_file -out pubkey_file
-  cmd = "openssl rsa -pubout -in " + prikey_file.toStdString() + " -out " +
-        pubkey_file.toStdString() + " > /dev/null 2>&1";
-  system(cmd.c_str());
+  QByteArray sig;
+  EVP_MD_CTX* ctx = ::EVP_MD_CTX_new();
+  size_t len = 0;
+  const auto* data = reinterpret_cast<const unsigned char*>(digest.constData());
+  if (ctx &&
+      ::EVP_DigestSignInit(ctx, nullptr, sig_details::mdOf(scheme), nullptr,
+                           key.get()) == 1 &&
+      ::EVP_DigestSign(ctx, nullptr, &len, data, digest.size()) == 1) {
+    sig.resize(static_cast<int>(len));
+    if (::EVP_DigestSign(ctx, reinterpret_cast<unsigned char*>(sig.data()),
+                         &len, data, digest.size()) == 1)
+      sig.resize(static_cast<int>(len));
+    else
+      sig.clear();
+  }
+  if (sig.isEmpty()) sig_details::printSslError("Sign failed:");
+  ::EVP_MD_CTX_free(ctx);
+  return sig;
+}
+
+bool verifyDigest(const QByteArray& digest, const QByteArray& signature,
+                  const QFileInfo& pubkey, SigScheme scheme) noexcept {
+  sig_details::KeyPtr key = sig_details::loadKey(pubkey, false);
+  SigScheme key_scheme;
+  // A signature of another scheme is never accepted.
+  if (!key || signature.isEmpty() ||
+      !sig_details::schemeOf(key.get(), &key_scheme) || key_scheme != scheme)
+    return false;
+
+  EVP_MD_CTX* ctx = ::EVP_MD_CTX_new();
+  bool succ =
+      ctx &&
+      ::EVP_DigestVerifyInit(ctx, nullptr, sig_details::mdOf(scheme), nullptr,
+                             key.get()) == 1 &&
+      ::EVP_DigestVerify(
+          ctx, reinterpret_cast<const unsigned char*>(signature.constData()),
+          signature.size(),
+          reinterpret_cast<const unsigned char*>(digest.constData()),
+          digest.size()) == 1;
+  ::EVP_MD_CTX_free(ctx);
+  // A bad signature leaves an error in the queue of this thread.
+  ::ERR_clear_error();
+  return succ;
+}
+
+bool verifyData(const QByteArray& data, const QByteArray& sig_file,
+                const QFileInfo& pubkey) noexcept {
+  SigScheme scheme;
+  QByteArray signature;
+  if (!parseSigFile(sig_file, &scheme, &signature)) return false;
+  return verifyDigest(sigDigestOf(data, scheme), signature, pubkey, scheme);
+}
+
+void clearKeyCache() noexcept {
+  ::std::lock_guard locker(sig_details::gKeyLock);
+  sig_details::gKeys.clear();
 }
 
 bool sign(const QFileInfo& target,
           const QFileInfo& prikey,const QString& version) noexcept {
   // Get the hash value of target, and then generate the signature.
   QFile tfile(target.absoluteFilePath());
-  QString hfilepath = target.absoluteDir().filePath(QStringLiteral("hash"));
-  QFile hfile(hfilepath);
   QString dfilepath =
       target.absoluteDir().filePath(version + QStringLiteral("_sig"));
 
+  sig_details::KeyPtr key = sig_details::loadKey(prikey, true);
+  SigScheme scheme;
+  if (!key || !sig_details::schemeOf(key.get(), &scheme)) return false;
+
+  if (!tfile.open(QFile::ReadOnly)) return false;
+  QCryptographicHash hash(sigHashOf(scheme));
+  hash.addData(&tfile);
+  tfile.close();
+
+  QByteArray sig = signDigest(hash.result(), prikey);
+  if (sig.isEmpty()) return false;
+  // The rsa signatures stay bare, the clients before the tag read them.
+  if (scheme != SigScheme::RsaSha256)
+    sig.prepend(sig_details::kSigTag + sigSchemeName(scheme) + "\n");
   QFile dfile(dfilepath);
-  if (tfile.open(QFile::ReadOnly)) {
-    //
-    QCryptographicHash hash(kHashAlgorithm);
-    hash.addData(&tfile);
-    QByteArray hashval = hash.result();
-    tfile.close();
-    if (hfile.open(QFile::WriteOnly | QFile::Truncate)) {
-      if (hfile.write(hashval) != hashval.size()) {
-        hfile.close();
-        return false;
-      }
-      hfile.close();
-      // do signature through cmd.
-      return sig_details::rsaSignThroughCmd(hfilepath, dfilepath,
-                                            prikey.absoluteFilePath());
-    } else {
-      return false;
-    }
-  } else {
-    // Open failed.
-    return false;
-  }
+  if (!dfile.open(QFile::WriteOnly | QFile::Truncate)) return false;
+  bool succ = dfile.write(sig) == sig.size();
+  dfile.close();
+  return succ;
 }
 
 bool verify(const QFileInfo& hash, const QFileInfo& signature,
             const QFileInfo& pubkey) noexcept {
-  //
-  return sig_details::rsaVerifyThroughCmd(signature.absoluteFilePath(),
-                                          hash.absoluteFilePath(),
-                                          pubkey.absoluteFilePath());
+  SigScheme scheme;
+  QByteArray sig;
+  if (!parseSigFile(sig_details::readAll(signature.absoluteFilePath()), &scheme,
+                    &sig))
+    return false;
+  return verifyDigest(sig_details::readAll(hash.absoluteFilePath()), sig,
+                      pubkey, scheme);
 }
 
 }  // namespace otalib
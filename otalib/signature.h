@@ -2,6 +2,7 @@
 #define SIGNATURE_H
 
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
 #include <stdio.h>
@@ -20,10 +21,37 @@ namespace otalib {
 
 constexpr int32_t kKeyLength = 1024;
 constexpr auto kHashAlgorithm = QCryptographicHash::Md5;
-static const ::std::string kSignHashAlgorithmCmd = "-sha256 ";
+
+// The signature is made by OpenSSL's EVP in process, the keys are loaded once
+// and cached by their path, a key file changed on disk is loaded again.
+// The scheme follows the type of the key:
+//      RsaSha256: RSA(PKCS#1 v1.5) over the sha256 of the target's digest
+//      (kHashAlgorithm). It's the same as the one of "openssl dgst -sha256
+//      -sign" on a file holding the digest, so the signatures made before
+//      still verify. The file holds the signature only.
+//      Ed25519: Ed25519 over the sha256 of the target. The file begins with
+//      the tag "OTASIG ed25519\n".
+// A signature is verified only by a key of its scheme.
+enum class SigScheme { RsaSha256, Ed25519 };
+
+const char* sigSchemeName(SigScheme scheme);
+
+// desc: The hash of the target signed under "scheme", so the digest can be
+// computed piece by piece.
+QCryptographicHash::Algorithm sigHashOf(SigScheme scheme);
+
+// desc: The digest of "data" signed under "scheme".
+QByteArray sigDigestOf(const QByteArray& data, SigScheme scheme);
+
+// desc: Split the content of a signature file into its scheme and the
+// signature.
+// ret: false if the tag is unknown.
+bool parseSigFile(const QByteArray& content, SigScheme* scheme,
+                  QByteArray* signature);
 
 // Generate the key under current directory.
-void genKey(const QString& prikey_file, const QString& pubkey_file);
+void genKey(const QString& prikey_file, const QString& pubkey_file,
+            SigScheme scheme = SigScheme::RsaSha256);
 
 // Sign the target.
 bool sign(const QFileInfo& target, const QFileInfo& prikey,
@@ -33,6 +61,23 @@ bool sign(const QFileInfo& target, const QFileInfo& prikey,
 bool verify(const QFileInfo& hash, const QFileInfo& signature,
             const QFileInfo& pubkey) noexcept;
 
+// desc: Sign "digest"(sigDigestOf() under the scheme of "prikey").
+// ret: The bare signature, empty on failure.
+QByteArray signDigest(const QByteArray& digest,
+                      const QFileInfo& prikey) noexcept;
+
+// desc: Verify a bare signature of "digest" made under "scheme".
+bool verifyDigest(const QByteArray& digest, const QByteArray& signature,
+                  const QFileInfo& pubkey,
+                  SigScheme scheme = SigScheme::RsaSha256) noexcept;
+
+// desc: Verify "data" against the content of its signature file.
+bool verifyData(const QByteArray& data, const QByteArray& sig_file,
+                const QFileInfo& pubkey) noexcept;
+
+// desc: Forget the keys loaded, for example after a key rotation.
+void clearKeyCache() noexcept;
+
 }  // namespace otalib
 
 #endif  // SIGNATURE_H
@@ -0,0 +1,158 @@
+#ifndef SLOT_INSTALL_HPP
+#define SLOT_INSTALL_HPP
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QString>
+#include <optional>
+
+#include "dir_copy.hpp"
+#include "logger/logger.h"
+#include "otaerr.hpp"
+
+namespace otalib {
+
+static inline const QString kSlotCurrentName = "current";
+static inline const QString kSlotAName = "slot_a";
+static inline const QString kSlotBName = "slot_b";
+// base/slot_a.ready: slot_a holds a complete version to switch back to.
+static inline const QString kSlotReadySuffix = ".ready";
+
+// A/B slot install. The app lives in one of two slots under a base directory,
+// and "current" points to the active one:
+//      base/current -> slot_a
+//      base/slot_a/    the running app
+//      base/slot_b/    inactive, the next version is prepared here
+// The update clones the active slot into the inactive one, applies the packs
+// there, and switches "current" only when all of them succeed. The active slot
+// is never written, a crash at any point leaves it untouched.
+// A slot left by commit() is marked ready, it's the one the local rollback
+// switches back to. stage() takes the mark away first, so a slot patched by an
+// update that failed or was interrupted is never switched to.
+class SlotLayout {
+ public:
+  // desc: Find the layout "app_root" belongs to. Returns nullopt if the app is
+  // not installed in slots, or "app_root" is not the active slot.
+  static ::std::optional<SlotLayout> detect(const QDir& app_root) {
+    QString root = QFileInfo(app_root.absolutePath()).canonicalFilePath();
+    if (root.isEmpty()) return ::std::nullopt;
+
+    QDir base = QFileInfo(root).dir();
+    QFileInfo current(base.filePath(kSlotCurrentName));
+    if (!current.isSymLink()) return ::std::nullopt;
+    QString active = QFileInfo(current.symLinkTarget()).fileName();
+    if (active != kSlotAName && active != kSlotBName) return ::std::nullopt;
+    if (QFileInfo(base.filePath(active)).canonicalFilePath() != root)
+      return ::std::nullopt;
+    return SlotLayout(base, active);
+  }
+
+  QDir base() const { return base_; }
+  QDir active() const { return QDir(base_.filePath(active_)); }
+  QDir inactive() const { return QDir(base_.filePath(inactiveName())); }
+
+  // desc: Make the inactive slot a copy of the active one. The files share
+  // their data with the active slot(reflinks or hard links), so it costs about
+  // the metadata only. The patching replaces the files instead of rewriting
+  // them, which leaves the active slot as it is.
+  void stage() const {
+    QDir slot = inactive();
+    setReady(inactiveName(), false);
+    if (slot.exists() && !slot.removeRecursively()) {
+      OTAError::S_file_delete_fail xerror{slot.path(), STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+
+    CopyReport report =
+        copyDirectory(active().path().toStdString(), slot.path().toStdString(),
+                      CopyMode::Share);
+    if (report.ok()) return;
+    for (const auto& failure : report.failures_)
+      print<GeneralErrorCtrl>(std::cerr, "[" + failure.path_ + "]",
+                              failure.reason_);
+    OTAError::S_file_copy_fail xerror{active().path(), slot.path(),
+                                      STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
+  }
+
+  // desc: Remove the slot staged by an update that didn't finish.
+  void discard() const {
+    setReady(inactiveName(), false);
+    inactive().removeRecursively();
+  }
+
+  // desc: Whether the inactive slot is a complete version, left by commit().
+  bool inactiveReady() const {
+    return QFileInfo::exists(readyPath(inactiveName())) &&
+           inactive().exists();
+  }
+
+  // desc: Switch "current" to the inactive slot. A new link replaces the old
+  // one by rename(), so "current" always points to a complete slot. The slot
+  // switched from is marked ready.
+  void commit() {
+    QString next = inactiveName();
+    ::std::string link = base_.filePath(kSlotCurrentName).toStdString();
+    ::std::string tmp_link = link + ".new";
+
+    ::unlink(tmp_link.c_str());
+    if (::symlink(next.toStdString().c_str(), tmp_link.c_str()) < 0 ||
+        ::rename(tmp_link.c_str(), link.c_str()) < 0) {
+      ::unlink(tmp_link.c_str());
+      OTAError::S_file_write_fail xerror{QString::fromStdString(link),
+                                         STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+    // Make the switch durable.
+    syncBase();
+    QString previous = active_;
+    active_ = next;
+    setReady(next, false);
+    setReady(previous, true);
+  }
+
+ private:
+  SlotLayout(const QDir& base, const QString& active)
+      : base_(base), active_(active) {}
+
+  QString inactiveName() const {
+    return active_ == kSlotAName ? kSlotBName : kSlotAName;
+  }
+
+  QString readyPath(const QString& slot) const {
+    return base_.filePath(slot + kSlotReadySuffix);
+  }
+
+  void setReady(const QString& slot, bool ready) const {
+    QString path = readyPath(slot);
+    if (ready) {
+      QFile mark(path);
+      if (!mark.open(QFile::WriteOnly | QFile::Truncate)) return;
+      mark.close();
+    } else if (!QFile::exists(path) || !QFile::remove(path)) {
+      return;
+    }
+    syncBase();
+  }
+
+  void syncBase() const {
+    int fd = ::open(base_.path().toStdString().c_str(),
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+      ::fsync(fd);
+      ::close(fd);
+    }
+  }
+
+  QDir base_;
+  QString active_;
+};
+
+}  // namespace otalib
+
+#endif  // SLOT_INSTALL_HPP
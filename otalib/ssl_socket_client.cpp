@@ -120,7 +120,7 @@ int SSLSocketClient::send(const QByteArray &data) {
 ///
 /// \brief SSLSocketClient::recv
 ///
-int SSLSocketClient::recv() {
+int SSLSocketClient::recv(bool keep) {
   char buffer[kMaxBuffer];
   int n;
   DataSize totalSize = 0;
@@ -129,7 +129,7 @@ int SSLSocketClient::recv() {
       totalSize += n;
       progressCb_(buffer, totalSize, n);
     }
-    recver_.append(buffer, n);
+    if (keep) recver_.append(buffer, n);
   }
   int err = ::SSL_get_error(ssl_, n);
   // if (err == SSL_ERROR_SYSCALL) err = errno;
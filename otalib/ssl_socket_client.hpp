@@ -36,7 +36,9 @@ class SSLSocketClient {
   int send(const std::string& data);
   int send(const QByteArray& data);
 
-  int recv();
+  // "keep": Store the data into recver(). Otherwise the data only goes to the
+  // progress callback.
+  int recv(bool keep = true);
 
   decltype(auto) sender() { return &sender_; }
   decltype(auto) recver() { return &recver_; }
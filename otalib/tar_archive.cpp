@@ -0,0 +1,654 @@
+#include "tar_archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+
+namespace otalib {
+namespace tar_details {
+
+constexpr size_t kIOBufferSize = 64 * 1024;
+constexpr const char* kLongLinkName = "././@LongLink";
+
+struct Header {
+  char name_[100];
+  char mode_[8];
+  char uid_[8];
+  char gid_[8];
+  char size_[12];
+  char mtime_[12];
+  char chksum_[8];
+  char typeflag_;
+  char linkname_[100];
+  char magic_[8];
+  char uname_[32];
+  char gname_[32];
+  char devmajor_[8];
+  char devminor_[8];
+  char prefix_[155];
+  char pad_[12];
+};
+static_assert(sizeof(Header) == kTarBlockSize, "Tar header must be a block.");
+
+// Numeric fields are octal. The ones too large for it are stored in base-256
+// as GNU tar does.
+void putNumber(char* field, size_t len, uint64_t value) {
+  if (value < (uint64_t(1) << (3 * (len - 1)))) {
+    ::snprintf(field, len, "%0*llo", int(len - 1),
+               static_cast<unsigned long long>(value));
+    return;
+  }
+  for (size_t i = len - 1; i > 0; --i) {
+    field[i] = static_cast<char>(value & 0xff);
+    value >>= 8;
+  }
+  field[0] = static_cast<char>(0x80);
+}
+
+uint64_t getNumber(const char* field, size_t len) {
+  uint64_t value = 0;
+  if (static_cast<unsigned char>(field[0]) & 0x80) {
+    value = static_cast<unsigned char>(field[0]) & 0x7f;
+    for (size_t i = 1; i < len; ++i)
+      value = (value << 8) | static_cast<unsigned char>(field[i]);
+    return value;
+  }
+  size_t i = 0;
+  while (i < len && field[i] == ' ') ++i;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    value = (value << 3) | (field[i] - '0');
+  return value;
+}
+
+uint64_t checksumOf(const Header& header) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(&header);
+  uint64_t sum = 0;
+  for (size_t i = 0; i < kTarBlockSize; ++i) sum += p[i];
+  // The checksum field itself counts as spaces.
+  for (size_t i = 0; i < sizeof(header.chksum_); ++i)
+    sum += ' ' - static_cast<unsigned char>(header.chksum_[i]);
+  return sum;
+}
+
+::std::string fieldString(const char* field, size_t len) {
+  return ::std::string(field, ::strnlen(field, len));
+}
+
+uint64_t paddingOf(uint64_t size) {
+  return (kTarBlockSize - size % kTarBlockSize) % kTarBlockSize;
+}
+
+// Entry names in the archive are relative. Drop the "./" and reject the ones
+// escaping from the destination.
+bool normalizeName(const ::std::string& name, ::std::string* out) {
+  if (!name.empty() && name.front() == '/') return false;
+  out->clear();
+  size_t begin = 0;
+  while (begin <= name.size()) {
+    size_t end = name.find('/', begin);
+    if (end == ::std::string::npos) end = name.size();
+    ::std::string part = name.substr(begin, end - begin);
+    begin = end + 1;
+    if (part.empty() || part == ".") continue;
+    if (part == "..") return false;
+    if (!out->empty()) out->push_back('/');
+    out->append(part);
+  }
+  return true;
+}
+
+[[noreturn]] void throwCorrupt(const QString& archive, const QString& extra) {
+  OTAError::S_archive_corrupt xerror{archive, extra};
+  throw OTAError{::std::move(xerror)};
+}
+
+}  // namespace tar_details
+
+//
+// TarGzWriter
+//
+TarGzWriter::TarGzWriter(TarSink sink, int level)
+    : sink_(::std::move(sink)), finished_(false) {
+  ::memset(&zs_, 0, sizeof(zs_));
+  // 15 + 16: gzip wrapper with the largest window.
+  if (::deflateInit2(&zs_, level, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+    OTAError::S_general xerror{"Cannot initialize the gzip stream." +
+                               STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
+  }
+}
+
+TarGzWriter::~TarGzWriter() { ::deflateEnd(&zs_); }
+
+void TarGzWriter::addDirectory(const ::std::string& name, mode_t mode,
+                               time_t mtime) {
+  TarEntry entry;
+  entry.name_ = name;
+  if (entry.name_.empty() || entry.name_.back() != '/') entry.name_ += '/';
+  entry.type_ = TarEntry::Directory;
+  entry.mode_ = mode;
+  entry.mtime_ = mtime;
+  writeHeader(entry);
+}
+
+void TarGzWriter::addFile(const ::std::string& name, const char* data,
+                          size_t size, mode_t mode, time_t mtime) {
+  TarEntry entry;
+  entry.name_ = name;
+  entry.mode_ = mode;
+  entry.size_ = size;
+  entry.mtime_ = mtime;
+  writeHeader(entry);
+  write(data, size);
+  writePadding(size);
+}
+
+void TarGzWriter::addFile(const ::std::string& name, const QString& path) {
+  ::std::string file = path.toStdString();
+  int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || ::fstat(fd, &st) < 0) {
+    if (fd >= 0) ::close(fd);
+    OTAError::S_file_open_fail xerror{path, STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
+  }
+
+  TarEntry entry;
+  entry.name_ = name;
+  entry.mode_ = st.st_mode & 07777;
+  entry.size_ = st.st_size;
+  entry.mtime_ = st.st_mtime;
+  writeHeader(entry);
+
+  // The header has promised the size, stick to it.
+  ::std::vector<char> buffer(tar_details::kIOBufferSize);
+  uint64_t left = entry.size_;
+  while (left > 0) {
+    ssize_t n = ::read(fd, buffer.data(),
+                       ::std::min<uint64_t>(buffer.size(), left));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      ::close(fd);
+      OTAError::S_file_copy_fail xerror{path, QString::fromStdString(name),
+                                        "File shrank while archiving." +
+                                            STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+    write(buffer.data(), n);
+    left -= n;
+  }
+  ::close(fd);
+  writePadding(entry.size_);
+}
+
+void TarGzWriter::addTree(const QDir& dir, const ::std::string& prefix) {
+  addDirectory(prefix, 0755,
+               QFileInfo(dir.absolutePath()).lastModified().toSecsSinceEpoch());
+  // Sorted, so the same tree always gives the same archive.
+  QFileInfoList list =
+      dir.entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden |
+                            QDir::System,
+                        QDir::Name);
+  for (const auto& info : list) {
+    ::std::string name = prefix + "/" + info.fileName().toStdString();
+    if (info.isSymLink()) {
+      char target[PATH_MAX];
+      ssize_t n = ::readlink(info.filePath().toStdString().c_str(), target,
+                             sizeof(target));
+      if (n < 0) {
+        OTAError::S_file_open_fail xerror{info.filePath(),
+                                          STRING_SOURCE_LOCATION};
+        throw OTAError{::std::move(xerror)};
+      }
+      TarEntry entry;
+      entry.name_ = name;
+      entry.link_.assign(target, n);
+      entry.type_ = TarEntry::Symlink;
+      entry.mode_ = 0777;
+      entry.mtime_ = info.lastModified().toSecsSinceEpoch();
+      writeHeader(entry);
+    } else if (info.isDir()) {
+      addTree(QDir(info.filePath()), name);
+    } else {
+      addFile(name, info.filePath());
+    }
+  }
+}
+
+void TarGzWriter::finish() {
+  if (finished_) return;
+  // Two zero blocks mark the end.
+  char zeros[kTarBlockSize * 2]{0};
+  write(zeros, sizeof(zeros), Z_FINISH);
+  finished_ = true;
+}
+
+void TarGzWriter::writeHeader(const TarEntry& entry) {
+  using tar_details::Header;
+  if (finished_) {
+    OTAError::S_general xerror{"Archive has been finished." +
+                               STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
+  }
+
+  auto fill = [](Header* header, const ::std::string& name, char type,
+                 mode_t mode, uint64_t size, time_t mtime) {
+    ::memset(header, 0, sizeof(Header));
+    ::memcpy(header->name_, name.data(),
+             ::std::min(name.size(), sizeof(header->name_)));
+    tar_details::putNumber(header->mode_, sizeof(header->mode_), mode);
+    tar_details::putNumber(header->uid_, sizeof(header->uid_), 0);
+    tar_details::putNumber(header->gid_, sizeof(header->gid_), 0);
+    tar_details::putNumber(header->size_, sizeof(header->size_), size);
+    tar_details::putNumber(header->mtime_, sizeof(header->mtime_), mtime);
+    header->typeflag_ = type;
+    ::memcpy(header->magic_, "ustar  ", 8);  // GNU format.
+  };
+  auto seal = [this](Header* header) {
+    ::snprintf(header->chksum_, 7, "%06llo",
+               static_cast<unsigned long long>(
+                   tar_details::checksumOf(*header) & 0777777));
+    header->chksum_[7] = ' ';
+    write(reinterpret_cast<const char*>(header), sizeof(Header));
+  };
+  // The names too long for the header go into a record before it.
+  auto longRecord = [&](char type, const ::std::string& value) {
+    Header header;
+    fill(&header, tar_details::kLongLinkName, type, 0644, value.size() + 1, 0);
+    seal(&header);
+    write(value.c_str(), value.size() + 1);
+    writePadding(value.size() + 1);
+  };
+
+  if (entry.name_.size() > sizeof(Header::name_)) longRecord('L', entry.name_);
+  if (entry.link_.size() > sizeof(Header::linkname_))
+    longRecord('K', entry.link_);
+
+  Header header;
+  uint64_t size = entry.type_ == TarEntry::File ? entry.size_ : 0;
+  fill(&header, entry.name_, entry.type_, entry.mode_, size, entry.mtime_);
+  ::memcpy(header.linkname_, entry.link_.data(),
+           ::std::min(entry.link_.size(), sizeof(header.linkname_)));
+  seal(&header);
+}
+
+void TarGzWriter::writePadding(uint64_t size) {
+  static const char zeros[kTarBlockSize]{0};
+  write(zeros, tar_details::paddingOf(size));
+}
+
+void TarGzWriter::write(const char* data, size_t size, int flush) {
+  char out[tar_details::kIOBufferSize];
+  zs_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  zs_.avail_in = static_cast<uInt>(size);
+  int ret;
+  do {
+    zs_.next_out = reinterpret_cast<Bytef*>(out);
+    zs_.avail_out = sizeof(out);
+    ret = ::deflate(&zs_, flush);
+    if (ret == Z_STREAM_ERROR) {
+      OTAError::S_general xerror{"Gzip stream broken." +
+                                 STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+    size_t have = sizeof(out) - zs_.avail_out;
+    if (have > 0) sink_(out, have);
+  } while (zs_.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+}
+
+//
+// TarGzReader
+//
+TarGzReader::TarGzReader()
+    : state_(State::Header),
+      ext_type_(0),
+      remain_(0),
+      padding_(0),
+      zero_blocks_(0) {
+  ::memset(&zs_, 0, sizeof(zs_));
+  // 15 + 32: detect the gzip or zlib wrapper.
+  if (::inflateInit2(&zs_, 15 + 32) != Z_OK) {
+    OTAError::S_general xerror{"Cannot initialize the gzip stream." +
+                               STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
+  }
+}
+
+TarGzReader::~TarGzReader() { ::inflateEnd(&zs_); }
+
+void TarGzReader::feed(const char* data, size_t size) {
+  char out[tar_details::kIOBufferSize];
+  zs_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  zs_.avail_in = static_cast<uInt>(size);
+  // A full buffer may leave output in zlib after the input is used up, it's
+  // taken before the next piece arrives.
+  bool full = false;
+  while ((zs_.avail_in > 0 || full) && state_ != State::Done) {
+    zs_.next_out = reinterpret_cast<Bytef*>(out);
+    zs_.avail_out = sizeof(out);
+    int ret = ::inflate(&zs_, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      tar_details::throwCorrupt(
+          "gzip", QString(zs_.msg ? zs_.msg : "inflate failed.") +
+                      STRING_SOURCE_LOCATION);
+    full = zs_.avail_out == 0;
+    consume(out, sizeof(out) - zs_.avail_out);
+    // Concatenated gzip members are one stream.
+    if (ret == Z_STREAM_END) ::inflateReset(&zs_);
+  }
+}
+
+void TarGzReader::consume(const char* data, size_t size) {
+  while (size > 0 && state_ != State::Done) {
+    size_t n = 0;
+    switch (state_) {
+      case State::Header: {
+        n = ::std::min(kTarBlockSize - block_.size(), size);
+        block_.append(data, n);
+        if (block_.size() == kTarBlockSize) {
+          parseHeader();
+          block_.clear();
+        }
+        break;
+      }
+      case State::Content:
+      case State::Skip: {
+        n = ::std::min<uint64_t>(remain_, size);
+        if (state_ == State::Content && on_data_) on_data_(entry_, data, n);
+        remain_ -= n;
+        if (remain_ == 0) {
+          if (state_ == State::Content && on_end_) on_end_(entry_);
+          state_ = State::Padding;
+        }
+        break;
+      }
+      case State::Extension: {
+        n = ::std::min<uint64_t>(remain_, size);
+        extension_.append(data, n);
+        remain_ -= n;
+        if (remain_ == 0) {
+          parseExtension();
+          state_ = State::Padding;
+        }
+        break;
+      }
+      case State::Padding: {
+        n = ::std::min<uint64_t>(padding_, size);
+        padding_ -= n;
+        break;
+      }
+      case State::Done:
+        return;
+    }
+    data += n;
+    size -= n;
+    if (state_ == State::Padding && padding_ == 0) state_ = State::Header;
+  }
+}
+
+void TarGzReader::parseHeader() {
+  using tar_details::Header;
+  Header header;
+  ::memcpy(&header, block_.data(), kTarBlockSize);
+
+  if (block_.find_first_not_of('\0') == ::std::string::npos) {
+    if (++zero_blocks_ == 2) state_ = State::Done;
+    return;
+  }
+  zero_blocks_ = 0;
+
+  uint64_t chksum =
+      tar_details::getNumber(header.chksum_, sizeof(header.chksum_));
+  if (chksum != tar_details::checksumOf(header))
+    tar_details::throwCorrupt("tar",
+                              "Header checksum mismatch." +
+                                  STRING_SOURCE_LOCATION);
+
+  uint64_t size = tar_details::getNumber(header.size_, sizeof(header.size_));
+  padding_ = tar_details::paddingOf(size);
+  remain_ = size;
+
+  switch (header.typeflag_) {
+    case 'L':  // GNU long name.
+    case 'K':  // GNU long link.
+    case 'x':  // POSIX extended header.
+    case 'g':  // POSIX global header, ignored.
+      ext_type_ = header.typeflag_;
+      extension_.clear();
+      state_ = State::Extension;
+      break;
+    case '0':
+    case '\0':
+    case '7':
+      entry_.type_ = TarEntry::File;
+      beginEntry(header, size);
+      break;
+    case '5':
+      entry_.type_ = TarEntry::Directory;
+      beginEntry(header, size);
+      break;
+    case '2':
+      entry_.type_ = TarEntry::Symlink;
+      beginEntry(header, size);
+      break;
+    default:
+      // Hard links, devices, fifos... are not part of any pack.
+      long_name_.clear();
+      long_link_.clear();
+      state_ = State::Skip;
+      break;
+  }
+
+  if (remain_ == 0 && state_ != State::Done) {
+    // Nothing follows the header.
+    if (state_ == State::Content && on_end_) on_end_(entry_);
+    if (state_ == State::Extension) parseExtension();
+    state_ = State::Header;
+  }
+}
+
+void TarGzReader::beginEntry(const tar_details::Header& header,
+                             uint64_t size) {
+  if (!long_name_.empty()) {
+    entry_.name_ = ::std::move(long_name_);
+  } else {
+    entry_.name_ = tar_details::fieldString(header.name_, sizeof(header.name_));
+    // POSIX ustar splits the long names.
+    if (::memcmp(header.magic_, "ustar\0", 6) == 0 && header.prefix_[0])
+      entry_.name_ =
+          tar_details::fieldString(header.prefix_, sizeof(header.prefix_)) +
+          "/" + entry_.name_;
+  }
+  if (!long_link_.empty())
+    entry_.link_ = ::std::move(long_link_);
+  else
+    entry_.link_ =
+        tar_details::fieldString(header.linkname_, sizeof(header.linkname_));
+  long_name_.clear();
+  long_link_.clear();
+
+  entry_.mode_ =
+      tar_details::getNumber(header.mode_, sizeof(header.mode_)) & 07777;
+  entry_.mtime_ = tar_details::getNumber(header.mtime_, sizeof(header.mtime_));
+  entry_.size_ = entry_.type_ == TarEntry::File ? size : 0;
+
+  if (on_entry_) on_entry_(entry_);
+  state_ = entry_.type_ == TarEntry::File ? State::Content : State::Skip;
+}
+
+void TarGzReader::parseExtension() {
+  if (ext_type_ == 'L' || ext_type_ == 'K') {
+    ::std::string value(extension_.c_str());  // Up to the NUL.
+    if (ext_type_ == 'L')
+      long_name_ = ::std::move(value);
+    else
+      long_link_ = ::std::move(value);
+    return;
+  }
+  if (ext_type_ != 'x') return;
+
+  // Records: "<length> <key>=<value>\n".
+  size_t pos = 0;
+  while (pos < extension_.size()) {
+    size_t space = extension_.find(' ', pos);
+    if (space == ::std::string::npos) break;
+    size_t len = ::std::strtoull(extension_.c_str() + pos, nullptr, 10);
+    if (len == 0 || pos + len > extension_.size()) break;
+    ::std::string record = extension_.substr(space + 1, pos + len - space - 2);
+    size_t eq = record.find('=');
+    if (eq != ::std::string::npos) {
+      ::std::string key = record.substr(0, eq);
+      if (key == "path")
+        long_name_ = record.substr(eq + 1);
+      else if (key == "linkpath")
+        long_link_ = record.substr(eq + 1);
+    }
+    pos += len;
+  }
+}
+
+//
+// TarDirExtractor
+//
+TarDirExtractor::TarDirExtractor(const QString& directory)
+    : root_(directory), fd_(-1) {
+  if (!root_.exists()) ::mkdir(directory.toStdString().c_str(), 0755);
+  reader_.setEntryCallback([this](const TarEntry& e) { onEntry(e); });
+  reader_.setDataCallback(
+      [this](const TarEntry& e, const char* d, size_t n) { onData(e, d, n); });
+  reader_.setEndCallback([this](const TarEntry& e) { onEnd(e); });
+}
+
+TarDirExtractor::~TarDirExtractor() {
+  if (fd_ >= 0) ::close(fd_);
+}
+
+void TarDirExtractor::finish() {
+  if (!reader_.finished())
+    tar_details::throwCorrupt(root_.path(), "Unexpected end of the archive." +
+                                                STRING_SOURCE_LOCATION);
+}
+
+void TarDirExtractor::onEntry(const TarEntry& entry) {
+  ::std::string name;
+  if (!tar_details::normalizeName(entry.name_, &name))
+    tar_details::throwCorrupt(root_.path(),
+                              "Unsafe entry [" +
+                                  QString::fromStdString(entry.name_) + "]." +
+                                  STRING_SOURCE_LOCATION);
+  current_ = root_.filePath(QString::fromStdString(name));
+  ::std::string path = current_.toStdString();
+
+  if (entry.type_ == TarEntry::Directory) {
+    root_.mkpath(current_);
+    return;
+  }
+  root_.mkpath(QFileInfo(current_).path());
+  ::unlink(path.c_str());
+
+  if (entry.type_ == TarEntry::Symlink) {
+    // Only the links staying inside the tree.
+    ::std::string link;
+    if (!tar_details::normalizeName(entry.link_, &link))
+      tar_details::throwCorrupt(root_.path(),
+                                "Unsafe link [" +
+                                    QString::fromStdString(entry.link_) + "]." +
+                                    STRING_SOURCE_LOCATION);
+    if (::symlink(entry.link_.c_str(), path.c_str()) < 0) {
+      OTAError::S_file_write_fail xerror{current_, STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+    return;
+  }
+
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+               entry.mode_);
+  if (fd_ < 0) {
+    OTAError::S_file_open_fail xerror{current_, STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
+  }
+  ::fchmod(fd_, entry.mode_);  // Not masked by umask, same as tar.
+}
+
+void TarDirExtractor::onData(const TarEntry&, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = ::write(fd_, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      OTAError::S_file_write_fail xerror{current_, STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+void TarDirExtractor::onEnd(const TarEntry& entry) {
+  struct timespec times[2];
+  times[0].tv_sec = times[1].tv_sec = entry.mtime_;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  ::futimens(fd_, times);
+  int ret = ::close(fd_);
+  fd_ = -1;
+  if (ret < 0) {
+    OTAError::S_file_write_fail xerror{current_, STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
+  }
+}
+
+//
+// Helpers
+//
+void tar_create_archive_file_gzip(const QString& directory,
+                                  const QString& archive_file) {
+  QFile archive(archive_file);
+  if (!archive.open(QFile::WriteOnly | QFile::Truncate)) {
+    OTAError::S_file_open_fail xerror{archive_file, STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
+  }
+  TarGzWriter writer([&archive, &archive_file](const char* data, size_t size) {
+    if (archive.write(data, size) != qint64(size)) {
+      OTAError::S_file_write_fail xerror{archive_file, STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+  });
+  writer.addTree(QDir(directory));
+  writer.finish();
+  archive.close();
+}
+
+void tar_extract_archive_file_gzip(const QString& archive_file,
+                                   const QString& directory) {
+  QFile archive(archive_file);
+  if (!archive.open(QFile::ReadOnly)) {
+    OTAError::S_file_open_fail xerror{archive_file, STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
+  }
+  TarDirExtractor extractor(directory);
+  ::std::vector<char> buffer(tar_details::kIOBufferSize);
+  qint64 n;
+  while ((n = archive.read(buffer.data(), buffer.size())) > 0)
+    extractor.feed(buffer.data(), n);
+  archive.close();
+  extractor.finish();
+}
+
+void tar_extract_archive_buffer_gzip(const QByteArray& archive,
+                                     const QString& directory) {
+  TarDirExtractor extractor(directory);
+  extractor.feed(archive.constData(), archive.size());
+  extractor.finish();
+}
+
+}  // namespace otalib
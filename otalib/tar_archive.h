@@ -0,0 +1,160 @@
+#ifndef TAR_ARCHIVE_H
+#define TAR_ARCHIVE_H
+
+#include <sys/types.h>
+#include <zlib.h>
+
+#include <QByteArray>
+#include <QDir>
+#include <QString>
+#include <functional>
+#include <string>
+
+#include "otaerr.hpp"
+
+namespace otalib {
+
+// In-process replacement of "tar -zcf"/"tar -zxf". The archives are gzip
+// compressed GNU tar, long names are stored with 'L' records, so they stay
+// readable by the system's tar and the old clients.
+constexpr size_t kTarBlockSize = 512;
+
+namespace tar_details {
+struct Header;
+}  // namespace tar_details
+
+// Receives the compressed bytes produced by TarGzWriter.
+using TarSink = ::std::function<void(const char* data, size_t size)>;
+
+struct TarEntry {
+  enum Type : char { File = '0', Symlink = '2', Directory = '5' };
+
+  ::std::string name_;
+  ::std::string link_;  // Only for symlinks.
+  Type type_ = File;
+  mode_t mode_ = 0644;
+  uint64_t size_ = 0;
+  time_t mtime_ = 0;
+};
+
+class TarGzWriter {
+ public:
+  explicit TarGzWriter(TarSink sink, int level = Z_DEFAULT_COMPRESSION);
+  ~TarGzWriter();
+
+  TarGzWriter(const TarGzWriter&) = delete;
+  TarGzWriter& operator=(const TarGzWriter&) = delete;
+
+  // The entries from memory are stamped "mtime", 0 by default, so the same
+  // content always gives the same bytes.
+  void addDirectory(const ::std::string& name, mode_t mode = 0755,
+                    time_t mtime = 0);
+  void addFile(const ::std::string& name, const char* data, size_t size,
+               mode_t mode = 0644, time_t mtime = 0);
+  // Stream the file from the disk, stamped by its own mtime.
+  void addFile(const ::std::string& name, const QString& path);
+  // Add everything under "dir" as "prefix/...". Same as "tar -C dir prefix".
+  void addTree(const QDir& dir, const ::std::string& prefix = ".");
+
+  // Write the end-of-archive blocks and flush the gzip stream. Nothing can be
+  // added after.
+  void finish();
+
+ private:
+  void writeHeader(const TarEntry& entry);
+  void writePadding(uint64_t size);
+  void write(const char* data, size_t size, int flush = Z_NO_FLUSH);
+
+  TarSink sink_;
+  z_stream zs_;
+  bool finished_;
+};
+
+class TarGzReader {
+ public:
+  using EntryCallback = ::std::function<void(const TarEntry&)>;
+  using DataCallback =
+      ::std::function<void(const TarEntry&, const char* data, size_t size)>;
+
+  TarGzReader();
+  ~TarGzReader();
+
+  TarGzReader(const TarGzReader&) = delete;
+  TarGzReader& operator=(const TarGzReader&) = delete;
+
+  // "on_entry" is called when an entry begins, "on_data" with its content
+  // piece by piece, and "on_end" when the content is complete.
+  void setEntryCallback(EntryCallback on_entry) {
+    on_entry_ = ::std::move(on_entry);
+  }
+  void setDataCallback(DataCallback on_data) { on_data_ = ::std::move(on_data); }
+  void setEndCallback(EntryCallback on_end) { on_end_ = ::std::move(on_end); }
+
+  // Push the compressed bytes. Throws OTAError on a corrupt archive.
+  void feed(const char* data, size_t size);
+
+  // True after the end-of-archive blocks.
+  bool finished() const noexcept { return state_ == State::Done; }
+
+ private:
+  enum class State { Header, Content, Skip, Extension, Padding, Done };
+
+  void consume(const char* data, size_t size);
+  void parseHeader();
+  void parseExtension();
+  void beginEntry(const tar_details::Header& header, uint64_t size);
+
+  z_stream zs_;
+  State state_;
+  ::std::string block_;      // Partial header block.
+  ::std::string extension_;  // Content of 'L', 'K' or 'x' records.
+  char ext_type_;
+  ::std::string long_name_;
+  ::std::string long_link_;
+  TarEntry entry_;
+  uint64_t remain_;   // Content left of the current record.
+  uint64_t padding_;  // Padding left after it.
+  size_t zero_blocks_;
+
+  EntryCallback on_entry_;
+  DataCallback on_data_;
+  EntryCallback on_end_;
+};
+
+// desc: Pack everything under "directory" into "archive_file".
+void tar_create_archive_file_gzip(const QString& directory,
+                                  const QString& archive_file);
+
+// desc: Unpack "archive_file" into "directory". The entries escaping from
+// "directory" are rejected.
+void tar_extract_archive_file_gzip(const QString& archive_file,
+                                   const QString& directory);
+
+// desc: Same as above, but the archive is in memory.
+void tar_extract_archive_buffer_gzip(const QByteArray& archive,
+                                     const QString& directory);
+
+// desc: Write the entries of a reader into "directory". Feed the reader and
+// call finish() at the end.
+class TarDirExtractor {
+ public:
+  explicit TarDirExtractor(const QString& directory);
+  ~TarDirExtractor();
+
+  void feed(const char* data, size_t size) { reader_.feed(data, size); }
+  void finish();
+
+ private:
+  void onEntry(const TarEntry& entry);
+  void onData(const TarEntry& entry, const char* data, size_t size);
+  void onEnd(const TarEntry& entry);
+
+  TarGzReader reader_;
+  QDir root_;
+  QString current_;
+  int fd_;
+};
+
+}  // namespace otalib
+
+#endif  // TAR_ARCHIVE_H
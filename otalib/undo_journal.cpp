@@ -0,0 +1,170 @@
+#include "undo_journal.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QTextStream>
+
+#include "diff.h"
+#include "dir_copy.hpp"
+#include "logger/logger.h"
+
+namespace otalib {
+namespace {
+
+static inline const QString kJournalInfoName = "journal_info";
+static inline const QString kRollbackLogName = "rollback_log";
+
+// journal_info ::= from|dest|count
+bool readJournalInfo(const QDir& root, QString* from, QString* dest,
+                     int* count) {
+  QFile file(root.filePath(kJournalInfoName));
+  if (!file.open(QFile::ReadOnly)) return false;
+  QStringList info = QString::fromUtf8(file.readAll()).trimmed().split("|");
+  file.close();
+  if (info.size() != 3) return false;
+
+  bool succ = false;
+  *from = info.at(0);
+  *dest = info.at(1);
+  *count = info.at(2).toInt(&succ);
+  return succ && *count > 0;
+}
+
+}  // namespace
+
+UndoJournal::UndoJournal(const QDir& root, uint64_t cap)
+    : root_(root), cap_(cap), used_(0), valid_(false), packs_(0) {}
+
+void UndoJournal::begin(const QString& from, const QString& dest) {
+  root_.removeRecursively();
+  from_ = from;
+  dest_ = dest;
+  used_ = 0;
+  packs_ = 0;
+  entries_.clear();
+  pending_.clear();
+  // A cap of 0 turns the journal off.
+  valid_ = cap_ > 0 && root_.mkpath(".");
+}
+
+void UndoJournal::beginPack() {
+  entries_.clear();
+  pending_.clear();
+  if (!valid_) return;
+  pack_ = QDir(root_.filePath(QString::number(packs_)));
+  if (!root_.mkpath(pack_.path())) invalidate();
+}
+
+void UndoJournal::endPack() {
+  // Even a pack failed halfway can be undone, its actions performed are all
+  // recorded.
+  pending_.clear();
+  if (!valid_) return;
+  QFile log(pack_.filePath(kRollbackLogName));
+  if (!log.open(QFile::WriteOnly | QFile::Truncate)) {
+    invalidate();
+    return;
+  }
+  QTextStream stream(&log);
+  for (const auto& info : entries_) writeDeltaLog(stream, info);
+  stream.flush();
+  log.close();
+  entries_.clear();
+
+  ++packs_;
+  writeInfo();
+}
+
+void UndoJournal::record(const DeltaInfo& info, const QDir& target) {
+  pending_.clear();
+  if (!valid_) return;
+
+  // Undo of an add is a delete, nothing to keep.
+  const QString& pos = info.position;
+  if (info.action == Action::ADD) {
+    pending_.push_back({Action::DELETEACT, info.category, pos, QString()});
+    return;
+  }
+
+  // Delete or delta, keep the previous content.
+  ::std::string from = target.absoluteFilePath(pos).toStdString();
+  ::std::string to = pack_.absoluteFilePath(pos).toStdString();
+  pack_.mkpath(QFileInfo(pack_.absoluteFilePath(pos)).path());
+  bool succ = false;
+  size_t bytes = 0;
+  if (info.category == Category::DIR) {
+    CopyReport report = copyDirectory(from, to, CopyMode::Share);
+    succ = report.ok();
+    bytes = report.bytes_;
+  } else {
+    succ = copyFile(from, to, CopyMode::Share, &bytes);
+  }
+  used_ += bytes;
+  if (!succ || used_ > cap_) {
+    invalidate();
+    return;
+  }
+
+  // The rollback pack is applied from the back, a patched file is deleted
+  // before the previous one is added back.
+  pending_.push_back({Action::ADD, info.category, pos, QString()});
+  if (info.action == Action::DELTA)
+    pending_.push_back({Action::DELETEACT, Category::FILE, pos, QString()});
+}
+
+void UndoJournal::confirm() {
+  entries_ += pending_;
+  pending_.clear();
+}
+
+void UndoJournal::invalidate() {
+  if (!valid_) return;
+  print<GeneralWarnCtrl>(::std::cout,
+                         "Undo journal dropped, the update cannot be rolled "
+                         "back locally.");
+  valid_ = false;
+  entries_.clear();
+  pending_.clear();
+  root_.removeRecursively();
+}
+
+bool UndoJournal::usable() const {
+  QString from, dest;
+  int count = 0;
+  return readJournalInfo(root_, &from, &dest, &count);
+}
+
+QString UndoJournal::rollback(const QDir& app_root) {
+  QString from, dest;
+  int count = 0;
+  if (!readJournalInfo(root_, &from, &dest, &count)) {
+    OTAError::S_general xerror{"No local journal to roll back." +
+                               STRING_SOURCE_LOCATION};
+    throw OTAError{::std::move(xerror)};
+  }
+
+  // Last pack first. Each one keeps a done_log, an interrupted rollback
+  // resumes where it stopped.
+  for (int i = count - 1; i >= 0; --i) {
+    QDir pack(root_.filePath(QString::number(i)));
+    if (!bs::applyDeltaPack(pack, app_root)) {
+      OTAError::S_apply_pack_unexpected_fail xerror{pack.path(),
+                                                    STRING_SOURCE_LOCATION};
+      throw OTAError{::std::move(xerror)};
+    }
+  }
+  root_.removeRecursively();
+  return from;
+}
+
+void UndoJournal::writeInfo() {
+  QSaveFile file(root_.filePath(kJournalInfoName));
+  QByteArray info =
+      (from_ + "|" + dest_ + "|" + QString::number(packs_)).toUtf8();
+  if (!file.open(QFile::WriteOnly) || file.write(info) != info.size() ||
+      !file.commit())
+    invalidate();
+}
+
+}  // namespace otalib
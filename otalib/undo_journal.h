@@ -0,0 +1,65 @@
+#ifndef UNDO_JOURNAL_H
+#define UNDO_JOURNAL_H
+
+#include <QDir>
+#include <QString>
+#include <cstdint>
+
+#include "delta_log.h"
+
+namespace otalib {
+
+// Local undo journal of an update. Before an action of a pack replaces or
+// deletes anything in the app, the previous content is kept, so the update can
+// be reverted without the server.
+// The journal of every pack is itself a rollback pack(rollback_log and the
+// previous files), applied by applyDeltaPack() in the reverse order:
+//      root/journal_info    from|dest|count of the packs
+//      root/0/rollback_log  undo of the 1st pack
+//      root/0/...           previous content
+//      root/1/...
+// The previous content shares the data with the app when it can(hard links),
+// and it is counted against "cap" only when it's really copied. The journal is
+// dropped once it goes over the cap.
+class UndoJournal {
+ public:
+  explicit UndoJournal(const QDir& root, uint64_t cap);
+
+  // Start a new journal, the old one is dropped.
+  void begin(const QString& from, const QString& dest);
+
+  // Called around the apply of every pack.
+  void beginPack();
+  void endPack();
+
+  // Called before "info" is performed on "target", and after it succeeds.
+  void record(const DeltaInfo& info, const QDir& target);
+  void confirm();
+  // The journal misses something, it cannot be used any more.
+  void invalidate();
+
+  // desc: Whether there's a usable journal under "root".
+  bool usable() const;
+
+  // desc: Revert the app to the version before the update, and drop the
+  // journal. Returns the version reverted to.
+  QString rollback(const QDir& app_root);
+
+ private:
+  void writeInfo();
+
+  QDir root_;
+  uint64_t cap_;
+  uint64_t used_;
+  bool valid_;
+  QString from_;
+  QString dest_;
+  int packs_;
+  QDir pack_;
+  DeltaInfoStream entries_;
+  DeltaInfoStream pending_;
+};
+
+}  // namespace otalib
+
+#endif  // UNDO_JOURNAL_H
@@ -11,6 +11,7 @@
 #include <QJsonParseError>
 #include <QTextStream>
 #include <optional>
+#include <vector>
 
 #include "logger/logger.h"
 #include "utils.hpp"
@@ -43,7 +44,27 @@ Response Json Pattern
    "Strategy" = "...",
    "Destination" = "..."
 }
+Confirm Json Pattern
+{
+   "Confirm" = "Yes",
+   "Action" = "...",
+   "Strategy" = "...",
+   "From" = "...",
+   "Destination" = "...",
+   ## 0..1, the app and its channel as in the request, they choose the
+   ## VersionMap of the server. The default one serves a confirm without them.
+   "name" = "...",
+   "type" = "...",
+   ## 0..1, the packs the client has cached.
+   "Cached" = [ { "Pack" = "...", "Sig" = "sha256 of the signature" }, ... ]
+}
 */
+// A pack the client has kept from a previous update.
+struct CachedPack {
+  QString packname_;
+  QString sig_hash_;  // Hex of sha256 of the pack's signature.
+};
+
 template <typename VersionType>
 using CheckInfo = std::tuple<StrategyAction, StrategyType, VersionType>;
 template <typename VersionType>
@@ -383,9 +404,12 @@ template <typename VersionType>
 
   // Check whether the responce is always the newest version.
   if (strategy.contains("newest")) {
-    // Always return the "newest".
+    // Always return the "newest". A map without versions keeps the client
+    // where it is, which is answered as no update.
+    auto newest = vcm.newest();
     return CheckInfo<VersionType>{StrategyAction::update,
-                                  StrategyType::optional, vcm.newest()};
+                                  StrategyType::optional,
+                                  newest ? *newest : cinfo.version};
   }
 
   // Check update strategy.
@@ -579,8 +603,33 @@ template <typename VersionType>
   return ParseResponse<VersionType>(raw);
 }
 
+// desc: The packs listed in the "Cached" field of a confirm.
+static ::std::vector<CachedPack> ParseConfirmCached(const QByteArray& raw) {
+  ::std::vector<CachedPack> packs;
+  QJsonObject jobj = QJsonDocument::fromJson(raw).object();
+  if (!jobj.contains("Cached") || !jobj.value("Cached").isArray())
+    return packs;
+  for (auto iter : jobj.value("Cached").toArray()) {
+    QJsonObject item = iter.toObject();
+    CachedPack pack{item.value("Pack").toString(),
+                    item.value("Sig").toString()};
+    if (!pack.packname_.isEmpty() && !pack.sig_hash_.isEmpty())
+      packs.push_back(::std::move(pack));
+  }
+  return packs;
+}
+
+// desc: The app and the channel named by a confirm, empty if it has none.
+static ::std::pair<QString, QString> ParseConfirmApp(const QByteArray& raw) {
+  QJsonObject jobj = QJsonDocument::fromJson(raw).object();
+  return {jobj.value("name").toString(), jobj.value("type").toString()};
+}
+
 template <typename VersionType>
-QJsonDocument MakeConfirm(const RequestResponse<VersionType>& response) {
+QJsonDocument MakeConfirm(const RequestResponse<VersionType>& response,
+                          const ::std::vector<CachedPack>& cached = {},
+                          const QString& appname = QString(),
+                          const QString& apptype = QString()) {
   //
   QJsonDocument jdoc;
   QJsonObject jobj;
@@ -612,6 +661,18 @@ QJsonDocument MakeConfirm(const RequestResponse<VersionType>& response) {
 
   jobj["From"] = from.toString();
   jobj["Destination"] = dest.toString();
+  if (!appname.isEmpty()) jobj["name"] = appname;
+  if (!apptype.isEmpty()) jobj["type"] = apptype;
+  if (!cached.empty()) {
+    QJsonArray packs;
+    for (const auto& pack : cached) {
+      QJsonObject item;
+      item["Pack"] = pack.packname_;
+      item["Sig"] = pack.sig_hash_;
+      packs.append(item);
+    }
+    jobj["Cached"] = packs;
+  }
   jobj[kConfirmField] = QStringLiteral("Yes");
   jdoc.setObject(jobj);
   return jdoc;
@@ -1,14 +1,24 @@
 #ifndef VERSIONCONTROLMAP_HPP
 #define VERSIONCONTROLMAP_HPP
 
+#include <algorithm>
 #include <atomic>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <functional>
 #include <mutex>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
 #include <queue>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <unordered_map>
+#include <vector>
 
 #include "version.hpp"
 
@@ -24,21 +34,136 @@ class VersionMap {
   using LevelType = typename VersionType::LevelType;
 
   // Lookup should have O(1) in lookup.
-  // Storage should have O(1) in access.
-  // Storage has its own meta-capacity. Calculated by function
-  // "CapcityOfVcm(...)" in "version.hpp".
   using Lookup =
       ::std::unordered_map<VersionType, VerIndex, typename VersionType::hasher>;
-  using Storage = ::std::vector<VersionType>;
+  // (from << 32 | to) -> bytes
+  using Costs = ::std::unordered_map<uint64_t, uint64_t>;
+
+  // The versions in segments of "vcm_capacity"(see "CapcityOfVcm(...)" in
+  // "version.hpp"), each with its own lookup and the costs of the edges
+  // ending in it. The segments are shared by the snapshots, a change copies
+  // the segment it falls in only, so it doesn't grow with the map. O(1) in
+  // access, O(log n) in lookup of the segment.
+  class Storage {
+    struct Segment {
+      ::std::vector<VersionType> vers_;
+      Lookup lp_;
+      // Keyed by the edges whose higher end is in the segment.
+      Costs costs_;
+    };
+    using SegmentPtr = ::std::shared_ptr<const Segment>;
+
+   public:
+    size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    const VersionType& operator[](size_t index) const noexcept {
+      return segs_[index / vcm_capacity]->vers_[index % vcm_capacity];
+    }
+    const VersionType& front() const noexcept { return (*this)[0]; }
+    const VersionType& back() const noexcept { return (*this)[size_ - 1]; }
+
+    // The versions are ascending, so is the first one of the segments.
+    bool find(const VersionType& ver, VerIndex* index) const noexcept {
+      auto iter = ::std::upper_bound(
+          segs_.begin(), segs_.end(), ver,
+          [](const VersionType& v, const SegmentPtr& seg) {
+            return !(seg->vers_.front() <= v);
+          });
+      if (iter == segs_.begin()) return false;
+      --iter;
+      auto found = (*iter)->lp_.find(ver);
+      if (found == (*iter)->lp_.end()) return false;
+      *index = static_cast<VerIndex>((iter - segs_.begin()) * vcm_capacity +
+                                     found->second);
+      return true;
+    }
+
+    void push_back(const VersionType& ver) {
+      if (size_ % vcm_capacity == 0) {
+        auto seg = ::std::make_shared<Segment>();
+        seg->vers_.reserve(vcm_capacity);
+        seg->lp_.reserve(vcm_capacity);
+        segs_.push_back(::std::move(seg));
+      }
+      Segment& seg = mutableSegment(size_);
+      seg.lp_.insert_or_assign(ver, static_cast<VerIndex>(seg.vers_.size()));
+      seg.vers_.push_back(ver);
+      ++size_;
+    }
+
+    // ret: The bytes of the edge, 0 if it's unknown.
+    uint64_t cost(VerIndex from, VerIndex to) const noexcept {
+      const Costs& costs = segs_[::std::max(from, to) / vcm_capacity]->costs_;
+      auto iter = costs.find(costKey(from, to));
+      return iter == costs.end() ? 0 : iter->second;
+    }
+
+    // ret: The bytes set before, 0 if there's none.
+    uint64_t setCost(VerIndex from, VerIndex to, uint64_t bytes) {
+      Costs& costs = mutableSegment(::std::max(from, to)).costs_;
+      uint64_t& stored = costs[costKey(from, to)];
+      return ::std::exchange(stored, bytes);
+    }
+
+   private:
+    // The segment of "index", copied if a published snapshot shares it.
+    Segment& mutableSegment(size_t index) {
+      SegmentPtr& seg = segs_[index / vcm_capacity];
+      if (seg.use_count() > 1) seg = ::std::make_shared<Segment>(*seg);
+      return const_cast<Segment&>(*seg);
+    }
+
+    ::std::vector<SegmentPtr> segs_;
+    size_t size_ = 0;
+  };
+
   using CallbackOnAc = bool(const VersionType&, const VersionType&);
+  // Bytes of the pack of an edge, 0 if it's unknown.
+  using CallbackOnCost = uint64_t(const VersionType&, const VersionType&);
+
+ public:
+  // The packs of an edge are generated in the background after append().
+  enum class EdgeState { Pending, Ready, Failed };
+  // Runs a job of edge generation. Without it the jobs run in append().
+  using Executor = ::std::function<void(::std::function<void()>)>;
 
-  Lookup lp_;
-  Storage stor_;
-  ::std::atomic_bool appending_ = false;
-  mutable ::std::mutex lock_;
+ private:
+  // (lower << 32 | higher) -> state, the edges not in it are ready.
+  using EdgeStates = ::std::unordered_map<uint64_t, EdgeState>;
+
+  // An immutable view of the map. The readers take the published one without
+  // a lock, append() builds the next one aside and publishes it only after
+  // the edges of the new version are ready.
+  struct Snapshot {
+    Storage stor_;
+    uint64_t cost_sum_ = 0;
+    uint64_t cost_count_ = 0;
+    EdgeStates unready_;
+    // How many edges of a version are still pending, the versions settled
+    // are not in it.
+    ::std::map<VerIndex, uint32_t> pending_;
+    // Bumped by every change, the routes found before are stale then.
+    uint64_t generation_ = 0;
+  };
+  using SnapshotPtr = ::std::shared_ptr<const Snapshot>;
+
+  // Accessed by ::std::atomic_load()/atomic_store() only.
+  SnapshotPtr snapshot_;
+
+  // The jobs of edge generation not finished yet.
+  Executor executor_;
+  ::std::mutex jobs_lock_;
+  ::std::condition_variable jobs_cond_;
+  size_t jobs_ = 0;
+  // Serializes the writers, the readers never take it.
+  ::std::mutex lock_;
 
   // Callback called when new node appends.
   ::std::function<CallbackOnAc> callback_on_ac_;
+  // Callback called for the edges of a new node, after they are constructed.
+  ::std::function<CallbackOnCost> callback_on_cost_;
+  // Callback called after the state of an edge is published.
+  ::std::function<void()> callback_on_settle_;
 
   // VersionMap attribute.
   static constexpr uint8_t vcm_max_level = VersionType::vcm_max_level;
@@ -58,179 +183,491 @@ class VersionMap {
  public:
   using EdgeType = ::std::pair<VersionType, VersionType>;
 
+  struct RouteCacheStats {
+    uint64_t hits_;
+    uint64_t misses_;
+    size_t size_;
+  };
+
+  static constexpr size_t kRouteCacheCapacity = 4096;
+
+ private:
+  // The routes found, keyed by (start << 32 | end) and least recently used
+  // first out. A route is taken only under the generation it was found in.
+  class RouteCache {
+    struct Route {
+      uint64_t key_;
+      uint64_t generation_;
+      ::std::vector<EdgeType> edges_;
+    };
+
+   public:
+    explicit RouteCache(size_t capacity) : capacity_(capacity) {}
+
+    bool get(uint64_t key, uint64_t generation,
+             ::std::vector<EdgeType>* edges) {
+      ::std::lock_guard locker(lock_);
+      auto iter = index_.find(key);
+      if (iter == index_.end() || iter->second->generation_ != generation) {
+        ++misses_;
+        return false;
+      }
+      routes_.splice(routes_.begin(), routes_, iter->second);
+      *edges = iter->second->edges_;
+      ++hits_;
+      return true;
+    }
+
+    void put(uint64_t key, uint64_t generation,
+             const ::std::vector<EdgeType>& edges) {
+      ::std::lock_guard locker(lock_);
+      if (capacity_ == 0) return;
+      auto iter = index_.find(key);
+      if (iter != index_.end()) {
+        // Found again by another thread, or found under a newer generation.
+        if (iter->second->generation_ > generation) return;
+        routes_.erase(iter->second);
+        index_.erase(iter);
+      }
+      routes_.push_front(Route{key, generation, edges});
+      index_.emplace(key, routes_.begin());
+      while (routes_.size() > capacity_) {
+        index_.erase(routes_.back().key_);
+        routes_.pop_back();
+      }
+    }
+
+    void resize(size_t capacity) {
+      ::std::lock_guard locker(lock_);
+      capacity_ = capacity;
+      while (routes_.size() > capacity_) {
+        index_.erase(routes_.back().key_);
+        routes_.pop_back();
+      }
+    }
+
+    RouteCacheStats stats() const {
+      ::std::lock_guard locker(lock_);
+      return {hits_, misses_, routes_.size()};
+    }
+
+   private:
+    mutable ::std::mutex lock_;
+    size_t capacity_;
+    ::std::list<Route> routes_;
+    ::std::unordered_map<uint64_t, typename ::std::list<Route>::iterator>
+        index_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+  };
+
+  mutable RouteCache route_cache_{kRouteCacheCapacity};
+
  public:
   VersionMap()
-      : lp_(VersionType::vcm_capacity, typename VersionType::hasher()),
-        stor_(),
+      : snapshot_(::std::make_shared<const Snapshot>()),
         lock_(),
         callback_on_ac_() {}
 
+  ~VersionMap() { wait(); }
+
+  VersionMap(const VersionMap&) = delete;
+  VersionMap& operator=(const VersionMap&) = delete;
+
+  // The jobs may run on any thread, and several at once. Set it before the
+  // first append.
+  void setExecutor(Executor executor) noexcept {
+    executor_ = ::std::move(executor);
+  }
+
+  // Called on the thread of a job once its edge is Ready or Failed, before
+  // wait() returns.
+  void setSettleCallback(::std::function<void()> f) noexcept {
+    callback_on_settle_ = ::std::move(f);
+  }
+
+  // Wait for all the edges queued to be generated.
+  void wait() {
+    ::std::unique_lock locker(jobs_lock_);
+    jobs_cond_.wait(locker, [this] { return jobs_ == 0; });
+  }
+
+  // "f" may be a function or any callable of the same signature, e.g. a
+  // lambda bound to the owner of the map.
   template <typename Function>
   void setCallback(Function&& f) noexcept {
-    static_assert(::std::is_same_v<Function, CallbackOnAc>,
+    static_assert(::std::is_invocable_r_v<bool, Function, const VersionType&,
+                                          const VersionType&>,
                   "Type of function doesn't match the callback.");
     callback_on_ac_ = std::forward<Function>(f);
   }
 
+  // The edges are weighted by the size of their packs. Without it every edge
+  // costs the same, and search() returns the route of the fewest hops.
+  template <typename Function>
+  void setCostCallback(Function&& f) noexcept {
+    static_assert(::std::is_invocable_r_v<uint64_t, Function,
+                                          const VersionType&,
+                                          const VersionType&>,
+                  "Type of function doesn't match the callback.");
+    callback_on_cost_ = std::forward<Function>(f);
+  }
+
+  // The version is registered at once. Its edges are generated by jobs on the
+  // executor, one job for each level, and become usable one by one. On
+  // initial construction the edges are taken as ready.
   bool append(const VersionType& glver, bool onInitConstruct = false) {
-    // Safe check.
-    if (!stor_.empty() && glver <= stor_.back()) return false;
+    ::std::vector<VerIndex> prevs;
+    VerIndex index;
+    {
+      ::std::lock_guard locker(lock_);
+      SnapshotPtr current = snapshot();
+      // Safe check.
+      if (!current->stor_.empty() && glver <= current->stor_.back())
+        return false;
+
+      // The distances of the levels must fit in VerDist.
+      if (current->stor_.size() >=
+          static_cast<size_t>(::std::numeric_limits<VerDist>::max()))
+        return false;
+
+      // Build a index.
+      auto next = ::std::make_shared<Snapshot>(*current);
+      index = next->stor_.size();
+      next->stor_.push_back(glver);
+
+      prevs = NodeConstruct(index);
+      if (onInitConstruct) {
+        // The packs built before are measured.
+        for (VerIndex prev : prevs) CostConstruct(*next, prev, index);
+        prevs.clear();
+      }
+      for (VerIndex prev : prevs)
+        next->unready_[edgeKey(prev, index)] = EdgeState::Pending;
+      if (!prevs.empty())
+        next->pending_[index] = static_cast<uint32_t>(prevs.size());
+      ++next->generation_;
+      ::std::atomic_store(&snapshot_, SnapshotPtr(::std::move(next)));
+    }
+
+    for (VerIndex prev : prevs) schedule(prev, index);
+    return true;
+  }
 
-    // Capacity check.
-    if (stor_.size() == vcm_capacity) return false;
+  // An edge as it's saved(see "vermap_index.h"), by the indexes of its ends.
+  struct EdgeInfo {
+    VerIndex lower_ = 0;
+    VerIndex higher_ = 0;
+    EdgeState state_ = EdgeState::Ready;
+    // Bytes of the packs, 0 if it's unknown.
+    uint64_t update_bytes_ = 0;
+    uint64_t rollback_bytes_ = 0;
+  };
 
-    // Build a index.
+  // The versions in ascending order, their indexes are the ones of the edges.
+  ::std::vector<VersionType> versions() const {
+    SnapshotPtr snap = snapshot();
+    ::std::vector<VersionType> vers;
+    vers.reserve(snap->stor_.size());
+    for (size_t i = 0; i < snap->stor_.size(); ++i)
+      vers.push_back(snap->stor_[i]);
+    return vers;
+  }
+
+  ::std::vector<EdgeInfo> edges() const {
+    SnapshotPtr snap = snapshot();
+    ::std::vector<EdgeInfo> infos;
+    for (VerIndex index = 1; index < snap->stor_.size(); ++index) {
+      for (VerIndex prev : NodeConstruct(index)) {
+        auto iter = snap->unready_.find(edgeKey(prev, index));
+        infos.push_back(EdgeInfo{
+            prev, index,
+            iter == snap->unready_.end() ? EdgeState::Ready : iter->second,
+            snap->stor_.cost(prev, index), snap->stor_.cost(index, prev)});
+      }
+    }
+    return infos;
+  }
+
+  // Rebuild an empty map from what versions() and edges() returned. The
+  // callbacks are not called for the Ready edges, their bytes are taken as
+  // they are. The others, and the edges not given, are generated again as
+  // append() does.
+  bool restore(const ::std::vector<VersionType>& vers,
+               const ::std::vector<EdgeInfo>& infos) {
+    ::std::vector<::std::pair<VerIndex, VerIndex>> jobs;
     {
       ::std::lock_guard locker(lock_);
-      appending_.store(true);
-      VerIndex index = stor_.size();
-      lp_.insert_or_assign(glver, index);
-
-      // Append to stor, and block the newest() at the same time.
-      stor_.push_back(glver);
+      SnapshotPtr current = snapshot();
+      if (!current->stor_.empty() ||
+          vers.size() >=
+              static_cast<size_t>(::std::numeric_limits<VerDist>::max()))
+        return false;
+
+      auto next = ::std::make_shared<Snapshot>(*current);
+      for (size_t i = 0; i < vers.size(); ++i) {
+        if (i > 0 && vers[i] <= vers[i - 1]) return false;
+        next->stor_.push_back(vers[i]);
+      }
 
-      // Call the callback if it's not on initial construction.
-      if (!onInitConstruct) NodeConstruct(index);
-      appending_.store(false);
+      ::std::unordered_map<uint64_t, const EdgeInfo*> given;
+      for (const auto& info : infos)
+        if (info.state_ == EdgeState::Ready)
+          given[edgeKey(info.lower_, info.higher_)] = &info;
+      for (VerIndex index = 1; index < vers.size(); ++index) {
+        for (VerIndex prev : NodeConstruct(index)) {
+          auto iter = given.find(edgeKey(prev, index));
+          if (iter == given.end()) {
+            jobs.emplace_back(prev, index);
+            next->unready_[edgeKey(prev, index)] = EdgeState::Pending;
+            ++next->pending_[index];
+            continue;
+          }
+          recordCost(*next, prev, index, iter->second->update_bytes_);
+          recordCost(*next, index, prev, iter->second->rollback_bytes_);
+        }
+      }
+      ++next->generation_;
+      ::std::atomic_store(&snapshot_, SnapshotPtr(::std::move(next)));
     }
+
+    for (auto [prev, index] : jobs) schedule(prev, index);
     return true;
   }
 
-  // Thread-safe method for search the shortest path from "start" to "end".
+  // The state of the edge between "lhs" and "rhs", Failed if there's no such
+  // edge.
+  EdgeState edgeState(const VersionType& lhs, const VersionType& rhs) const
+      noexcept {
+    SnapshotPtr snap = snapshot();
+    VerIndex l, r;
+    if (!snap->stor_.find(lhs, &l) || !snap->stor_.find(rhs, &r))
+      return EdgeState::Failed;
+    VerIndex lower = ::std::min(l, r);
+    VerIndex higher = ::std::max(l, r);
+    auto prevs = NodeConstruct(higher);
+    if (::std::find(prevs.begin(), prevs.end(), lower) == prevs.end())
+      return EdgeState::Failed;
+    auto iter = snap->unready_.find(edgeKey(lower, higher));
+    return iter == snap->unready_.end() ? EdgeState::Ready : iter->second;
+  }
+
+  // Thread-safe method for search the cheapest route from "start" to "end":
+  // the fewest bytes to download, then the fewest hops. An edge whose cost is
+  // unknown is taken as the mean of the known ones. Only the ready edges are
+  // taken. The result is the same for the same map, "stg" doesn't change the
+  // route. The routes are kept in an LRU cache until the map changes. It runs
+  // on one snapshot without a lock.
   // Copy-elision is guaranteed in c++17.
   template <SearchStrategy stg = SearchStrategy::vUpdate>
   ::std::vector<EdgeType> search(const VersionType& start,
                                  const VersionType& end) const noexcept {
     std::vector<EdgeType> route_path;
-    if (lp_.count(start) == 0 || lp_.count(end) == 0) return route_path;
+    SnapshotPtr snap = snapshot();
+    VerIndex startIndex, goalIndex;
+    if (!snap->stor_.find(start, &startIndex) ||
+        !snap->stor_.find(end, &goalIndex))
+      return route_path;
     if (start == end) return route_path;
 
-    VerIndex startIndex = lp_.at(start);
-    VerIndex goalIndex = lp_.at(end);
-
-    std::vector<VerIndex> vs;
-    CalculateUnit<stg> unit(stor_.size() + 10,  // buffer size
-                            this);
-    unit.dfs(vs, route_path, startIndex, 1, goalIndex);
+    uint64_t key = costKey(startIndex, goalIndex);
+    uint64_t generation = snap->generation_;
+    if (route_cache_.get(key, generation, &route_path)) return route_path;
 
+    route_path = searchRoute(*snap, startIndex, goalIndex);
+    route_cache_.put(key, generation, route_path);
     return route_path;
   }
 
-  VersionType newest() const noexcept {
-    if (appending_) {
-      // Block current thread if the delta pack hasn't generated yet.
-      ::std::lock_guard locker(lock_);
-      return stor_.back();
-    } else
-      return stor_.back();
+  RouteCacheStats routeCacheStats() const noexcept {
+    return route_cache_.stats();
   }
 
-  VersionType oldest() const noexcept { return stor_.front(); }
+  // 0 disables the cache.
+  void setRouteCacheCapacity(size_t capacity) noexcept {
+    route_cache_.resize(capacity);
+  }
 
- private:
-  template <SearchStrategy stg = SearchStrategy::vUpdate>
-  struct CalculateUnit {
-    VerIndex curMinHops_;
-    bool* vis_;
-    const VersionMap<VersionType>* parent_;
-
-    CalculateUnit(VerIndex min_hop, const VersionMap<VersionType>* p)
-        : curMinHops_(min_hop), vis_(new bool[min_hop]), parent_(p) {
-      memset(vis_, 0, min_hop);
+  // The newest version the others can reach: none of the edges up to it is
+  // pending, and one of its own is ready at least. nullopt if the map is
+  // empty.
+  ::std::optional<VersionType> newest() const noexcept {
+    SnapshotPtr snap = snapshot();
+    if (snap->stor_.empty()) return ::std::nullopt;
+    VerIndex settled = snap->pending_.empty()
+                           ? static_cast<VerIndex>(snap->stor_.size())
+                           : snap->pending_.begin()->first;
+    for (VerIndex index = settled; index-- > 1;) {
+      for (VerIndex prev : NodeConstruct(index))
+        if (snap->unready_.count(edgeKey(prev, index)) == 0)
+          return snap->stor_[index];
     }
+    return snap->stor_.front();
+  }
 
-    ~CalculateUnit() { delete[] vis_; }
-
-    inline void dfs(std::vector<VerIndex>& indexs, std::vector<EdgeType>& edges,
-                    VerIndex i, VerDist d, VerIndex goal) {
-      if (i == goal) {
-        VerIndex hops = indexs.size(), k;
-        if (hops == 0) return;
-        if (hops < curMinHops_) {
-          curMinHops_ = hops;
-          edges.clear();
-          for (k = 0; k + 1 < hops; ++k) {
-            edges.emplace_back(parent_->stor_[indexs[k]],
-                               parent_->stor_[indexs[k + 1]]);
-          }
-          if (k == hops - 1) {
-            edges.emplace_back(parent_->stor_[indexs[k]], parent_->stor_[goal]);
-          }
-        }
-        return;
-      }
-
-      // prune
-      if (curMinHops_ < static_cast<VerIndex>(indexs.size())) return;
+  ::std::optional<VersionType> oldest() const noexcept {
+    SnapshotPtr snap = snapshot();
+    if (snap->stor_.empty()) return ::std::nullopt;
+    return snap->stor_.front();
+  }
 
-      // max level
-      LevelType level =
-          parent_->levelOfDistance(parent_->distanceOfVerIndex(i, goal));
+ private:
+  SnapshotPtr snapshot() const noexcept {
+    return ::std::atomic_load(&snapshot_);
+  }
 
-      for (LevelType l = level; l >= 0; l--) {
-        // the index is in level
-        if (parent_->checkHit(l, i)) {
-          d = parent_->distanceOfLevel(l);
-          break;
-        }
+  // Generate the packs of the edge from "prev" to "index" on the executor,
+  // then publish its state.
+  void schedule(VerIndex prev, VerIndex index) {
+    {
+      ::std::lock_guard locker(jobs_lock_);
+      ++jobs_;
+    }
+    SnapshotPtr snap = snapshot();
+    VersionType from = snap->stor_[prev];
+    VersionType to = snap->stor_[index];
+    auto job = [this, prev, index, from, to] {
+      bool succ = false;
+      try {
+        succ = callback_on_ac_ && callback_on_ac_(from, to);
+      } catch (...) {
+        succ = false;
       }
+      settle(prev, index, succ);
+      if (callback_on_settle_) callback_on_settle_();
+      // Notified under the lock, the map may be gone once wait() returns.
+      ::std::lock_guard locker(jobs_lock_);
+      --jobs_;
+      jobs_cond_.notify_all();
+    };
+    if (executor_)
+      executor_(::std::move(job));
+    else
+      job();
+  }
 
-      if constexpr (stg == SearchStrategy::vUpdate) {
-        // ignored...
-        double p = (double)rand() / RAND_MAX;
-        if (p < 0.8) d = -d;
-        // d = -d;
-      }
-      // rollback/update
-      if (parent_->checkVerIndex(i - d) && !vis_[i - d]) {
-        indexs.emplace_back(i);
-        vis_[i] = true;
-        dfs(indexs, edges, i - d, d, goal);
-        vis_[i] = false;
-        indexs.pop_back();
-      }
-      // update/rollback
-      if (parent_->checkVerIndex(i + d) && !vis_[i + d]) {
-        indexs.emplace_back(i);
-        vis_[i] = true;
-        dfs(indexs, edges, i + d, d, goal);
-        vis_[i] = false;
-        indexs.pop_back();
-      }
+  void settle(VerIndex prev, VerIndex index, bool succ) {
+    ::std::lock_guard locker(lock_);
+    auto next = ::std::make_shared<Snapshot>(*snapshot());
+    if (succ) {
+      next->unready_.erase(edgeKey(prev, index));
+      CostConstruct(*next, prev, index);
+    } else {
+      next->unready_[edgeKey(prev, index)] = EdgeState::Failed;
     }
-  };
-
- private:
-  inline constexpr bool checkVerIndex(VerIndex index) const noexcept {
-    return index >= 0 && index < static_cast<VerIndex>(stor_.size());
+    if (--next->pending_[index] == 0) next->pending_.erase(index);
+    ++next->generation_;
+    ::std::atomic_store(&snapshot_, SnapshotPtr(::std::move(next)));
   }
 
-  // Select an appropriate level from the current index difference
-  inline constexpr LevelType levelOfDistance(VerDist dist) const noexcept {
-    LevelType level = 0;
-    if (dist >= 0 && dist < vcm_basic_distance) return level;
-    VerIndex l = vcm_basic_distance;
-    while (dist >= l) {
-      level++;
-      l <<= 1;
+  ::std::vector<EdgeType> searchRoute(const Snapshot& snap, VerIndex startIndex,
+                                      VerIndex goalIndex,
+                                      bool whole = false) const {
+    std::vector<EdgeType> route_path;
+    // Dijkstra over the edges of the skip list, a node has 2 edges at most on
+    // each level. Ties are broken by hops and then by index.
+    // The versions taken are the ones within a segment of either end, and the
+    // first ones of the segments, which the levels above "vcm_max_level" link.
+    // A map of one or two segments is searched as a whole. The edges linking
+    // the segments settle last, while one of them met isn't ready, or if no
+    // route is found, the map is searched again as a whole("whole").
+    using Label = ::std::tuple<uint64_t, VerIndex, VerIndex>;
+    struct Node {
+      uint64_t cost_ = ::std::numeric_limits<uint64_t>::max();
+      VerIndex hops_ = 0;
+      VerIndex from_ = 0;
+    };
+    VerIndex size = static_cast<VerIndex>(snap.stor_.size());
+    auto near = [startIndex, goalIndex, whole](VerIndex j) {
+      return whole || j % vcm_capacity == 0 ||
+             static_cast<uint64_t>(distanceOfVerIndex(j, startIndex)) <=
+                 vcm_capacity ||
+             static_cast<uint64_t>(distanceOfVerIndex(j, goalIndex)) <=
+                 vcm_capacity;
+    };
+    // Indexed directly while it's small, the nodes reached only otherwise.
+    bool dense = size <= 4 * vcm_capacity;
+    ::std::vector<Node> dense_nodes(dense ? size : 0);
+    ::std::unordered_map<VerIndex, Node> sparse_nodes;
+    auto node = [&](VerIndex j) -> Node& {
+      return dense ? dense_nodes[j] : sparse_nodes[j];
+    };
+    ::std::priority_queue<Label, ::std::vector<Label>, ::std::greater<Label>>
+        queue;
+    node(startIndex) = Node{0, 0, startIndex};
+    queue.emplace(0, 0, startIndex);
+    uint64_t unknown = unknownCost(snap);
+    LevelType top = topLevel(size);
+    bool blocked = false;
+
+    while (!queue.empty()) {
+      auto [c, h, i] = queue.top();
+      queue.pop();
+      const Node& at = node(i);
+      if (c != at.cost_ || h != at.hops_) continue;
+      if (i == goalIndex) break;
+      auto relax = [&, c = c, h = h, i = i](VerIndex j) {
+        if (!near(j)) return;
+        if (!snap.unready_.empty() &&
+            snap.unready_.count(edgeKey(::std::min(i, j), ::std::max(i, j)))) {
+          if (static_cast<uint64_t>(distanceOfVerIndex(i, j)) >= vcm_capacity)
+            blocked = true;
+          return;
+        }
+        uint64_t next = c + edgeCost(snap, i, j, unknown);
+        Node& to = node(j);
+        if (next < to.cost_ || (next == to.cost_ && h + 1 < to.hops_)) {
+          to = Node{next, h + 1, i};
+          queue.emplace(next, h + 1, j);
+        }
+      };
+      for (LevelType level = 0; level <= top; ++level) {
+        VerIndex d = static_cast<VerIndex>(distanceOfLevel(level));
+        // rollback: i is on the level, "i - d" links to it.
+        if (i >= d && checkHit(level, i)) relax(i - d);
+        // update: "i + d" is on the level.
+        if (i + d < size && checkHit(level, i + d)) relax(i + d);
+      }
     }
-    return level;
+    if (!whole && (blocked || node(goalIndex).cost_ == Node().cost_))
+      return searchRoute(snap, startIndex, goalIndex, true);
+    if (node(goalIndex).cost_ == Node().cost_) return route_path;
+
+    for (VerIndex i = goalIndex; i != startIndex; i = node(i).from_)
+      route_path.emplace_back(snap.stor_[node(i).from_], snap.stor_[i]);
+    ::std::reverse(route_path.begin(), route_path.end());
+    return route_path;
   }
 
   // Get the distance of two index.
-  inline constexpr VerDist distanceOfVerIndex(VerIndex i, VerIndex j) const
-      noexcept {
+  static constexpr VerDist distanceOfVerIndex(VerIndex i, VerIndex j) noexcept {
     return i < j ? j - i : i - j;
   }
 
-  // Get the distance value on a certain level.
+  // Get the distance value on a certain level. Above "vcm_max_level" the
+  // levels link the segments, the distance goes on doubling, so a route is
+  // O(log n) however many segments there are.
   inline constexpr VerDist distanceOfLevel(LevelType level) const noexcept {
     if (level == 0) return 1;
 
-    VerDist distance = vcm_basic_distance;
+    uint64_t distance = vcm_basic_distance;
     LevelType max = level < vcm_max_level ? level : vcm_max_level;
     for (LevelType i = 1; i < max; ++i) distance *= vcm_factor;
-    return distance;
+    for (LevelType i = vcm_max_level; i < level; ++i) distance *= vcm_factor;
+    return static_cast<VerDist>(distance);
+  }
+
+  // The highest level an edge can be on in a map of "size" versions. The
+  // levels above "vcm_max_level" are built once the first segment is full,
+  // the edges built before are kept.
+  inline constexpr LevelType topLevel(uint64_t size) const noexcept {
+    LevelType level = vcm_max_level;
+    uint64_t distance = vcm_capacity;
+    while (size > 0 && distance * vcm_factor <= size - 1) {
+      distance *= vcm_factor;
+      ++level;
+    }
+    return level;
   }
 
   // Check whether the node is on a certain level.
@@ -239,17 +676,58 @@ class VersionMap {
     return index % distanceOfLevel(level) == 0;
   }
 
-  void NodeConstruct(VerIndex index) {
-    //
-    for (LevelType level = 0; level <= vcm_max_level; ++level) {
+  // The lower ends of the edges linking "index" to the versions before, one
+  // on each level it's on.
+  ::std::vector<VerIndex> NodeConstruct(VerIndex index) const {
+    ::std::vector<VerIndex> prevs;
+    for (LevelType level = 0, top = topLevel(uint64_t(index) + 1); level <= top;
+         ++level) {
       if (!checkHit(level, index)) continue;
 
       VerDist distance = distanceOfLevel(level);
+      if (index < static_cast<VerIndex>(distance)) continue;
       VerIndex prev = index - distance;
-      if (prev < 0) continue;
-
-      callback_on_ac_(stor_[prev], stor_[index]);
+      if (::std::find(prevs.begin(), prevs.end(), prev) == prevs.end())
+        prevs.push_back(prev);
     }
+    return prevs;
+  }
+
+  static uint64_t costKey(VerIndex from, VerIndex to) noexcept {
+    return static_cast<uint64_t>(from) << 32 | to;
+  }
+
+  static uint64_t edgeKey(VerIndex lower, VerIndex higher) noexcept {
+    return costKey(lower, higher);
+  }
+
+  // Measure the packs of the edge between "prev" and "index", in both
+  // directions.
+  void CostConstruct(Snapshot& snap, VerIndex prev, VerIndex index) {
+    if (!callback_on_cost_) return;
+    ::std::pair<VerIndex, VerIndex> edges[] = {{prev, index}, {index, prev}};
+    for (auto [from, to] : edges)
+      recordCost(snap, from, to,
+                 callback_on_cost_(snap.stor_[from], snap.stor_[to]));
+  }
+
+  static void recordCost(Snapshot& snap, VerIndex from, VerIndex to,
+                         uint64_t bytes) {
+    if (bytes == 0) return;
+    uint64_t before = snap.stor_.setCost(from, to, bytes);
+    if (before == 0) ++snap.cost_count_;
+    snap.cost_sum_ += bytes - before;
+  }
+
+  static uint64_t unknownCost(const Snapshot& snap) noexcept {
+    if (snap.cost_count_ == 0) return 1;
+    return ::std::max<uint64_t>(1, snap.cost_sum_ / snap.cost_count_);
+  }
+
+  static uint64_t edgeCost(const Snapshot& snap, VerIndex from, VerIndex to,
+                           uint64_t unknown) noexcept {
+    uint64_t bytes = snap.stor_.cost(from, to);
+    return bytes == 0 ? unknown : bytes;
   }
 };
 
@@ -0,0 +1,169 @@
+#include "vermap_index.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <QFile>
+#include <QSaveFile>
+#include <algorithm>
+
+namespace otalib {
+namespace {
+
+constexpr char kMagic[8] = {'O', 'T', 'A', 'V', 'M', 'I', 'D', 'X'};
+
+bool statOf(const QString& path, struct stat* st) {
+  return ::stat(path.toStdString().c_str(), st) == 0;
+}
+
+int64_t mtimeOf(const struct stat& st) {
+  return st.st_mtim.tv_sec * 1'000'000'000LL + st.st_mtim.tv_nsec;
+}
+
+// zlib takes the length as uInt, a large body is summed piece by piece.
+uint32_t crcOf(uint32_t crc, const void* data, size_t size) {
+  auto bytes = static_cast<const Bytef*>(data);
+  while (size > 0) {
+    uInt piece = static_cast<uInt>(::std::min<size_t>(size, 1u << 30));
+    crc = static_cast<uint32_t>(::crc32(crc, bytes, piece));
+    bytes += piece;
+    size -= piece;
+  }
+  return crc;
+}
+
+}  // namespace
+
+bool VerMapIndex::open(const QString& path) {
+  close();
+  int fd = ::open(path.toStdString().c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat st;
+  if (::fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(VerMapIndexHeader)) {
+    ::close(fd);
+    return false;
+  }
+  length_ = static_cast<size_t>(st.st_size);
+  map_ = ::mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map_ == MAP_FAILED) {
+    map_ = nullptr;
+    length_ = 0;
+    return false;
+  }
+  auto fail = [this] {
+    close();
+    return false;
+  };
+
+  auto header = static_cast<const VerMapIndexHeader*>(map_);
+  if (::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion ||
+      header->version_record_size != sizeof(VerMapVersionRecord) ||
+      header->edge_record_size != sizeof(VerMapEdgeRecord))
+    return fail();
+  uint64_t room = length_ - sizeof(VerMapIndexHeader);
+  if (header->crc != crcOf(0, header + 1, room)) return fail();
+  if (header->version_count > room / sizeof(VerMapVersionRecord))
+    return fail();
+  room -= header->version_count * sizeof(VerMapVersionRecord);
+  if (header->edge_count > room / sizeof(VerMapEdgeRecord)) return fail();
+  room -= header->edge_count * sizeof(VerMapEdgeRecord);
+  if (header->names_size != room) return fail();
+
+  auto versions = reinterpret_cast<const VerMapVersionRecord*>(header + 1);
+  auto edges = reinterpret_cast<const VerMapEdgeRecord*>(
+      versions + header->version_count);
+  for (uint64_t i = 0; i < header->version_count; ++i) {
+    if (versions[i].name_offset > room ||
+        versions[i].name_size > room - versions[i].name_offset)
+      return fail();
+  }
+  for (uint64_t i = 0; i < header->edge_count; ++i) {
+    if (edges[i].lower >= edges[i].higher ||
+        edges[i].higher >= header->version_count)
+      return fail();
+  }
+  header_ = header;
+  versions_ = versions;
+  edges_ = edges;
+  names_ = reinterpret_cast<const char*>(edges + header->edge_count);
+  return true;
+}
+
+void VerMapIndex::close() {
+  if (map_) ::munmap(map_, length_);
+  map_ = nullptr;
+  length_ = 0;
+  header_ = nullptr;
+  versions_ = nullptr;
+  edges_ = nullptr;
+  names_ = nullptr;
+}
+
+bool VerMapIndex::Write(const QString& path,
+                        const ::std::vector<Version>& versions,
+                        const ::std::vector<VerMapEdgeRecord>& edges,
+                        const QString& source) {
+  VerMapIndexHeader header;
+  ::memset(&header, 0, sizeof(header));
+  ::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.version_record_size = sizeof(VerMapVersionRecord);
+  header.edge_record_size = sizeof(VerMapEdgeRecord);
+  header.version_count = versions.size();
+  header.edge_count = edges.size();
+  struct stat st;
+  if (!source.isEmpty() && statOf(source, &st)) {
+    header.source_size = st.st_size;
+    header.source_mtime = mtimeOf(st);
+  }
+
+  ::std::vector<VerMapVersionRecord> records(versions.size());
+  ::std::string names;
+  for (size_t i = 0; i < versions.size(); ++i) {
+    VerMapVersionRecord& record = records[i];
+    ::memset(&record, 0, sizeof(record));
+    record.name_offset = names.size();
+    record.name_size = static_cast<uint32_t>(versions[i].name_.size());
+    ::memcpy(record.hash, versions[i].hash_, sizeof(record.hash));
+    names += versions[i].name_;
+  }
+  header.names_size = names.size();
+
+  size_t records_size = records.size() * sizeof(VerMapVersionRecord);
+  size_t edges_size = edges.size() * sizeof(VerMapEdgeRecord);
+  header.crc = crcOf(0, records.data(), records_size);
+  header.crc = crcOf(header.crc, edges.data(), edges_size);
+  header.crc = crcOf(header.crc, names.data(), names.size());
+
+  QSaveFile file(path);
+  if (!file.open(QFile::WriteOnly)) return false;
+  if (file.write(reinterpret_cast<const char*>(&header), sizeof(header)) !=
+          sizeof(header) ||
+      file.write(reinterpret_cast<const char*>(records.data()),
+                 static_cast<qint64>(records_size)) !=
+          static_cast<qint64>(records_size) ||
+      file.write(reinterpret_cast<const char*>(edges.data()),
+                 static_cast<qint64>(edges_size)) !=
+          static_cast<qint64>(edges_size) ||
+      file.write(names.data(), static_cast<qint64>(names.size())) !=
+          static_cast<qint64>(names.size()))
+    return false;
+  return file.commit();
+}
+
+bool VerMapIndex::IsFresh(const VerMapIndex& index, const QString& source) {
+  struct stat st;
+  if (!index.isOpen() || !statOf(source, &st)) return false;
+  const VerMapIndexHeader& header = index.header();
+  return header.source_size == st.st_size &&
+         header.source_mtime == mtimeOf(st);
+}
+
+}  // namespace otalib
@@ -0,0 +1,111 @@
+#ifndef VERMAP_INDEX_H
+#define VERMAP_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <QString>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace otalib {
+
+// Binary form of a VersionMap, mapped at startup so the map is rebuilt without
+// a parse and without a look at the packs. The integers are in the byte order
+// of the host, the layout is:
+//      header | versions[version_count] | edges[edge_count] | names
+// "crc" is the crc32 of everything after the header. An edge is kept by the
+// indexes of its ends, "state" is VersionMap::EdgeState. The sizes and hashes
+// are zeros if they're unknown.
+// "source_*" is the stat of the text list of versions(verMap.idb) when the
+// index was written, an index older than the list is not taken.
+struct VerMapIndexHeader {
+  char magic[8];  // "OTAVMIDX"
+  uint32_t version;
+  uint32_t version_record_size;
+  uint32_t edge_record_size;
+  uint32_t crc;
+  uint64_t version_count;
+  uint64_t edge_count;
+  uint64_t names_size;
+  int64_t source_size;
+  int64_t source_mtime;  // ns
+};
+
+struct VerMapVersionRecord {
+  uint64_t name_offset;
+  uint32_t name_size;
+  uint32_t reserved;
+  uint8_t hash[32];  // The merkle root of the complete pack.
+};
+
+struct VerMapEdgeRecord {
+  uint32_t lower;
+  uint32_t higher;
+  uint32_t state;
+  uint32_t reserved;
+  uint64_t update_size;
+  uint64_t rollback_size;
+  uint8_t update_hash[32];  // sha256 of the packs.
+  uint8_t rollback_hash[32];
+};
+
+static_assert(sizeof(VerMapIndexHeader) == 64, "Header must be packed.");
+static_assert(sizeof(VerMapVersionRecord) == 48, "Record must be packed.");
+static_assert(sizeof(VerMapEdgeRecord) == 96, "Record must be packed.");
+
+class VerMapIndex {
+ public:
+  static constexpr uint32_t kVersion = 1;
+
+  struct Version {
+    ::std::string name_;
+    uint8_t hash_[32]{0};
+  };
+
+  VerMapIndex() = default;
+  ~VerMapIndex() { close(); }
+  VerMapIndex(const VerMapIndex&) = delete;
+  VerMapIndex& operator=(const VerMapIndex&) = delete;
+
+  // desc: Map the index. A file of another version, whose records are out of
+  // its bounds or whose crc doesn't match, fails.
+  bool open(const QString& path);
+  void close();
+  bool isOpen() const { return header_ != nullptr; }
+
+  const VerMapIndexHeader& header() const { return *header_; }
+  size_t versionCount() const { return header_ ? header_->version_count : 0; }
+  size_t edgeCount() const { return header_ ? header_->edge_count : 0; }
+  const VerMapVersionRecord& version(size_t index) const {
+    return versions_[index];
+  }
+  const VerMapEdgeRecord& edge(size_t index) const { return edges_[index]; }
+  ::std::string_view name(size_t index) const {
+    return {names_ + versions_[index].name_offset,
+            versions_[index].name_size};
+  }
+
+  // param:
+  //      source: The text list of versions, its stat is recorded. Empty for
+  //      none.
+  static bool Write(const QString& path, const ::std::vector<Version>& versions,
+                    const ::std::vector<VerMapEdgeRecord>& edges,
+                    const QString& source = QString());
+
+  // desc: Whether "index" was written after the last change of "source".
+  static bool IsFresh(const VerMapIndex& index, const QString& source);
+
+ private:
+  void* map_ = nullptr;
+  size_t length_ = 0;
+  const VerMapIndexHeader* header_ = nullptr;
+  const VerMapVersionRecord* versions_ = nullptr;
+  const VerMapEdgeRecord* edges_ = nullptr;
+  const char* names_ = nullptr;
+};
+
+}  // namespace otalib
+
+#endif  // VERMAP_INDEX_H
@@ -3,6 +3,8 @@
 
 #include <QString>
 #include <filesystem>
+#include <list>
+#include <mutex>
 
 #include "ThreadPool.h"
 using namespace otaserver::net;
@@ -12,56 +14,86 @@ namespace otaserver {
 
 constexpr static const size_t kDelayTime = 2000;
 
+// Polls the directories watched, all of them from one thread of the pool.
 class DirectoryWatcher {
  public:
   using DirectoryChangedCb = std::function<void(const QString& verDir)>;
   enum DirAction { Init, Add };
 
   DirectoryWatcher() {}
-  explicit DirectoryWatcher(const QString& dir) : dir_(dir) {}
 
-  void startWatch(const QString& dir = "") {
-    if (dir_.isEmpty()) dir_ = dir;
-
-    ThreadPool<>::instance().add(std::bind(&DirectoryWatcher::listen, this));
+  // desc: Watch "dir" from the next round, "cb" is called with the name of
+  // each directory added into it. The directories already in it are not
+  // reported.
+  void watch(const QString& dir, const DirectoryChangedCb& cb) {
+    std::lock_guard locker(lock_);
+    watched_.push_back(Watched{dir, cb, true, {}});
   }
 
-  void setDirChangedCb(const DirectoryChangedCb& cb) {
-    directoryChangedCb_ = std::move(cb);
+  void startWatch() {
+    if (started_) return;
+    started_ = true;
+    ThreadPool<>::instance().add(std::bind(&DirectoryWatcher::listen, this));
   }
 
  private:
+  struct Watched {
+    QString dir_;
+    DirectoryChangedCb directoryChangedCb_;
+    bool init_;
+    std::unordered_map<std::string, DirAction> dirMp_;
+  };
+
   void listen() {
     while (true) {
-      fs::directory_iterator dir(dir_.toStdString());
-      for (auto& it : dir) {
-        if (!it.is_directory()) continue;
-        // add/remove directory
-        std::string versionDir = it.path().filename();
-        // add directory
-
-        if (init_) {
-          dirMp_[versionDir] = Init;
-        } else {
-          auto x = dirMp_.find(versionDir);
-          if (x == dirMp_.end()) {
-            if (directoryChangedCb_)
-              directoryChangedCb_(QString::fromStdString(versionDir));
-            dirMp_[versionDir] = Add;
-          }
+      // The list only grows, its nodes stay put while the lock is released.
+      std::list<Watched>::iterator iter;
+      {
+        std::lock_guard locker(lock_);
+        iter = watched_.begin();
+      }
+      while (true) {
+        Watched* w;
+        {
+          std::lock_guard locker(lock_);
+          if (iter == watched_.end()) break;
+          w = &*iter++;
         }
+        scan(*w);
       }
-      init_ = false;
       // delay
       std::this_thread::sleep_for(std::chrono::milliseconds(kDelayTime));
     }
   }
 
+  void scan(Watched& w) {
+    std::error_code ec;
+    fs::directory_iterator dir(w.dir_.toStdString(), ec);
+    if (ec) return;
+    for (auto& it : dir) {
+      if (!it.is_directory()) continue;
+      // add/remove directory
+      std::string versionDir = it.path().filename();
+      // add directory
+
+      if (w.init_) {
+        w.dirMp_[versionDir] = Init;
+      } else {
+        auto x = w.dirMp_.find(versionDir);
+        if (x == w.dirMp_.end()) {
+          if (w.directoryChangedCb_)
+            w.directoryChangedCb_(QString::fromStdString(versionDir));
+          w.dirMp_[versionDir] = Add;
+        }
+      }
+    }
+    w.init_ = false;
+  }
+
  private:
-  QString dir_;
-  bool init_ = true;
-  DirectoryChangedCb directoryChangedCb_;
-  std::unordered_map<std::string, DirAction> dirMp_;
+  std::mutex lock_;
+  std::list<Watched> watched_;
+  bool started_ = false;
 };
 
 }  // namespace otaserver
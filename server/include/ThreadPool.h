@@ -1,6 +1,7 @@
 #ifndef OTASERVER_NET_THREADPOOL_H
 #define OTASERVER_NET_THREADPOOL_H
 
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <functional>
@@ -21,6 +22,14 @@ class ThreadPool {
     return th;
   }
 
+  // For the jobs that take minutes, e.g. generating the delta packs, so they
+  // don't hold the threads of the connections.
+  static ThreadPool &generation() {
+    static ThreadPool th(
+        std::max<size_t>(2, std::thread::hardware_concurrency() / 2));
+    return th;
+  }
+
   ~ThreadPool() {
     if (!running_) return;
     shutdown();
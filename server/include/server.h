@@ -3,11 +3,18 @@
 
 #include <QFile>
 #include <QObject>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
 
 #include "../../otalib/pack_apply.hpp"
 #include "../../otalib/update_strategy.hpp"
 #include "DirectoryWatcher.h"
 #include "TcpServer.h"
+#include "shard.h"
 #include "otalib/logger/logger.h"
 
 using namespace otaserver::net;
@@ -31,18 +38,26 @@ class OTAServer : public QObject {
   void newConnection(TcpConnectionPtr);
   void closeConnection(TcpConnectionPtr);
   bool readMessage(TcpConnectionPtr);
-  void directoryChanged(const QString& version);
 
-  void initDirectoryListener();
-  void initVersionMap();
+  void initShards();
+  // desc: The shard of the app "name" on the channel "type". A shard is
+  // opened at its first request if ./apps/<name>/<type>/CompletePack exists,
+  // an unknown or invalid one is served by the default shard.
+  Shard& shardOf(const QString& name, const QString& type);
+  Shard& openShard(const QString& name, const QString& type);
 
   bool mkDir(const QString& dir);
 
  private:
   TcpServer* server_;
-  VersionMap<GeneralVersion> gVcm_;
   DirectoryWatcher watcher_;
-  FILE* indxFp_;
+  std::shared_mutex shardLock_;
+  // {name, type} -> shard, {"", ""} is the default one.
+  std::map<std::pair<QString, QString>, std::unique_ptr<Shard>> shards_;
+  // The shards being loaded by openShard().
+  std::mutex openLock_;
+  std::condition_variable openCond_;
+  std::set<std::pair<QString, QString>> opening_;
 };
 }  // namespace otaserver
 
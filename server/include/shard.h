@@ -0,0 +1,140 @@
+#ifndef OTASERVER_SHARD_H
+#define OTASERVER_SHARD_H
+
+#include <stdio.h>
+
+#include <QFileInfo>
+#include <QString>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "../../otalib/pack_apply.hpp"
+#include "DirectoryWatcher.h"
+
+using namespace otalib;
+
+namespace otaserver {
+
+// The VersionMap and the packs of one app on one channel("type" of the
+// client). A shard keeps its store under its own root:
+//      ./apps/<name>/<type>/CompletePack/
+//      ./apps/<name>/<type>/DeltaPack/ DoneDeltaPack/ Sigs/ Hashs/
+//      ./apps/<name>/<type>/tmpAllDeltaPack/
+//      ./apps/<name>/<type>/verMap.idb verMap.vmi
+// The default shard(empty name and type) is rooted at "./", the layout of a
+// server of one app.
+// The delta packs of a shard are generated by its own queue on the
+// generation pool, at most kShardGenerators jobs of it at once, so a shard
+// with many new versions doesn't hold the pool from the others.
+class Shard {
+ public:
+  static constexpr size_t kShardGenerators = 2;
+
+  Shard(const QString& name, const QString& type);
+  ~Shard();
+  Shard(const Shard&) = delete;
+  Shard& operator=(const Shard&) = delete;
+
+  // desc: The root of the shard of "name" and "type".
+  static QString RootOf(const QString& name, const QString& type);
+
+  // desc: Whether "name" and "type" are fit for a path: [A-Za-z0-9._-], not
+  // leading by '.'. Both empty is the default shard.
+  static bool IsValidKey(const QString& name, const QString& type);
+
+  // desc: Make the directories and load the VersionMap.
+  void init();
+
+  // desc: Watch the complete packs by "watcher" from now on.
+  void watch(DirectoryWatcher& watcher);
+
+  const QString& name() const noexcept { return name_; }
+  const QString& type() const noexcept { return type_; }
+  QString label() const;
+  VersionMap<GeneralVersion>& vcm() noexcept { return vcm_; }
+
+  // desc: The files of an edge, the missing ones are generated.
+  // ret: {file.tar.gz, update_hash, update_sig}
+  ::std::tuple<QFileInfo, QFileInfo, QFileInfo> findPack(
+      const GeneralVersion& prev, const GeneralVersion& next);
+
+  // desc: The signed manifest of "route", kept while the packs of the route
+  // are the same.
+  // ret: {manifest, signature}, empty if it can't be made.
+  ::std::pair<QByteArray, QByteArray> genRouteManifest(
+      const QString& route, const QByteArray& applyLog,
+      const std::vector<PackFiles>& packs);
+
+  // ./tmpAllDeltaPack/1.0.0_1.0.2.tar.gz
+  QString bundleFile(const GeneralVersion& from,
+                     const GeneralVersion& dest) const;
+
+ private:
+  void initVersionMap();
+  bool loadVersionMapIndex();
+  void saveVersionMapIndex();
+  void seedVersionMap();
+  void directoryChanged(const QString& version);
+  // desc: Append "version" and record it in verMap.idb.
+  bool appendVersion(const QString& version, bool loading);
+
+  void post(std::function<void()> job);
+  void drain();
+
+  QFileInfo genHashFileFromCompletePack(const QString& version);
+  bool genMerkleProofFile(const QDir& deltaPack, const QString& logName,
+                          const GeneralVersion& target);
+  QFileInfo genDeltaPackSigFile(const QString& delVersion);
+  QFileInfo genDeltaPackTarGzFile(const QString& deltaPackDir,
+                                  const QString& delVersion);
+  bool findPackVCM(const GeneralVersion& prev, const GeneralVersion& next);
+  uint64_t packSizeVCM(const GeneralVersion& prev, const GeneralVersion& next);
+
+  void rememberHash(std::map<QString, QByteArray>& hashes, const QString& key,
+                    const QByteArray& hash);
+  void copyHash(const std::map<QString, QByteArray>& hashes,
+                const QString& key, uint8_t* out);
+  void rememberPackHash(const QString& delVersion);
+
+  QString path(const char* sub) const { return root_ + sub; }
+
+ private:
+  QString name_;
+  QString type_;
+  QString root_;
+  FILE* indxFp_ = nullptr;
+
+  // The edges of a new version are generated at once, they all write the
+  // hash files of it.
+  std::mutex hashFileLock_;
+  // The hashes kept in the index, filled when the files are generated or
+  // when the index is loaded.
+  std::mutex hashLock_;
+  // 1.0.2 -> merkle root
+  std::map<QString, QByteArray> versionHashes_;
+  // 1.0.0-1.0.2 -> sha256 of ./DoneDeltaPack/1.0.0-1.0.2.tar.gz
+  std::map<QString, QByteArray> packHashes_;
+  // Serializes the writes of the index, they come from the generation pool.
+  std::mutex indexLock_;
+  // One lock for each route manifest, taken by the requests of the route.
+  std::mutex routeLock_;
+  std::map<QString, std::mutex> routeLocks_;
+
+  // The jobs of the VersionMap waiting for the generation pool.
+  std::mutex queueLock_;
+  std::condition_variable queueCond_;
+  std::deque<std::function<void()>> queue_;
+  size_t running_ = 0;
+
+  // Declared last, its jobs use the members above.
+  VersionMap<GeneralVersion> vcm_;
+};
+
+}  // namespace otaserver
+
+#endif
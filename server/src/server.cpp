@@ -2,7 +2,11 @@
 
 #include <sys/stat.h>
 
+#include <QDir>
 #include <QJsonDocument>
+#include <QSaveFile>
+#include <mutex>
+#include <set>
 
 #include "server/include/FileLoader.hpp"
 using namespace otaserver;
@@ -10,12 +14,7 @@ using namespace otaserver;
 using std::placeholders::_1;
 
 namespace {
-constexpr static const char* kAllDeltaPackTmpDir = "./tmpAllDeltaPack/";
-constexpr static const char* kCompletePackDir = "./CompletePack/";
-constexpr static const char* kGenDeltaPackDir = "./DeltaPack/";
-constexpr static const char* kDoneDeltaPackDir = "./DoneDeltaPack/";
-constexpr static const char* kSigDir = "./Sigs/";
-constexpr static const char* kHashDir = "./Hashs/";
+constexpr static const char* kAppsDir = "./apps/";
 
 constexpr static const char* kServerSSLKey = "./ssl/";
 constexpr static const char* kServerSSLPriKey = "./ssl/private.pem";
@@ -25,18 +24,11 @@ constexpr static const char* kSigKeyDir = "./key/";
 constexpr static const char* kSigPriKeyFile = "./key/prikey";
 constexpr static const char* kSigPubKeyFile = "./key/pubkey";
 
-constexpr static const char* kIndxVerMapData = "./verMap.idb";
-
 constexpr static const size_t kIdleTimeout = 2000;
 constexpr static const size_t kServerPort = 5555;
 }  // namespace
 
-::std::tuple<QFileInfo, QFileInfo, QFileInfo> findPackCallback(
-    const GeneralVersion& prev, const GeneralVersion& next);
-
-bool findPackVCMCallback(const GeneralVersion&, const GeneralVersion&);
-
-OTAServer::OTAServer(QObject* parent) : QObject(parent), indxFp_(nullptr) {
+OTAServer::OTAServer(QObject* parent) : QObject(parent) {
   server_ = new TcpServer;
   server_->set_new_conn_cb(std::bind(&OTAServer::newConnection, this, _1));
   server_->set_close_conn_cb(std::bind(&OTAServer::closeConnection, this, _1));
@@ -50,18 +42,6 @@ OTAServer::OTAServer(QObject* parent) : QObject(parent), indxFp_(nullptr) {
 OTAServer::~OTAServer() {
   if (server_) delete server_;
   server_ = nullptr;
-
-  if (indxFp_) {
-    ::fflush(indxFp_);
-    ::fsync(::fileno(indxFp_));
-    ::fclose(indxFp_);
-    indxFp_ = nullptr;
-  }
-}
-
-void OTAServer::initDirectoryListener() {
-  watcher_.setDirChangedCb(std::bind(&OTAServer::directoryChanged, this, _1));
-  watcher_.startWatch(kCompletePackDir);
 }
 
 void OTAServer::initializeEnv() {
@@ -79,38 +59,81 @@ void OTAServer::initializeEnv() {
   // genKey(kSigPriKeyFile, kSigPubKeyFile);
 
   // create directory
-  mkDir(kAllDeltaPackTmpDir);
-  mkDir(kCompletePackDir);
-  mkDir(kGenDeltaPackDir);
-  mkDir(kDoneDeltaPackDir);
-  mkDir(kSigDir);
-  mkDir(kHashDir);
-
-  initVersionMap();
-  initDirectoryListener();
+  mkDir(kAppsDir);
+
+  initShards();
+  watcher_.startWatch();
 }
 
-void OTAServer::initVersionMap() {
-  gVcm_.setCallback<bool(const GeneralVersion&, const GeneralVersion&)>(
-      findPackVCMCallback);
+// The default shard at "./", then one for each ./apps/<name>/<type>/ found.
+void OTAServer::initShards() {
+  openShard("", "");
+  for (const QString& name :
+       QDir(kAppsDir).entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+    for (const QString& type : QDir(kAppsDir + name)
+                                   .entryList(QDir::Dirs | QDir::NoDotAndDotDot))
+      shardOf(name, type);
+  }
+}
 
-  struct stat st;
-  if (-1 != ::stat(kIndxVerMapData, &st)) {
-    indxFp_ = ::fopen(kIndxVerMapData, "r+");
-    print<GeneralInfoCtrl>(std::cout, "Load VersionMap from [", kIndxVerMapData,
-                           "]");
-  } else {
-    indxFp_ = ::fopen(kIndxVerMapData, "w+");
+Shard& OTAServer::shardOf(const QString& name, const QString& type) {
+  {
+    std::shared_lock locker(shardLock_);
+    auto iter = shards_.find({name, type});
+    if (iter == shards_.end() &&
+        (!Shard::IsValidKey(name, type) ||
+         !QDir(Shard::RootOf(name, type) + "CompletePack").exists()))
+      iter = shards_.find({QString(), QString()});
+    if (iter != shards_.end()) return *iter->second;
   }
-  // reconstruct VersionMap
-  char buffer[1024]{0};
-  // line by line
-  while (::fgets(buffer, 1024, indxFp_) != nullptr) {
-    QString version = QString::fromStdString(std::string(buffer)).trimmed();
-    if (version.isEmpty()) continue;
-    print<GeneralInfoCtrl>(std::cout, version);
-    gVcm_.append(version, true);
+  return openShard(name, type);
+}
+
+// The shard is loaded without shardLock_, the requests of the other shards
+// go on meanwhile. The requests of the same shard wait for the first one.
+Shard& OTAServer::openShard(const QString& name, const QString& type) {
+  std::pair<QString, QString> key{name, type};
+  {
+    std::unique_lock locker(openLock_);
+    openCond_.wait(locker, [this, &key] { return opening_.count(key) == 0; });
+    std::shared_lock shardLocker(shardLock_);
+    auto iter = shards_.find(key);
+    if (iter != shards_.end()) return *iter->second;
+    opening_.insert(key);
+  }
+  auto opened = [this, &key] {
+    {
+      std::lock_guard locker(openLock_);
+      opening_.erase(key);
+    }
+    openCond_.notify_all();
+  };
+
+  auto shard = std::make_unique<Shard>(name, type);
+  print<GeneralInfoCtrl>(std::cout, "Open shard [", shard->label(), "] at [",
+                         Shard::RootOf(name, type), "]");
+  try {
+    shard->init();
+  } catch (...) {
+    opened();
+    throw;
+  }
+
+  Shard* result;
+  bool inserted = false;
+  {
+    std::unique_lock locker(shardLock_);
+    auto& slot = shards_[key];
+    // Kept if another thread has inserted it first.
+    if (!slot) {
+      slot = std::move(shard);
+      inserted = true;
+    }
+    result = slot.get();
   }
+  if (inserted) result->watch(watcher_);
+  opened();
+  return *result;
 }
 
 bool OTAServer::mkDir(const QString& dir) {
@@ -123,36 +146,6 @@ bool OTAServer::mkDir(const QString& dir) {
   return true;
 }
 
-void OTAServer::directoryChanged(const QString& version) {
-  char c;
-  std::cout << "Found version [" + version.toStdString() +
-                   "] was added, is it generating a new deltapack? [y/n]: "
-            << std::flush;
-  std::cin >> c;
-  if (c == 'y' || c == 'Y') {
-    bool success = gVcm_.append(version, false);
-    if (success) {
-      std::string ver = version.toStdString();
-      ::fwrite(ver.data(), sizeof(char), ver.size(), indxFp_);
-      ::fwrite("\n", sizeof(char), 1, indxFp_);
-      ::fflush(indxFp_);
-      ::fsync(::fileno(indxFp_));
-      print<GeneralSuccessCtrl>(std::cout, "append new version successfully!");
-    } else
-      print<GeneralErrorCtrl>(std::cout, "append new version failed!");
-  } else {
-    print<GeneralWarnCtrl>(std::cout, "cancel!");
-    bool success = gVcm_.append(version, true);
-    if (success) {
-      std::string ver = version.toStdString();
-      ::fwrite(ver.data(), sizeof(char), ver.size(), indxFp_);
-      ::fwrite("\n", sizeof(char), 1, indxFp_);
-      ::fflush(indxFp_);
-      ::fsync(::fileno(indxFp_));
-    }
-  }
-}
-
 void OTAServer::quit() { server_->quit(); }
 
 void OTAServer::start(quint16 port) {
@@ -173,116 +166,6 @@ void OTAServer::closeConnection(TcpConnectionPtr /*conn*/) {
   print<GeneralErrorCtrl>(std::cout, "Client App had closed!");
 }
 
-// generate hash file for complete pack special version
-// when system administrator added a new version package
-QFileInfo genHashFileFromCompletePack(const QString& version) {
-  // ./CompletePack/1.0.1/file_log
-  // ./CompletePack/1.1.0/file_log
-  QString prefix = kCompletePackDir + version;
-  QString filelog(prefix + "/" + kFileLogName);
-  merkle_hash_t rootHash =
-      FileLogger::GetHashFromLogFile(filelog, prefix + "/");
-
-  // save hash string to file
-  // ./Hashs/1.1.0_hash
-  QString hashfile = kHashDir + version + "_hash";
-  QFile file(hashfile);
-  file.open(QFile::WriteOnly | QFile::Truncate);
-  std::string hashv = rootHash.to_string();
-  file.write(hashv.data(), hashv.size());
-  file.flush();
-  file.close();
-  // return ./Hashs/1.1.0_hash filepath
-  return QFileInfo(hashfile);
-}
-
-QFileInfo genDeltaPackSigFile(const QString& delVersion) {
-  // update and rollback
-  // ./DoneDeltaPack/1.0.0-1.0.2.tat.gz
-  QString deltaPackTarGzFile = kDoneDeltaPackDir + delVersion + ".tar.gz";
-  // ./Sigs/1.0.0-1.0.2_sig
-  QString sigfile = kSigDir + delVersion + "_sig";
-  otalib::sign(QFileInfo(deltaPackTarGzFile), QFileInfo(kSigPriKeyFile),
-               delVersion);
-  // ./DoneDeltaPack/1.0.0-1.0.2_sig
-  QFile::copy(kDoneDeltaPackDir + delVersion + "_sig", sigfile);
-  QFile::remove(kDoneDeltaPackDir + delVersion + "_sig");
-  QFile::remove(QString(kDoneDeltaPackDir) + "hash");
-  return QFileInfo(sigfile);
-}
-
-QFileInfo genDeltaPackTarGzFile(const QString& deltaPackDir,
-                                const QString delVersion) {
-  // ./DeltaPack/1.0.0-1.0.2
-  // ./DoneDeltaPack/1.0.0-1.0.2.tar.gz
-  QString doneDeltaPackFile = kDoneDeltaPackDir + delVersion + ".tar.gz";
-  tar_create_archive_file_gzip(deltaPackDir, doneDeltaPackFile);
-  return QFileInfo(doneDeltaPackFile);
-}
-
-bool findPackVCMCallback(const GeneralVersion& prev,
-                         const GeneralVersion& next) {
-  findPackCallback(prev, next);
-  return true;
-}
-
-::std::tuple<QFileInfo, QFileInfo, QFileInfo> findPackCallback(
-    const GeneralVersion& prev, const GeneralVersion& next) {
-  // ./CompletePack/1.0.0
-  // ./CompletePack/1.0.2
-  QDir vPrev(kCompletePackDir + prev.toString());
-  QDir vNext(kCompletePackDir + next.toString());
-  if (!vPrev.exists() || !vNext.exists())
-    return {QFileInfo(""), QFileInfo(""), QFileInfo("")};
-
-  // rollback: ./DeltaPack/1.0.2-1.0.0
-  // update:   ./DeltaPack/1.0.0-1.0.2
-  QString rollbackStr = next.toString() + "-" + prev.toString();
-  QString updateStr = prev.toString() + "-" + next.toString();
-
-  QDir rollbackPack(kGenDeltaPackDir + rollbackStr);
-  QDir updatePack(kGenDeltaPackDir + updateStr);
-
-  // generate delta packages
-  if (!updatePack.exists() && !rollbackPack.exists()) {
-    bool success = generateDeltaPack(vPrev, vNext, rollbackPack, updatePack);
-    if (!success) return {QFileInfo(""), QFileInfo(""), QFileInfo("")};
-  }
-  // rollback
-  // ./DoneDeltaPack/1.0.2-1.0.0.tar.gz
-  QFileInfo rollbackDelta(kDoneDeltaPackDir + rollbackStr + ".tar.gz");
-  if (!rollbackDelta.exists()) {
-    rollbackDelta =
-        genDeltaPackTarGzFile(rollbackPack.absolutePath(), rollbackStr);
-  }
-  // update
-  // ./DoneDeltaPack/1.0.0-1.0.2.tar.gz
-  QFileInfo updateDelta(kDoneDeltaPackDir + updateStr + ".tar.gz");
-  if (!updateDelta.exists()) {
-    updateDelta = genDeltaPackTarGzFile(updatePack.absolutePath(), updateStr);
-  }
-  // ./Hashs/1.0.2_hash
-  QFileInfo updateHash(kHashDir + next.toString() + "_hash");
-  if (!updateHash.exists()) {
-    updateHash = genHashFileFromCompletePack(next.toString());
-  }
-  // rollback deltapack tar.gz sig
-  // ./Sigs/1.0.2-1.0.0_sig
-  QFileInfo rollbackSig(kSigDir + rollbackStr + "_sig");
-  if (!rollbackSig.exists()) {
-    rollbackSig = genDeltaPackSigFile(rollbackStr);
-  }
-  // update deltapack tar.gz sig
-  // ./Sigs/1.0.0-1.0.2_sig
-  QFileInfo updateSig(kSigDir + updateStr + "_sig");
-  if (!updateSig.exists()) {
-    updateSig = genDeltaPackSigFile(updateStr);
-  }
-
-  // {file.tar.gz, update_hash, update_sig}
-  return {updateDelta, updateHash, updateSig};
-}
-
 void OTAServer::dumpAppClientInfo(const QString& client,
                                   const ClientInfo<GeneralVersion>& cinfo) {
   print<GeneralSuccessCtrl>(std::cout, "Client info: ", client);
@@ -312,7 +195,8 @@ bool OTAServer::readMessage(TcpConnectionPtr conn) {
     // dump client information
     dumpAppClientInfo(conn->peer_address().to_string(), clientInfo);
 
-    auto ciOpt = matchStrategy(clientInfo, gVcm_);
+    Shard& shard = shardOf(clientInfo.name, clientInfo.type);
+    auto ciOpt = matchStrategy(clientInfo, shard.vcm());
 
     QJsonDocument jDoc;
     if (!ciOpt.has_value()) {
@@ -348,51 +232,91 @@ bool OTAServer::readMessage(TcpConnectionPtr conn) {
     const auto& [sac, stype, from, dest] = resp.value();
     if (sac == sAction::None) return true;
 
+    // A confirm without the app is of a client before the shards.
+    auto [appname, apptype] = ParseConfirmApp(bytes);
+    Shard& shard = shardOf(appname, apptype);
+    auto& vcm = shard.vcm();
     std::vector<VersionMap<GeneralVersion>::EdgeType> verPath;
     if (sac == sAction::Update) {
-      verPath = gVcm_.search<SearchStrategy::vUpdate>(from, dest);
+      verPath = vcm.search<SearchStrategy::vUpdate>(from, dest);
     } else if (sac == sAction::Rollback) {
-      verPath = gVcm_.search<SearchStrategy::vRollback>(from, dest);
+      verPath = vcm.search<SearchStrategy::vRollback>(from, dest);
     }
+    auto routeStats = vcm.routeCacheStats();
+    print<GeneralInfoCtrl>(std::cout, "shard:", shard.label(),
+                           "route cache hits:", routeStats.hits_,
+                           "misses:", routeStats.misses_);
     // path empty ...
     if (verPath.empty()) {
       return true;
     }
 
-    // ./tmpAllDeltaPack/1.0.0_1.0.2
+    // The packs the client has kept, keyed by name and signature hash.
+    std::set<std::pair<QString, QString>> cached;
+    for (const auto& pack : ParseConfirmCached(bytes))
+      cached.emplace(pack.packname_, pack.sig_hash_);
+    auto omit = [&cached](const QFileInfo& pack, const QFileInfo& sig) {
+      if (cached.empty()) return false;
+      QFile file(sig.absoluteFilePath());
+      if (!file.open(QFile::ReadOnly)) return false;
+      QString sig_hash = PackCache::sigHash(file.readAll());
+      return cached.count({pack.fileName(), sig_hash}) > 0;
+    };
+
     // ./tmpAllDeltaPack/1.0.0_1.0.2.tar.gz
-    QString destDir =
-        kAllDeltaPackTmpDir + from.toString() + "_" + dest.toString();
-    ::mkdir(destDir.toStdString().c_str(), 0755);
+    QString completeDeltaPackFile = shard.bundleFile(from, dest);
 
-    QString completeDeltaPackFile = destDir + ".tar.gz";
+    // The file holds the whole bundle, it doesn't fit a client with a cache.
+    if (cached.empty() && QFile(completeDeltaPackFile).exists()) {
+      // map v1_v2.tar.gz file into net::Buffer
+      FileLoader(completeDeltaPackFile.toStdString()).readAll(conn->sender());
+      return true;
+    }
 
     /*
+        ./apply_log
+        ./route_manifest
+        ./route_manifest_sig
         // 1.0.0 -> 1.0.1
-        ./tmpAllDeltaPack/1.0.0_1.0.2/1.0.0-1.0.1.tar.gz
-        ./tmpAllDeltaPack/1.0.0_1.0.2/1.0.1_hash
-        ./tmpAllDeltaPack/1.0.0_1.0.2/1.0.1_sig
+        ./1.0.0-1.0.1_sig
+        ./1.0.1_hash
+        ./1.0.0-1.0.1.tar.gz
         // 1.0.1 -> 1.0.2
-        ./tmpAllDeltaPack/1.0.0_1.0.2/1.0.1-1.0.2.tar.gz
-        ./tmpAllDeltaPack/1.0.0_1.0.2/1.0.2_hash
-        ./tmpAllDeltaPack/1.0.0_1.0.2/1.0.2_sig
+        ./1.0.1-1.0.2_sig
+        ./1.0.2_hash
+        ./1.0.1-1.0.2.tar.gz
         ...
-        ./tmpAllDeltaPack/1.0.0_1.0.2/apply_log
     */
-    if (!QFile(completeDeltaPackFile).exists()) {
-      getPackFromPaths<GeneralVersion,
-                       ::std::tuple<QFileInfo, QFileInfo, QFileInfo>(
-                           const GeneralVersion&, const GeneralVersion&)>(
-          QDir(destDir), verPath, findPackCallback);
-
-      // ./tmpAllDeltaPack/1.0.0_1.0.2 -> ./tmpAllDeltaPack/1.0.0_1.0.2.tar.gz
-      tar_create_archive_file_gzip(destDir, completeDeltaPackFile);
+    // Build the archive in memory, then send it and keep it for the next
+    // request of the same path.
+    QByteArray archive;
+    TarGzWriter writer([&archive](const char* data, size_t size) {
+      archive.append(data, static_cast<int>(size));
+    });
+    QString route = from.toString() + "_" + dest.toString();
+    auto manifest = [&route, &shard](const QByteArray& applyLog,
+                                     const std::vector<PackFiles>& packs) {
+      return shard.genRouteManifest(route, applyLog, packs);
+    };
+    auto findPack = [&shard](const GeneralVersion& prev,
+                             const GeneralVersion& next) {
+      return shard.findPack(prev, next);
+    };
+    size_t omitted = archivePackFromPaths<GeneralVersion>(
+        writer, verPath, findPack, omit, manifest);
+    writer.finish();
+
+    conn->sender()->append(archive.constData(), archive.size());
+    if (omitted > 0) {
+      print<GeneralInfoCtrl>(std::cout, "packs cached by client:", omitted);
+      return true;
     }
 
-    // map v1_v2.tar.gz file into net::Buffer
-    FileLoader(completeDeltaPackFile.toStdString()).readAll(conn->sender());
-
-    QDir(destDir).removeRecursively();
+    QSaveFile cache(completeDeltaPackFile);
+    if (cache.open(QFile::WriteOnly)) {
+      cache.write(archive);
+      cache.commit();
+    }
   }
   // sending
   return true;
@@ -0,0 +1,527 @@
+#include "server/include/shard.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <QDir>
+#include <QRegularExpression>
+#include <QSaveFile>
+#include <algorithm>
+
+#include "otalib/vermap_index.h"
+using namespace otaserver;
+
+namespace {
+constexpr static const char* kAllDeltaPackTmpDir = "tmpAllDeltaPack/";
+constexpr static const char* kCompletePackDir = "CompletePack/";
+constexpr static const char* kGenDeltaPackDir = "DeltaPack/";
+constexpr static const char* kDoneDeltaPackDir = "DoneDeltaPack/";
+constexpr static const char* kSigDir = "Sigs/";
+constexpr static const char* kHashDir = "Hashs/";
+
+constexpr static const char* kIndxVerMapData = "verMap.idb";
+// binary form of the VersionMap, see vermap_index.h
+constexpr static const char* kVerMapIndexFile = "verMap.vmi";
+
+// The key is shared by all the shards.
+constexpr static const char* kSigPriKeyFile = "./key/prikey";
+
+constexpr static const char* kAppsDir = "./apps/";
+}  // namespace
+
+Shard::Shard(const QString& name, const QString& type)
+    : name_(name), type_(type), root_(RootOf(name, type)) {}
+
+Shard::~Shard() {
+  // The jobs of the map use the members, let them finish first.
+  vcm_.wait();
+  {
+    std::unique_lock locker(queueLock_);
+    queueCond_.wait(locker, [this] { return running_ == 0; });
+  }
+  if (indxFp_) {
+    ::fflush(indxFp_);
+    ::fsync(::fileno(indxFp_));
+    ::fclose(indxFp_);
+    indxFp_ = nullptr;
+  }
+}
+
+QString Shard::RootOf(const QString& name, const QString& type) {
+  if (name.isEmpty() && type.isEmpty()) return QStringLiteral("./");
+  return kAppsDir + name + "/" + type + "/";
+}
+
+bool Shard::IsValidKey(const QString& name, const QString& type) {
+  if (name.isEmpty() && type.isEmpty()) return true;
+  static const QRegularExpression pattern(
+      QStringLiteral("^[A-Za-z0-9_-][A-Za-z0-9._-]*$"));
+  return pattern.match(name).hasMatch() && pattern.match(type).hasMatch();
+}
+
+QString Shard::label() const {
+  if (name_.isEmpty() && type_.isEmpty()) return QStringLiteral("default");
+  return name_ + "/" + type_;
+}
+
+void Shard::init() {
+  // create directory
+  QDir dir;
+  dir.mkpath(path(kAllDeltaPackTmpDir));
+  dir.mkpath(path(kCompletePackDir));
+  dir.mkpath(path(kGenDeltaPackDir));
+  dir.mkpath(path(kDoneDeltaPackDir));
+  dir.mkpath(path(kSigDir));
+  dir.mkpath(path(kHashDir));
+
+  initVersionMap();
+}
+
+void Shard::watch(DirectoryWatcher& watcher) {
+  watcher.watch(path(kCompletePackDir),
+                [this](const QString& version) { directoryChanged(version); });
+}
+
+QString Shard::bundleFile(const GeneralVersion& from,
+                          const GeneralVersion& dest) const {
+  return path(kAllDeltaPackTmpDir) + from.toString() + "_" + dest.toString() +
+         ".tar.gz";
+}
+
+void Shard::initVersionMap() {
+  vcm_.setCallback([this](const GeneralVersion& prev,
+                          const GeneralVersion& next) {
+    return findPackVCM(prev, next);
+  });
+  vcm_.setCostCallback([this](const GeneralVersion& prev,
+                              const GeneralVersion& next) {
+    return packSizeVCM(prev, next);
+  });
+  // The delta packs of the new versions are generated in background, a
+  // version is routed to once its packs are done.
+  vcm_.setExecutor([this](std::function<void()> job) { post(job); });
+  vcm_.setSettleCallback([this] { saveVersionMapIndex(); });
+
+  std::string indxFile = path(kIndxVerMapData).toStdString();
+  struct stat st;
+  if (-1 != ::stat(indxFile.c_str(), &st)) {
+    indxFp_ = ::fopen(indxFile.c_str(), "r+");
+  } else {
+    indxFp_ = ::fopen(indxFile.c_str(), "w+");
+  }
+  if (!loadVersionMapIndex()) {
+    print<GeneralInfoCtrl>(std::cout, "Load VersionMap from [", indxFile, "]");
+    // reconstruct VersionMap
+    char buffer[1024]{0};
+    // line by line
+    while (::fgets(buffer, 1024, indxFp_) != nullptr) {
+      QString version = QString::fromStdString(std::string(buffer)).trimmed();
+      if (version.isEmpty()) continue;
+      print<GeneralInfoCtrl>(std::cout, version);
+      vcm_.append(version, true);
+    }
+    saveVersionMapIndex();
+  }
+  ::fseek(indxFp_, 0, SEEK_END);
+  if (!vcm_.oldest()) seedVersionMap();
+}
+
+// A shard without a list of versions takes the complete packs already in its
+// directory, oldest first, and generates their delta packs. The watcher
+// doesn't report the directories found at its first scan.
+void Shard::seedVersionMap() {
+  static const QRegularExpression pattern(
+      QStringLiteral("^\\d+\\.\\d+\\.\\d+$"));
+  std::vector<GeneralVersion> versions;
+  for (const QString& name : QDir(path(kCompletePackDir))
+                                 .entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+    // The packs are found by toString(), "1.01.0" wouldn't be.
+    if (!pattern.match(name).hasMatch() ||
+        GeneralVersion(name).toString() != name)
+      continue;
+    versions.emplace_back(name);
+  }
+  if (versions.empty()) return;
+  std::sort(versions.begin(), versions.end());
+
+  size_t appended = 0;
+  for (const auto& version : versions)
+    if (appendVersion(version.toString(), false)) ++appended;
+  print<GeneralInfoCtrl>(std::cout, "Seed VersionMap of [", label(),
+                         "] from [", path(kCompletePackDir),
+                         "] versions:", appended);
+}
+
+// Take the VersionMap from the binary index if it's not older than the list
+// of versions. The packs are not looked at, the edges not ready in it are
+// generated again.
+bool Shard::loadVersionMapIndex() {
+  VerMapIndex index;
+  if (!index.open(path(kVerMapIndexFile)) ||
+      !VerMapIndex::IsFresh(index, path(kIndxVerMapData)))
+    return false;
+
+  using EdgeInfo = VersionMap<GeneralVersion>::EdgeInfo;
+  using EdgeState = VersionMap<GeneralVersion>::EdgeState;
+  std::vector<GeneralVersion> versions;
+  versions.reserve(index.versionCount());
+  for (size_t i = 0; i < index.versionCount(); ++i) {
+    std::string_view name = index.name(i);
+    QString version =
+        QString::fromUtf8(name.data(), static_cast<int>(name.size()));
+    versions.emplace_back(version);
+    const auto* hash = reinterpret_cast<const char*>(index.version(i).hash);
+    rememberHash(versionHashes_, version, QByteArray(hash, 32));
+  }
+  std::vector<EdgeInfo> edges;
+  edges.reserve(index.edgeCount());
+  for (size_t i = 0; i < index.edgeCount(); ++i) {
+    const VerMapEdgeRecord& record = index.edge(i);
+    if (record.state > static_cast<uint32_t>(EdgeState::Failed)) continue;
+    edges.push_back(EdgeInfo{record.lower, record.higher,
+                             static_cast<EdgeState>(record.state),
+                             record.update_size, record.rollback_size});
+    QString lower = versions[record.lower].toString();
+    QString higher = versions[record.higher].toString();
+    rememberHash(packHashes_, lower + "-" + higher,
+                 QByteArray(reinterpret_cast<const char*>(record.update_hash),
+                            32));
+    rememberHash(packHashes_, higher + "-" + lower,
+                 QByteArray(reinterpret_cast<const char*>(record.rollback_hash),
+                            32));
+  }
+  if (!vcm_.restore(versions, edges)) return false;
+  print<GeneralInfoCtrl>(std::cout, "Load VersionMap from [",
+                         path(kVerMapIndexFile), "] versions:", versions.size(),
+                         "edges:", edges.size());
+  return true;
+}
+
+void Shard::saveVersionMapIndex() {
+  std::lock_guard locker(indexLock_);
+  std::vector<GeneralVersion> versions = vcm_.versions();
+  std::vector<VerMapIndex::Version> records(versions.size());
+  for (size_t i = 0; i < versions.size(); ++i) {
+    QString version = versions[i].toString();
+    records[i].name_ = version.toStdString();
+    copyHash(versionHashes_, version, records[i].hash_);
+  }
+  std::vector<VerMapEdgeRecord> edges;
+  for (const auto& info : vcm_.edges()) {
+    // The versions appended after "versions" were taken.
+    if (info.higher_ >= versions.size()) continue;
+    VerMapEdgeRecord record;
+    ::memset(&record, 0, sizeof(record));
+    record.lower = info.lower_;
+    record.higher = info.higher_;
+    record.state = static_cast<uint32_t>(info.state_);
+    record.update_size = info.update_bytes_;
+    record.rollback_size = info.rollback_bytes_;
+    QString lower = versions[info.lower_].toString();
+    QString higher = versions[info.higher_].toString();
+    copyHash(packHashes_, lower + "-" + higher, record.update_hash);
+    copyHash(packHashes_, higher + "-" + lower, record.rollback_hash);
+    edges.push_back(record);
+  }
+  if (!VerMapIndex::Write(path(kVerMapIndexFile), records, edges,
+                          path(kIndxVerMapData)))
+    print<GeneralErrorCtrl>(std::cout, "Cannot write [",
+                            path(kVerMapIndexFile), "]");
+}
+
+void Shard::directoryChanged(const QString& version) {
+  // The watcher reports the shards one by one, the prompts don't mix.
+  char c;
+  std::cout << "Found version [" + version.toStdString() + "] of [" +
+                   label().toStdString() +
+                   "] was added, is it generating a new deltapack? [y/n]: "
+            << std::flush;
+  std::cin >> c;
+  if (c == 'y' || c == 'Y') {
+    if (appendVersion(version, false))
+      print<GeneralSuccessCtrl>(
+          std::cout,
+          "append new version successfully! generating its delta packs...");
+    else
+      print<GeneralErrorCtrl>(std::cout, "append new version failed!");
+  } else {
+    print<GeneralWarnCtrl>(std::cout, "cancel!");
+    appendVersion(version, true);
+  }
+}
+
+bool Shard::appendVersion(const QString& version, bool loading) {
+  if (!vcm_.append(version, loading)) return false;
+  std::string ver = version.toStdString();
+  ::fwrite(ver.data(), sizeof(char), ver.size(), indxFp_);
+  ::fwrite("\n", sizeof(char), 1, indxFp_);
+  ::fflush(indxFp_);
+  ::fsync(::fileno(indxFp_));
+  saveVersionMapIndex();
+  return true;
+}
+
+void Shard::post(std::function<void()> job) {
+  std::lock_guard locker(queueLock_);
+  queue_.push_back(std::move(job));
+  if (running_ >= kShardGenerators) return;
+  ++running_;
+  ThreadPool<>::generation().add([this] { drain(); });
+}
+
+// Each run takes one job and hands the pool back, so the queues of the
+// shards take turns on it.
+void Shard::drain() {
+  std::function<void()> job;
+  {
+    std::lock_guard locker(queueLock_);
+    if (queue_.empty()) {
+      --running_;
+      queueCond_.notify_all();
+      return;
+    }
+    job = std::move(queue_.front());
+    queue_.pop_front();
+  }
+  job();
+  std::lock_guard locker(queueLock_);
+  if (queue_.empty()) {
+    --running_;
+    queueCond_.notify_all();
+    return;
+  }
+  ThreadPool<>::generation().add([this] { drain(); });
+}
+
+void Shard::rememberHash(std::map<QString, QByteArray>& hashes,
+                         const QString& key, const QByteArray& hash) {
+  if (hash.size() != 32 || hash.count('\0') == 32) return;
+  std::lock_guard locker(hashLock_);
+  hashes[key] = hash;
+}
+
+void Shard::copyHash(const std::map<QString, QByteArray>& hashes,
+                     const QString& key, uint8_t* out) {
+  std::lock_guard locker(hashLock_);
+  auto iter = hashes.find(key);
+  if (iter != hashes.end()) ::memcpy(out, iter->second.constData(), 32);
+}
+
+void Shard::rememberPackHash(const QString& delVersion) {
+  {
+    std::lock_guard locker(hashLock_);
+    if (packHashes_.count(delVersion)) return;
+  }
+  QFile pack(path(kDoneDeltaPackDir) + delVersion + ".tar.gz");
+  if (!pack.open(QFile::ReadOnly)) return;
+  QCryptographicHash hash(QCryptographicHash::Sha256);
+  hash.addData(&pack);
+  rememberHash(packHashes_, delVersion, hash.result());
+}
+
+// generate hash file for complete pack special version
+// when system administrator added a new version package
+QFileInfo Shard::genHashFileFromCompletePack(const QString& version) {
+  std::lock_guard locker(hashFileLock_);
+  // ./CompletePack/1.0.1/file_log
+  // ./CompletePack/1.1.0/file_log
+  QString prefix = path(kCompletePackDir) + version;
+  QString filelog(prefix + "/" + kFileLogName);
+  quint64 chunkSize =
+      ReadProperty(prefix + "/" + kPropertyName).hash_chunk_size_;
+  // ./Hashs/1.1.0_manifest
+  merkle_hash_t rootHash = FileLogger::WriteLeafManifest(
+      filelog, prefix + "/", chunkSize,
+      path(kHashDir) + version + "_manifest");
+
+  // ./Hashs/1.1.0_chunks
+  if (chunkSize > 0)
+    FileLogger::WriteChunkManifest(filelog, prefix + "/", chunkSize,
+                                   path(kHashDir) + version + "_chunks");
+
+  // save hash string to file
+  // ./Hashs/1.1.0_hash
+  QString hashfile = path(kHashDir) + version + "_hash";
+  QFile file(hashfile);
+  file.open(QFile::WriteOnly | QFile::Truncate);
+  std::string hashv = rootHash.to_string();
+  file.write(hashv.data(), hashv.size());
+  rememberHash(versionHashes_, version,
+               QByteArray::fromHex(QByteArray::fromStdString(hashv)));
+  file.flush();
+  file.close();
+  // return ./Hashs/1.1.0_hash filepath
+  return QFileInfo(hashfile);
+}
+
+// write the inclusion proofs of the files written by a delta pack, against
+// the root of the version it leads to
+bool Shard::genMerkleProofFile(const QDir& deltaPack, const QString& logName,
+                               const GeneralVersion& target) {
+  // ./Hashs/1.0.2_manifest
+  QString leafFile = path(kHashDir) + target.toString() + "_manifest";
+  if (!QFileInfo::exists(leafFile))
+    genHashFileFromCompletePack(target.toString());
+  std::vector<std::string> entries;
+  std::vector<merkle_hash_t> leaves =
+      FileLogger::ReadLeafManifest(leafFile, &entries);
+
+  QFile logFile(deltaPack.filePath(logName));
+  if (!logFile.open(QFile::ReadOnly)) return false;
+  QTextStream log(&logFile);
+  DeltaInfoStream infos = readDeltaLog(log);
+  // ./DeltaPack/1.0.0-1.0.2/merkle_proof
+  return WriteMerkleProofs(entries, leaves, TouchedEntries(infos, entries),
+                           deltaPack.filePath(kMerkleProofName));
+}
+
+QFileInfo Shard::genDeltaPackSigFile(const QString& delVersion) {
+  // update and rollback
+  // ./DoneDeltaPack/1.0.0-1.0.2.tat.gz
+  QString doneDir = path(kDoneDeltaPackDir);
+  QString deltaPackTarGzFile = doneDir + delVersion + ".tar.gz";
+  // ./Sigs/1.0.0-1.0.2_sig
+  QString sigfile = path(kSigDir) + delVersion + "_sig";
+  otalib::sign(QFileInfo(deltaPackTarGzFile), QFileInfo(kSigPriKeyFile),
+               delVersion);
+  // ./DoneDeltaPack/1.0.0-1.0.2_sig
+  QFile::copy(doneDir + delVersion + "_sig", sigfile);
+  QFile::remove(doneDir + delVersion + "_sig");
+  return QFileInfo(sigfile);
+}
+
+// sign the route manifest once for a pair of versions, and keep it while the
+// packs of the route are the same
+::std::pair<QByteArray, QByteArray> Shard::genRouteManifest(
+    const QString& route, const QByteArray& applyLog,
+    const std::vector<PackFiles>& packs) {
+  // ./Sigs/1.0.0_1.0.2_route
+  // ./Sigs/1.0.0_1.0.2_route_sig
+  QString manifestFile = path(kSigDir) + route + "_route";
+  QString sigFile = manifestFile + "_sig";
+
+  // The digests of the packs as they are now, a pack generated again since
+  // the manifest was signed doesn't match the one kept.
+  QList<QFileInfo> files;
+  for (const auto& [pack, hash, packSig] : packs) files << pack << hash;
+  QByteArray content = MakeRouteManifest(applyLog, files);
+  if (content.isEmpty()) return {};
+
+  // sign() rewrites the signature in place, the requests of the route wait
+  // for each other.
+  std::unique_lock<std::mutex> routeLocker;
+  {
+    std::lock_guard locker(routeLock_);
+    routeLocker = std::unique_lock(routeLocks_[route]);
+  }
+  QFile cached(manifestFile);
+  QFile cachedSig(sigFile);
+  if (cached.open(QFile::ReadOnly) && cached.readAll() == content &&
+      cachedSig.open(QFile::ReadOnly)) {
+    QByteArray sig = cachedSig.readAll();
+    if (!sig.isEmpty()) return {content, sig};
+  }
+  cached.close();
+  cachedSig.close();
+
+  QSaveFile file(manifestFile);
+  if (!file.open(QFile::WriteOnly) || file.write(content) != content.size() ||
+      !file.commit() ||
+      !otalib::sign(QFileInfo(manifestFile), QFileInfo(kSigPriKeyFile),
+                    route + "_route") ||
+      !cachedSig.open(QFile::ReadOnly)) {
+    QFile::remove(manifestFile);
+    return {};
+  }
+  return {content, cachedSig.readAll()};
+}
+
+QFileInfo Shard::genDeltaPackTarGzFile(const QString& deltaPackDir,
+                                       const QString& delVersion) {
+  // ./DeltaPack/1.0.0-1.0.2
+  // ./DoneDeltaPack/1.0.0-1.0.2.tar.gz
+  QString doneDeltaPackFile = path(kDoneDeltaPackDir) + delVersion + ".tar.gz";
+  tar_create_archive_file_gzip(deltaPackDir, doneDeltaPackFile);
+  return QFileInfo(doneDeltaPackFile);
+}
+
+bool Shard::findPackVCM(const GeneralVersion& prev,
+                        const GeneralVersion& next) {
+  auto [pack, hash, sig] = findPack(prev, next);
+  // QFileInfo caches the stat, ask again.
+  if (!QFileInfo::exists(pack.filePath()) ||
+      !QFileInfo::exists(hash.filePath()) || !QFileInfo::exists(sig.filePath()))
+    return false;
+  rememberPackHash(prev.toString() + "-" + next.toString());
+  rememberPackHash(next.toString() + "-" + prev.toString());
+  return true;
+}
+
+// the size of the pack of an edge, 0 if it isn't built
+uint64_t Shard::packSizeVCM(const GeneralVersion& prev,
+                            const GeneralVersion& next) {
+  // ./DoneDeltaPack/1.0.0-1.0.2.tar.gz
+  QFileInfo pack(path(kDoneDeltaPackDir) + prev.toString() + "-" +
+                 next.toString() + ".tar.gz");
+  return pack.exists() ? static_cast<uint64_t>(pack.size()) : 0;
+}
+
+::std::tuple<QFileInfo, QFileInfo, QFileInfo> Shard::findPack(
+    const GeneralVersion& prev, const GeneralVersion& next) {
+  // ./CompletePack/1.0.0
+  // ./CompletePack/1.0.2
+  QDir vPrev(path(kCompletePackDir) + prev.toString());
+  QDir vNext(path(kCompletePackDir) + next.toString());
+  if (!vPrev.exists() || !vNext.exists())
+    return {QFileInfo(""), QFileInfo(""), QFileInfo("")};
+
+  // rollback: ./DeltaPack/1.0.2-1.0.0
+  // update:   ./DeltaPack/1.0.0-1.0.2
+  QString rollbackStr = next.toString() + "-" + prev.toString();
+  QString updateStr = prev.toString() + "-" + next.toString();
+
+  QDir rollbackPack(path(kGenDeltaPackDir) + rollbackStr);
+  QDir updatePack(path(kGenDeltaPackDir) + updateStr);
+
+  // generate delta packages
+  if (!updatePack.exists() && !rollbackPack.exists()) {
+    bool success = generateDeltaPack(vPrev, vNext, rollbackPack, updatePack);
+    if (!success) return {QFileInfo(""), QFileInfo(""), QFileInfo("")};
+    // A pack without proofs is still checked with the whole tree.
+    genMerkleProofFile(updatePack, "update_log", next);
+    genMerkleProofFile(rollbackPack, "rollback_log", prev);
+  }
+  // rollback
+  // ./DoneDeltaPack/1.0.2-1.0.0.tar.gz
+  QFileInfo rollbackDelta(path(kDoneDeltaPackDir) + rollbackStr + ".tar.gz");
+  if (!rollbackDelta.exists()) {
+    rollbackDelta =
+        genDeltaPackTarGzFile(rollbackPack.absolutePath(), rollbackStr);
+  }
+  // update
+  // ./DoneDeltaPack/1.0.0-1.0.2.tar.gz
+  QFileInfo updateDelta(path(kDoneDeltaPackDir) + updateStr + ".tar.gz");
+  if (!updateDelta.exists()) {
+    updateDelta = genDeltaPackTarGzFile(updatePack.absolutePath(), updateStr);
+  }
+  // ./Hashs/1.0.2_hash
+  QFileInfo updateHash(path(kHashDir) + next.toString() + "_hash");
+  if (!updateHash.exists()) {
+    updateHash = genHashFileFromCompletePack(next.toString());
+  }
+  // rollback deltapack tar.gz sig
+  // ./Sigs/1.0.2-1.0.0_sig
+  QFileInfo rollbackSig(path(kSigDir) + rollbackStr + "_sig");
+  if (!rollbackSig.exists()) {
+    rollbackSig = genDeltaPackSigFile(rollbackStr);
+  }
+  // update deltapack tar.gz sig
+  // ./Sigs/1.0.0-1.0.2_sig
+  QFileInfo updateSig(path(kSigDir) + updateStr + "_sig");
+  if (!updateSig.exists()) {
+    updateSig = genDeltaPackSigFile(updateStr);
+  }
+
+  // {file.tar.gz, update_hash, update_sig}
+  return {updateDelta, updateHash, updateSig};
+}
@@ -0,0 +1,81 @@
+#include <chrono>
+#include <random>
+
+#include "otalib/sha256_hash.h"
+
+using namespace otalib;
+
+// Hash every file under "dir" on one thread, then on all the cores, and report
+// the throughput. Run it twice to see the numbers with a warm page cache.
+void hash_bench(const QString& dir = "./subdir") {
+  std::vector<std::string> files;
+  ListFilesForHash(dir, files);
+  uint64_t bytes = 0;
+  for (const auto& file : files)
+    bytes += QFileInfo(QString::fromStdString(file)).size();
+
+  auto run = [&](size_t threads) {
+    auto start = std::chrono::steady_clock::now();
+    merkle_tree_t tree;
+    for (const auto& hash : Sha256HashFiles(files, threads)) tree.insert(hash);
+    merkle_hash_t root = tree.root();
+    std::chrono::duration<double> cost =
+        std::chrono::steady_clock::now() - start;
+
+    double gbps = cost.count() > 0 ? bytes / cost.count() / 1e9 : 0;
+    print<GeneralInfoCtrl>(
+        std::cout, "threads:", threads == 0 ? std::thread::hardware_concurrency() : threads,
+        "files:", files.size(), "bytes:", bytes, "seconds:", cost.count(),
+        "GB/s:", gbps);
+    return root;
+  };
+
+  merkle_hash_t sequential = run(1);
+  merkle_hash_t parallel = run(0);
+  if (sequential == parallel)
+    print<GeneralSuccessCtrl>(std::cout, "root:", parallel.to_string());
+  else
+    print<GeneralErrorCtrl>(std::cout, "roots differ!");
+}
+
+// Root of "leaves" random leaves, by merkle_tree_t and by MerkleRootOf() on
+// every SHA-256 backend this CPU has.
+void merkle_bench(size_t leaves = 100000) {
+  std::mt19937 rng(leaves);
+  std::vector<merkle_hash_t> hashes(leaves);
+  for (auto& hash : hashes)
+    for (auto& byte : hash.bytes) byte = static_cast<uint8_t>(rng());
+
+  auto since = [](auto start) {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  merkle::TreeT<kSha256Len, merkle::sha256_openssl> tree;
+  for (const auto& hash : hashes) tree.insert(hash);
+  merkle_hash_t expect = tree.root();
+  print<GeneralInfoCtrl>(std::cout, "tree insert(openssl) ms:", since(start));
+
+  for (auto backend :
+       {Sha256Backend::Generic, Sha256Backend::ShaNi, Sha256Backend::Avx2}) {
+    if (!Sha256BackendSupported(backend)) continue;
+    start = std::chrono::steady_clock::now();
+    std::vector<merkle_hash_t> level = hashes;
+    while (level.size() > 1) {
+      std::vector<merkle_hash_t> parents(level.size() / 2 + level.size() % 2);
+      Sha256Hash64(level[0].bytes, parents[0].bytes, level.size() / 2,
+                   backend);
+      if (level.size() % 2) parents.back() = level.back();
+      level = std::move(parents);
+    }
+    double cost = since(start);
+    if (level.front() == expect)
+      print<GeneralInfoCtrl>(std::cout, "batch root", Sha256BackendName(backend),
+                             "ms:", cost);
+    else
+      print<GeneralErrorCtrl>(std::cout, "batch root",
+                              Sha256BackendName(backend), "differs!");
+  }
+}
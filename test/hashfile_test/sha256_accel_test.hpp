@@ -0,0 +1,41 @@
+#include <openssl/sha.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+#include "../../otalib/logger/logger.h"
+#include "../../otalib/sha256_accel.h"
+
+using namespace otalib;
+
+// Every backend this CPU supports gives the digests of SHA256(), for counts
+// around the 8 lanes of AVX2 so the tail after the batches is taken too.
+bool test_sha256_backends() {
+  std::mt19937 rng(35);
+  bool succ = true;
+  for (Sha256Backend backend : {Sha256Backend::Generic, Sha256Backend::ShaNi,
+                                Sha256Backend::Avx2}) {
+    if (!Sha256BackendSupported(backend)) {
+      print<GeneralInfoCtrl>(std::cout, "Not supported:",
+                             Sha256BackendName(backend));
+      continue;
+    }
+    for (size_t n : {0, 1, 7, 8, 9, 17}) {
+      std::vector<uint8_t> in(n * 64);
+      for (auto& byte : in) byte = static_cast<uint8_t>(rng());
+      std::vector<uint8_t> expected(n * 32), out(n * 32 + 1, 0xee);
+      for (size_t i = 0; i < n; ++i)
+        SHA256(in.data() + i * 64, 64, expected.data() + i * 32);
+      Sha256Hash64(in.data(), out.data(), n, backend);
+      // The byte after the digests is left alone.
+      if (memcmp(out.data(), expected.data(), n * 32) != 0 ||
+          out[n * 32] != 0xee) {
+        print<GeneralErrorCtrl>(std::cerr, "Digest mismatch:",
+                                Sha256BackendName(backend), "n:", n);
+        succ = false;
+      }
+    }
+  }
+  return succ;
+}
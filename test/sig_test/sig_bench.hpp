@@ -0,0 +1,81 @@
+#include <chrono>
+#include <random>
+
+#include "../../otalib/logger/logger.h"
+#include "../../otalib/signature.h"
+
+using namespace otalib;
+
+// Sign "edges" packs of "pack_size" bytes as the server does for every new
+// edge, then verify them as the client does for every hop. The same is done
+// through the openssl command line for a few packs, as it was before(rsa
+// only).
+void sig_bench(int edges = 200, int pack_size = 256 * 1024,
+               SigScheme scheme = SigScheme::RsaSha256) {
+  QDir dir("./sig_bench");
+  dir.removeRecursively();
+  dir.mkpath(".");
+  genKey(dir.filePath("prikey"), dir.filePath("pubkey"), scheme);
+  print<GeneralInfoCtrl>(std::cout, "scheme:", sigSchemeName(scheme));
+
+  std::mt19937 rng(edges);
+  for (int i = 0; i < edges; ++i) {
+    QByteArray pack(pack_size, 0);
+    for (auto& byte : pack) byte = static_cast<char>(rng());
+    QFile file(dir.filePath(QString::number(i) + ".tar.gz"));
+    file.open(QFile::WriteOnly);
+    file.write(pack);
+  }
+
+  auto since = [](auto start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < edges; ++i)
+    sign(QFileInfo(dir.filePath(QString::number(i) + ".tar.gz")),
+         QFileInfo(dir.filePath("prikey")), QString::number(i));
+  double cost = since(start);
+  print<GeneralInfoCtrl>(std::cout, "sign edges:", edges, "seconds:", cost,
+                         "per second:", edges / cost);
+
+  start = std::chrono::steady_clock::now();
+  int failed = 0;
+  for (int i = 0; i < edges; ++i) {
+    QFile pack(dir.filePath(QString::number(i) + ".tar.gz"));
+    QFile sig(dir.filePath(QString::number(i) + "_sig"));
+    pack.open(QFile::ReadOnly);
+    sig.open(QFile::ReadOnly);
+    if (!verifyData(pack.readAll(), sig.readAll(),
+                    QFileInfo(dir.filePath("pubkey"))))
+      ++failed;
+  }
+  cost = since(start);
+  print<GeneralInfoCtrl>(std::cout, "verify hops:", edges, "seconds:", cost,
+                         "per second:", edges / cost, "failed:", failed);
+
+  // Two process spawns and a hash file per pack.
+  int spawned = scheme == SigScheme::RsaSha256 ? std::min(edges, 20) : 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < spawned; ++i) {
+    QFile pack(dir.filePath(QString::number(i) + ".tar.gz"));
+    pack.open(QFile::ReadOnly);
+    QFile hash(dir.filePath("hash"));
+    hash.open(QFile::WriteOnly | QFile::Truncate);
+    hash.write(QCryptographicHash::hash(pack.readAll(), kHashAlgorithm));
+    hash.close();
+    std::string base = dir.absolutePath().toStdString() + "/";
+    std::string cmd = "openssl dgst -sha256 -sign " + base + "prikey -out " +
+                      base + "cli_sig " + base + "hash && openssl dgst " +
+                      "-sha256 -verify " + base + "pubkey -signature " + base +
+                      "cli_sig " + base + "hash > /dev/null";
+    system(cmd.c_str());
+  }
+  cost = since(start);
+  if (spawned > 0)
+    print<GeneralInfoCtrl>(std::cout, "openssl command sign+verify:", spawned,
+                           "seconds:", cost, "per second:", spawned / cost);
+  dir.removeRecursively();
+}
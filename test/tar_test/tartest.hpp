@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+
+#include "../../otalib/logger/logger.h"
+#include "../../otalib/tar_archive.h"
+
+using namespace otalib;
+
+// Write an archive in memory and read it back, piece by piece and at once.
+// The content compresses well and isn't a multiple of the buffer of the
+// reader, so the reader takes more output than input from zlib.
+bool test_tar_roundtrip() {
+  std::string big(3 * 1024 * 1024 + 12345, '\0');
+  for (size_t i = 0; i < big.size(); ++i) big[i] = static_cast<char>(i / 4096);
+  std::string small = "apply_log\n1.0.0-1.0.1\n";
+  std::string longName(150, 'n');
+
+  QByteArray archive;
+  TarGzWriter writer([&archive](const char* data, size_t size) {
+    archive.append(data, static_cast<int>(size));
+  });
+  writer.addDirectory("./pack");
+  writer.addFile("./pack/big", big.data(), big.size());
+  writer.addFile("./pack/" + longName, small.data(), small.size());
+  writer.finish();
+
+  for (size_t piece : {size_t(archive.size()), size_t(1), size_t(1000),
+                       size_t(64 * 1024)}) {
+    std::map<std::string, std::string> files;
+    std::string current;
+    TarGzReader reader;
+    reader.setEntryCallback([&current](const TarEntry&) { current.clear(); });
+    reader.setDataCallback(
+        [&current](const TarEntry&, const char* data, size_t size) {
+          current.append(data, size);
+        });
+    reader.setEndCallback([&files, &current](const TarEntry& entry) {
+      if (entry.type_ == TarEntry::File) files[entry.name_] = current;
+    });
+    for (int off = 0; off < archive.size(); off += static_cast<int>(piece))
+      reader.feed(archive.constData() + off,
+                  std::min<size_t>(piece, archive.size() - off));
+
+    bool succ = reader.finished() && files.size() == 2 &&
+                files["./pack/big"] == big &&
+                files["./pack/" + longName] == small;
+    if (!succ) {
+      print<GeneralErrorCtrl>(std::cerr, "Round trip failed, piece:", piece);
+      return false;
+    }
+  }
+  print<GeneralSuccessCtrl>(std::cout, "Round trip succeed, archive bytes:",
+                            archive.size());
+  return true;
+}
+
+// The same content written twice, a second apart, gives the same bytes.
+bool test_tar_deterministic() {
+  auto build = [] {
+    QByteArray archive;
+    TarGzWriter writer([&archive](const char* data, size_t size) {
+      archive.append(data, static_cast<int>(size));
+    });
+    std::string log = "1.0.0-1.0.1.tar.gz|1.0.1_hash|1.0.0-1.0.1_sig\n";
+    writer.addDirectory(".");
+    writer.addFile("./apply_log", log.data(), log.size());
+    writer.finish();
+    return archive;
+  };
+  QByteArray first = build();
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  if (build() != first) {
+    print<GeneralErrorCtrl>(std::cerr, "Archive differs between runs.");
+    return false;
+  }
+  return true;
+}
@@ -1,5 +1,11 @@
+#include <string.h>
+
+#include <QDir>
+#include <QFile>
+
 #include "../../otalib/logger/logger.h"
 #include "../../otalib/vcm.hpp"
+#include "../../otalib/vermap_index.h"
 
 using namespace otalib;
 
@@ -59,3 +65,228 @@ void test_vcm() {
     print<GeneralErrorCtrl>(std::cout, "[" + i.first.toString() + "]->[" +
                                            i.second.toString() + "]");
 }
+
+// The pack of an edge on level 0 is small, the others are large, so the
+// cheapest route keeps to level 0 longer than the one of the fewest hops.
+uint64_t edgeBytes(const GeneralVersion& prev, const GeneralVersion& next) {
+  GeneralVersion diff = prev < next ? GeneralVersion::minus(next, prev)
+                                    : GeneralVersion::minus(prev, next);
+  return diff == GeneralVersion("0.0.1") ? 10 : 1000;
+}
+
+void test_vcm_cost() {
+  VersionMap<GeneralVersion> vm;
+  vm.setCostCallback<uint64_t(const GeneralVersion&, const GeneralVersion&)>(
+      edgeBytes);
+  GeneralVersion vbase("0.0.1");
+  auto vcur = vbase;
+  for (uint64_t i = 0; i < 100; i++) {
+    vm.append(vcur, true);
+    vcur = GeneralVersion::add(vcur, vbase);
+  }
+
+  GeneralVersion s("0.0.1"), d("0.9.9");
+  auto r = vm.search<SearchStrategy::vUpdate>(s, d);
+  uint64_t bytes = 0;
+  for (const auto& [prev, next] : r) bytes += edgeBytes(prev, next);
+  print<GeneralInfoCtrl>(std::cout, "hops:", r.size(), "bytes:", bytes);
+  // The same route every time.
+  bool same = r == vm.search<SearchStrategy::vUpdate>(s, d);
+  print<GeneralInfoCtrl>(std::cout, "deterministic:", same);
+}
+
+// More versions than one segment holds, the routes stay short.
+void test_vcm_growth() {
+  VersionMap<GeneralVersion> vm;
+  GeneralVersion vbase("0.0.1");
+  auto vcur = vbase;
+  std::vector<GeneralVersion> vers;
+  for (uint64_t i = 0; i < 10 * GeneralVersion::vcm_capacity; i++) {
+    if (!vm.append(vcur, true)) {
+      print<GeneralErrorCtrl>(std::cout, "append failed at", i);
+      return;
+    }
+    vers.push_back(vcur);
+    vcur = GeneralVersion::add(vcur, vbase);
+  }
+
+  size_t maxHops = 0;
+  uint64_t fail = 0;
+  for (uint64_t i = 0; i < 1000; ++i) {
+    auto s = vers[rand() % vers.size()];
+    auto d = vers[rand() % vers.size()];
+    if (s == d) continue;
+    auto r = s < d ? vm.search<SearchStrategy::vUpdate>(s, d)
+                   : vm.search<SearchStrategy::vRollback>(s, d);
+    if (r.empty()) ++fail;
+    maxHops = std::max(maxHops, r.size());
+  }
+  print<GeneralInfoCtrl>(std::cout, "versions:", vers.size(),
+                         "max hops:", maxHops, "fail:", fail);
+}
+
+// The jobs of edge generation are kept until run() is called, so the states
+// in between are seen.
+class DeferredExecutor {
+ public:
+  void operator()(std::function<void()> job) {
+    jobs_.push_back(std::move(job));
+  }
+  void run() {
+    auto jobs = std::move(jobs_);
+    jobs_.clear();
+    for (auto& job : jobs) job();
+  }
+
+ private:
+  std::vector<std::function<void()>> jobs_;
+};
+
+bool test_vcm_async() {
+  using State = VersionMap<GeneralVersion>::EdgeState;
+  DeferredExecutor executor;
+  VersionMap<GeneralVersion> vm;
+  vm.setExecutor([&executor](std::function<void()> job) {
+    executor(std::move(job));
+  });
+  // The packs of 0.0.5 can't be generated.
+  GeneralVersion bad("0.0.5");
+  vm.setCallback([&bad](const GeneralVersion&, const GeneralVersion& next) {
+    return next != bad;
+  });
+
+  GeneralVersion v1("0.0.1"), v2("0.0.2"), v3("0.0.3"), v4("0.0.4");
+  vm.append(v1, true);
+  vm.append(v2, true);
+  vm.append(v3, true);
+  vm.append(v4);
+
+  bool succ = vm.edgeState(v3, v4) == State::Pending &&
+              vm.search<SearchStrategy::vUpdate>(v1, v4).empty() &&
+              vm.newest() == v3;
+  executor.run();
+  succ = succ && vm.edgeState(v3, v4) == State::Ready &&
+         !vm.search<SearchStrategy::vUpdate>(v1, v4).empty() &&
+         vm.newest() == v4;
+
+  vm.append(bad);
+  executor.run();
+  succ = succ && vm.edgeState(v4, bad) == State::Failed &&
+         vm.search<SearchStrategy::vUpdate>(v1, bad).empty() &&
+         vm.newest() == v4;
+  if (!succ) print<GeneralErrorCtrl>(std::cerr, "Async edges failed.");
+  return succ;
+}
+
+// A route is cached until the map changes.
+bool test_vcm_route_cache() {
+  VersionMap<GeneralVersion> vm;
+  GeneralVersion vbase("0.0.1");
+  auto vcur = vbase;
+  for (uint64_t i = 0; i < 100; i++) {
+    vm.append(vcur, true);
+    vcur = GeneralVersion::add(vcur, vbase);
+  }
+
+  GeneralVersion s("0.0.1"), d("0.9.9");
+  auto before = vm.routeCacheStats();
+  auto r = vm.search<SearchStrategy::vUpdate>(s, d);
+  bool succ = r == vm.search<SearchStrategy::vUpdate>(s, d);
+  auto after = vm.routeCacheStats();
+  succ = succ && after.misses_ == before.misses_ + 1 &&
+         after.hits_ == before.hits_ + 1;
+
+  // A new version bumps the generation, the route is found again.
+  vm.append(vcur, true);
+  succ = succ && r == vm.search<SearchStrategy::vUpdate>(s, d);
+  before = after;
+  after = vm.routeCacheStats();
+  succ = succ && after.misses_ == before.misses_ + 1 &&
+         after.hits_ == before.hits_;
+
+  // Without the cache every search misses.
+  vm.setRouteCacheCapacity(0);
+  vm.search<SearchStrategy::vUpdate>(s, d);
+  vm.search<SearchStrategy::vUpdate>(s, d);
+  before = after;
+  after = vm.routeCacheStats();
+  succ = succ && after.size_ == 0 && after.hits_ == before.hits_;
+  if (!succ) print<GeneralErrorCtrl>(std::cerr, "Route cache failed.");
+  return succ;
+}
+
+// Write an index and map it back, then break a byte of it.
+bool test_vermap_index() {
+  QString path = QDir::temp().filePath("vcmtest.vmi");
+  std::vector<VerMapIndex::Version> versions(3);
+  versions[0].name_ = "1.0.0";
+  versions[1].name_ = "1.0.1";
+  versions[2].name_ = "1.0.2";
+  for (size_t i = 0; i < versions.size(); ++i)
+    memset(versions[i].hash_, static_cast<int>(i + 1), 32);
+  std::vector<VerMapEdgeRecord> edges(2);
+  edges[0] = VerMapEdgeRecord{0, 1, 1, 0, 100, 200, {0}, {0}};
+  edges[1] = VerMapEdgeRecord{1, 2, 2, 0, 300, 0, {0}, {0}};
+  memset(edges[0].update_hash, 0xab, 32);
+  if (!VerMapIndex::Write(path, versions, edges)) {
+    print<GeneralErrorCtrl>(std::cerr, "Index write failed.");
+    return false;
+  }
+
+  bool succ;
+  {
+    VerMapIndex index;
+    succ = index.open(path) && index.versionCount() == 3 &&
+           index.edgeCount() == 2;
+    for (size_t i = 0; succ && i < versions.size(); ++i)
+      succ = index.name(i) == versions[i].name_ &&
+             memcmp(index.version(i).hash, versions[i].hash_, 32) == 0;
+    for (size_t i = 0; succ && i < edges.size(); ++i)
+      succ = memcmp(&index.edge(i), &edges[i], sizeof(VerMapEdgeRecord)) == 0;
+  }
+
+  // The crc covers everything after the header.
+  QFile file(path);
+  if (succ && file.open(QIODevice::ReadWrite)) {
+    file.seek(sizeof(VerMapIndexHeader) + 1);
+    char c;
+    file.getChar(&c);
+    file.seek(sizeof(VerMapIndexHeader) + 1);
+    file.putChar(static_cast<char>(c ^ 0xff));
+    file.close();
+    VerMapIndex index;
+    succ = !index.open(path);
+  }
+  QFile::remove(path);
+  if (!succ) print<GeneralErrorCtrl>(std::cerr, "Index round trip failed.");
+  return succ;
+}
+
+// The edges linking the segments failed, the far versions are still linked
+// by the others.
+bool test_vcm_far_route() {
+  std::map<QString, uint64_t> indexes;
+  VersionMap<GeneralVersion> vm;
+  vm.setCallback([&indexes](const GeneralVersion& prev,
+                            const GeneralVersion& next) {
+    return indexes[next.toString()] - indexes[prev.toString()] <
+           GeneralVersion::vcm_capacity;
+  });
+  GeneralVersion vbase("0.0.1");
+  auto vcur = vbase;
+  std::vector<GeneralVersion> vers;
+  for (uint64_t i = 0; i < 5 * GeneralVersion::vcm_capacity; i++) {
+    indexes[vcur.toString()] = i;
+    vm.append(vcur);
+    vers.push_back(vcur);
+    vcur = GeneralVersion::add(vcur, vbase);
+  }
+
+  auto s = vers[5];
+  auto d = vers[4 * GeneralVersion::vcm_capacity + 5];
+  auto r = vm.search<SearchStrategy::vUpdate>(s, d);
+  bool succ = !r.empty() && r.front().first == s && r.back().second == d &&
+              !vm.search<SearchStrategy::vRollback>(d, s).empty();
+  if (!succ) print<GeneralErrorCtrl>(std::cerr, "Far route failed.");
+  return succ;
+}
@@ -8,9 +8,18 @@ using namespace otalib;
 using namespace otalib::app;
 int main(int argc, char* argv[]) {
   QCoreApplication a(argc, argv);
+  QCommandLineOption op_rollback("r");
+
+  QCommandLineParser parser;
+  parser.addOption(op_rollback);
+  parser.process(a);
+
   UpdateModule um;
   try {
-    um.TryUpdate();
+    if (parser.isSet(op_rollback))
+      um.TryLocalRollback();
+    else
+      um.TryUpdate();
   } catch (::std::exception& e) {
     print<GeneralFerrorCtrl>(::std::cerr, e.what());
     print<GeneralFerrorCtrl>(::std::cerr, "Update(Rollback) failed. Press[Enter] to quit.");